@@ -0,0 +1,238 @@
+//
+// cloRedis counter aggregator class implementation
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include "internal/log.h"
+#include "aggregator.h"
+
+namespace cloris {
+
+RedisCounterAggregator::RedisCounterAggregator(RedisManager* manager, int db, const AggregatorOption* option)
+    : manager_(manager),
+      db_(db),
+      stopping_(false),
+      pending_(0),
+      merged_(0),
+      refused_(0),
+      flushed_(0),
+      failed_(0) {
+    if (option) {
+        option_ = *option;
+    }
+    option_.batch_size = std::max(option_.batch_size, 1);
+    flush_thread_ = std::thread(&RedisCounterAggregator::FlushLoop, this);
+    cLog(TRACE, "RedisCounterAggregator constructor ");
+}
+
+RedisCounterAggregator::~RedisCounterAggregator() {
+    this->Stop();
+    cLog(TRACE, "RedisCounterAggregator ~ destructor");
+}
+
+void RedisCounterAggregator::Stop() {
+    {
+        std::lock_guard<std::mutex> lk(wake_mtx_);
+        stopping_ = true;
+    }
+    // an increment that saw 'stopping_' false is in its stripe once the lock is released
+    for (auto& stripe : stripes_) {
+        std::lock_guard<std::mutex> lk(stripe.mutex);
+    }
+    wake_.notify_all();
+    if (flush_thread_.joinable()) {
+        flush_thread_.join();
+    }
+    this->Flush();
+}
+
+RedisCounterAggregator::Stripe* RedisCounterAggregator::StripeOf(const std::string& key) {
+    return &stripes_[std::hash<std::string>()(key) % AGGREGATOR_STRIPES];
+}
+
+bool RedisCounterAggregator::IncrBy(const std::string& key, int64_t delta) {
+    Stripe* stripe = StripeOf(key);
+    bool crossed = false;
+    {
+        std::lock_guard<std::mutex> lk(stripe->mutex);
+        // checked under the stripe lock, Stop() waits on it before the last flush
+        if (stopping_) {
+            return false;
+        }
+        auto iter = stripe->incrs.find(key);
+        if (iter != stripe->incrs.end()) {
+            iter->second += delta;
+        } else if (pending_ >= option_.max_pending) {
+            ++refused_;
+            return false;
+        } else {
+            stripe->incrs.emplace(key, delta);
+            // each value is taken by one caller only, so exactly one sees the crossing
+            crossed = (++pending_ == option_.flush_threshold);
+        }
+    }
+    this->Added(crossed);
+    return true;
+}
+
+bool RedisCounterAggregator::HIncrBy(const std::string& key, const std::string& field, int64_t delta) {
+    Stripe* stripe = StripeOf(key);
+    bool crossed = false;
+    {
+        std::lock_guard<std::mutex> lk(stripe->mutex);
+        if (stopping_) {
+            return false;
+        }
+        auto iter = stripe->hincrs.find(key);
+        if (iter != stripe->hincrs.end() && iter->second.count(field)) {
+            iter->second[field] += delta;
+        } else if (pending_ >= option_.max_pending) {
+            ++refused_;
+            return false;
+        } else {
+            stripe->hincrs[key].emplace(field, delta);
+            crossed = (++pending_ == option_.flush_threshold);
+        }
+    }
+    this->Added(crossed);
+    return true;
+}
+
+void RedisCounterAggregator::Added(bool crossed) {
+    ++merged_;
+    if (crossed) {
+        // taking 'wake_mtx_' keeps the notify out of the gap between the flush
+        // thread checking 'pending_' and going to wait
+        {
+            std::lock_guard<std::mutex> lk(wake_mtx_);
+        }
+        wake_.notify_one();
+    }
+}
+
+void RedisCounterAggregator::FlushLoop() {
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(wake_mtx_);
+            wake_.wait_for(lk, std::chrono::milliseconds(option_.flush_interval_ms), [this]() {
+                return stopping_ || pending_ >= option_.flush_threshold;
+            });
+            if (stopping_) {
+                break;
+            }
+        }
+        this->Flush();
+    }
+}
+
+bool RedisCounterAggregator::Flush() {
+    std::lock_guard<std::mutex> flush_lk(flush_mtx_);
+    bool ok = true;
+    std::vector<Counter> batch;
+    batch.reserve(option_.batch_size);
+    for (int i = 0; i < AGGREGATOR_STRIPES; ++i) {
+        // take the stripe as a whole, callers merge into empty maps meanwhile
+        Stripe taken;
+        {
+            std::lock_guard<std::mutex> lk(stripes_[i].mutex);
+            taken.incrs.swap(stripes_[i].incrs);
+            taken.hincrs.swap(stripes_[i].hincrs);
+        }
+        for (auto& item : taken.incrs) {
+            batch.push_back(Counter{&item.first, NULL, item.second});
+            if ((int)batch.size() == option_.batch_size) {
+                ok = this->SendBatch(batch) && ok;
+                batch.clear();
+            }
+        }
+        for (auto& hash : taken.hincrs) {
+            for (auto& item : hash.second) {
+                batch.push_back(Counter{&hash.first, &item.first, item.second});
+                if ((int)batch.size() == option_.batch_size) {
+                    ok = this->SendBatch(batch) && ok;
+                    batch.clear();
+                }
+            }
+        }
+        // the pointers of 'batch' must not outlive 'taken'
+        if (!batch.empty()) {
+            ok = this->SendBatch(batch) && ok;
+            batch.clear();
+        }
+    }
+    return ok;
+}
+
+bool RedisCounterAggregator::SendBatch(const std::vector<Counter>& batch) {
+    pending_ -= batch.size();
+    RedisConnection conn = manager_->Get(db_);
+    if (!conn) {
+        failed_ += batch.size();
+        cLog(ERROR, "counters lost, no connection to master");
+        return false;
+    }
+    if (option_.reply_off && !conn->BeginNoReply()) {
+        failed_ += batch.size();
+        return false;
+    }
+    for (auto& counter : batch) {
+        std::string delta = std::to_string(counter.delta);
+        const char* argv[4];
+        size_t argvlen[4];
+        int argc = 0;
+        argv[argc] = counter.field ? "HINCRBY" : "INCRBY";
+        argvlen[argc] = strlen(argv[argc]);
+        ++argc;
+        argv[argc] = counter.key->data();
+        argvlen[argc++] = counter.key->size();
+        if (counter.field) {
+            argv[argc] = counter.field->data();
+            argvlen[argc++] = counter.field->size();
+        }
+        argv[argc] = delta.data();
+        argvlen[argc++] = delta.size();
+        if (!conn->AppendArgv(argc, argv, argvlen)) {
+            failed_ += batch.size();
+            return false;
+        }
+    }
+    uint64_t failed = 0;
+    if (option_.reply_off) {
+        // the reply of 'CLIENT REPLY ON' tells the whole batch was read by redis
+        if (!conn->EndNoReply()) {
+            failed = batch.size();
+        }
+    } else {
+        // a broken connection gives up the replies left, their commands count as lost
+        uint64_t written = 0;
+        while (conn->pending_replies() > 0) {
+            RedisReply reply = conn->GetReply();
+            if (reply.is_int()) {
+                ++written;
+            } else {
+                cLog(ERROR, "counter not written: %s", reply.err_str().c_str());
+            }
+        }
+        failed = batch.size() - written;
+    }
+    flushed_ += batch.size() - failed;
+    failed_ += failed;
+    return failed == 0;
+}
+
+AggregatorStats RedisCounterAggregator::stats() const {
+    AggregatorStats stats;
+    stats.merged = merged_;
+    stats.refused = refused_;
+    stats.flushed = flushed_;
+    stats.failed = failed_;
+    stats.pending = pending_;
+    return stats;
+}
+
+} // namespace cloris
@@ -0,0 +1,114 @@
+//
+// cloRedis counter aggregator class definition
+// RedisCounterAggregator merges INCRBY/HINCRBY per key in process and writes
+// the sums behind the caller: a flush thread sends them as pipelined batches
+// every 'flush_interval_ms', or sooner once 'flush_threshold' counters are
+// pending. Counters are spread over AGGREGATOR_STRIPES maps, each with its own
+// lock, so callers of different keys don't contend.
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#ifndef CLORIS_CLOREDIS_AGGREGATOR_H_
+#define CLORIS_CLOREDIS_AGGREGATOR_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "cloredis.h"
+
+#define AGGREGATOR_STRIPES 16
+#define DEFAULT_AGGREGATOR_FLUSH_INTERVAL_MS 100
+#define DEFAULT_AGGREGATOR_FLUSH_THRESHOLD 10000
+#define DEFAULT_AGGREGATOR_MAX_PENDING 1000000
+#define DEFAULT_AGGREGATOR_BATCH_SIZE 1000
+
+namespace cloris {
+
+struct AggregatorOption {
+    AggregatorOption()
+        : flush_interval_ms(DEFAULT_AGGREGATOR_FLUSH_INTERVAL_MS),
+          flush_threshold(DEFAULT_AGGREGATOR_FLUSH_THRESHOLD),
+          max_pending(DEFAULT_AGGREGATOR_MAX_PENDING),
+          batch_size(DEFAULT_AGGREGATOR_BATCH_SIZE),
+          reply_off(false) {
+    }
+
+    int flush_interval_ms;
+    // pending counters which wake the flush thread before its interval
+    int64_t flush_threshold;
+    // bound on pending counters, an increment of a counter not pending yet is
+    // refused beyond it
+    int64_t max_pending;
+    // commands per pipeline
+    int batch_size;
+    // send batches under 'CLIENT REPLY OFF': no reply is read, so a failed
+    // command goes unnoticed
+    bool reply_off;
+};
+
+struct AggregatorStats {
+    uint64_t merged;        // increments taken
+    uint64_t refused;       // increments refused for 'max_pending'
+    uint64_t flushed;       // commands sent
+    uint64_t failed;        // commands lost to a broken connection or an error reply
+    int64_t pending;        // counters not sent yet
+};
+
+class RedisCounterAggregator {
+public:
+    // 'manager' must outlive the aggregator, counters are written to master of 'db'
+    RedisCounterAggregator(RedisManager* manager, int db = DEFAULT_DB, const AggregatorOption* option = NULL);
+    // flushes what is pending
+    ~RedisCounterAggregator();
+
+    // false if refused for 'max_pending' or after 'Stop'
+    bool IncrBy(const std::string& key, int64_t delta);
+    bool HIncrBy(const std::string& key, const std::string& field, int64_t delta);
+    // send the pending counters now, false if any command was lost
+    bool Flush();
+    // stop the flush thread and flush the pending counters
+    void Stop();
+
+    AggregatorStats stats() const;
+private:
+    struct Stripe {
+        std::mutex mutex;
+        std::unordered_map<std::string, int64_t> incrs;
+        std::unordered_map<std::string, std::unordered_map<std::string, int64_t>> hincrs;
+    };
+    // one command of a flush
+    struct Counter {
+        const std::string* key;
+        const std::string* field;   // NULL for INCRBY
+        int64_t delta;
+    };
+
+    Stripe* StripeOf(const std::string& key);
+    // 'crossed' tells the increment took 'pending_' to the flush threshold
+    void Added(bool crossed);
+    void FlushLoop();
+    bool SendBatch(const std::vector<Counter>& batch);
+
+    RedisManager* manager_;
+    const int db_;
+    AggregatorOption option_;
+    Stripe stripes_[AGGREGATOR_STRIPES];
+    std::mutex flush_mtx_;                  // one flush at a time
+    std::mutex wake_mtx_;
+    std::condition_variable wake_;
+    std::thread flush_thread_;
+    std::atomic<bool> stopping_;
+    std::atomic<int64_t> pending_;
+    std::atomic<uint64_t> merged_;
+    std::atomic<uint64_t> refused_;
+    std::atomic<uint64_t> flushed_;
+    std::atomic<uint64_t> failed_;
+};
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_AGGREGATOR_H_
@@ -0,0 +1,97 @@
+//
+// Bulk SET throughput of a pipeline reading every reply against the same
+// batches sent fire-and-forget under 'CLIENT REPLY OFF'
+//
+// usage: no_reply_bench [host] [keys] [batch] [value_bytes] [password]
+//   e.g. no_reply_bench 127.0.0.1:6379 1000000 1000 64
+//
+
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "cloredis.h"
+
+using namespace cloris;
+
+static const char* g_host     = "127.0.0.1:6379";
+static const char* g_password = "";
+static int g_keys        = 1000000;
+static int g_batch       = 1000;
+static int g_value_bytes = 64;
+static int g_timeout_ms  = 5000;
+
+// seconds to SET 'g_keys' keys in batches, negative on error
+static double RunBatches(RedisManager* manager, bool reply_off) {
+    std::string value(g_value_bytes, 'v');
+    std::vector<std::vector<std::string>> commands;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < g_keys; i += g_batch) {
+        commands.clear();
+        for (int j = i; j < std::min(i + g_batch, g_keys); ++j) {
+            commands.push_back({"SET", "bench_key:" + std::to_string(j), value});
+        }
+        if (reply_off) {
+            std::string err;
+            if (!manager->DoNoReply(DEFAULT_DB, commands, &err)) {
+                std::cout << "fire-and-forget batch failed: " << err << std::endl;
+                return -1;
+            }
+            continue;
+        }
+        RedisConnection conn = manager->Get();
+        for (auto& command : commands) {
+            conn->AppendArgv(command);
+        }
+        while (conn->pending_replies() > 0) {
+            if (!conn->GetReply().ok()) {
+                std::cout << "pipelined SET failed: " << conn->err_str() << std::endl;
+                return -1;
+            }
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+}
+
+static void Report(const std::string& name, double seconds) {
+    if (seconds < 0) {
+        return;
+    }
+    double mb = (double)g_keys * (g_value_bytes + 40) / (1 << 20);
+    std::cout << name
+              << "  " << seconds << " s"
+              << "  " << (int64_t)(g_keys / seconds) << " keys/s"
+              << "  ~" << mb / seconds << " MB/s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        g_host = argv[1];
+    }
+    if (argc > 2) {
+        g_keys = std::max(atoi(argv[2]), 1);
+    }
+    if (argc > 3) {
+        g_batch = std::max(atoi(argv[3]), 1);
+    }
+    if (argc > 4) {
+        g_value_bytes = std::max(atoi(argv[4]), 1);
+    }
+    if (argc > 5) {
+        g_password = argv[5];
+    }
+    std::unique_ptr<RedisManager> manager(new RedisManager());
+    std::string err;
+    if (!manager->Init(g_host, g_password, g_timeout_ms, NULL, &err)) {
+        std::cout << "init " << g_host << " failed: " << err << std::endl;
+        return 1;
+    }
+    std::cout << g_keys << " SET of " << g_value_bytes << " bytes in batches of " << g_batch << std::endl;
+    Report("replies  ", RunBatches(manager.get(), false));
+    Report("reply off", RunBatches(manager.get(), true));
+    return 0;
+}
@@ -0,0 +1,147 @@
+//
+// Keyspace scan speed: a blocking SCAN loop, RedisScan prefetching the next
+// page, and ParallelScan over several connections. Keys 'scan_bench:<n>' are
+// loaded first if the DB has fewer keys, and left there for the next run
+//
+// usage: scan_bench [host] [keys] [count] [parallelism] [db] [password]
+//   e.g. scan_bench 127.0.0.1:6379 10000000 1000 8
+//
+
+#include <stdlib.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "cloredis.h"
+#include "scan.h"
+
+using namespace cloris;
+
+static const char* g_host     = "127.0.0.1:6379";
+static const char* g_password = "";
+static int g_keys        = 10000000;
+static int g_count       = 1000;
+static int g_parallelism = 8;
+static int g_db          = DEFAULT_DB;
+static int g_timeout_ms  = 5000;
+
+static double Seconds(std::chrono::steady_clock::time_point start) {
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1e6;
+}
+
+static bool Load(RedisManager* manager) {
+    int64_t size = manager->Do(g_db, "DBSIZE").toInt64();
+    if (size >= g_keys) {
+        return true;
+    }
+    std::cout << "loading " << g_keys << " keys" << std::endl;
+    std::vector<std::vector<std::string>> commands;
+    for (int i = 0; i < g_keys; i += 10000) {
+        commands.clear();
+        for (int j = i; j < std::min(i + 10000, g_keys); ++j) {
+            commands.push_back({"SET", "scan_bench:" + std::to_string(j), "v"});
+        }
+        std::string err;
+        if (!manager->DoNoReply(g_db, commands, &err)) {
+            std::cout << "load failed: " << err << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// the cursor loop written by hand, one round trip per page
+static void RunBlocking(RedisManager* manager) {
+    auto start = std::chrono::steady_clock::now();
+    RedisConnection conn = manager->Get(g_db);
+    std::string cursor = "0";
+    uint64_t keys = 0;
+    do {
+        RedisReply reply = conn->Do("SCAN %s COUNT %d", cursor.c_str(), g_count);
+        if (!reply.is_array() || reply.size() != 2) {
+            std::cout << "SCAN failed: " << reply.err_str() << std::endl;
+            return;
+        }
+        cursor = reply[0].toString();
+        keys += reply[1].size();
+    } while (cursor != "0");
+    double seconds = Seconds(start);
+    std::cout << "blocking loop   " << keys << " keys  " << seconds << " s  "
+              << (int64_t)(keys / seconds) << " keys/s" << std::endl;
+}
+
+static void RunPrefetch(RedisManager* manager) {
+    auto start = std::chrono::steady_clock::now();
+    ScanOption option;
+    option.count = g_count;
+    RedisScan scan = RedisScan::Keys(manager, g_db, &option);
+    uint64_t keys = 0;
+    for (const ScanEntry& entry : scan) {
+        (void)entry;
+        ++keys;
+    }
+    if (!scan.ok()) {
+        std::cout << "RedisScan failed: " << scan.err_str() << std::endl;
+        return;
+    }
+    double seconds = Seconds(start);
+    std::cout << "prefetch        " << keys << " keys  " << seconds << " s  "
+              << (int64_t)(keys / seconds) << " keys/s" << std::endl;
+}
+
+static void RunParallel(RedisManager* manager) {
+    auto start = std::chrono::steady_clock::now();
+    ScanOption option;
+    option.count = g_count;
+    std::atomic<uint64_t> keys(0);
+    std::string err;
+    bool ok = ParallelScan(manager, g_db, g_parallelism, &option, [&keys](const std::vector<ScanEntry>& page) {
+        keys += page.size();
+    }, &err);
+    if (!ok) {
+        std::cout << "ParallelScan failed: " << err << std::endl;
+        return;
+    }
+    double seconds = Seconds(start);
+    std::cout << "parallel x" << g_parallelism << "     " << keys << " keys  " << seconds << " s  "
+              << (int64_t)(keys / seconds) << " keys/s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        g_host = argv[1];
+    }
+    if (argc > 2) {
+        g_keys = std::max(atoi(argv[2]), 1);
+    }
+    if (argc > 3) {
+        g_count = std::max(atoi(argv[3]), 1);
+    }
+    if (argc > 4) {
+        g_parallelism = std::max(atoi(argv[4]), 1);
+    }
+    if (argc > 5) {
+        g_db = atoi(argv[5]);
+    }
+    if (argc > 6) {
+        g_password = argv[6];
+    }
+    std::unique_ptr<RedisManager> manager(new RedisManager());
+    std::string err;
+    if (!manager->Init(g_host, g_password, g_timeout_ms, NULL, &err)) {
+        std::cout << "init " << g_host << " failed: " << err << std::endl;
+        return 1;
+    }
+    if (!Load(manager.get())) {
+        return 1;
+    }
+    std::cout << "SCAN COUNT " << g_count << " over DB " << g_db << std::endl;
+    RunBlocking(manager.get());
+    RunPrefetch(manager.get());
+    RunParallel(manager.get());
+    return 0;
+}
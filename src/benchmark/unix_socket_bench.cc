@@ -0,0 +1,94 @@
+//
+// Latency of a co-located redis over loopback TCP against a unix socket
+//
+// usage: unix_socket_bench [tcp_host] [unix_endpoint] [requests] [password]
+//   e.g. unix_socket_bench 127.0.0.1:6379 unix:///tmp/redis.sock 100000
+// Redis must listen on both, e.g. 'unixsocket /tmp/redis.sock' in redis.conf.
+//
+
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "cloredis.h"
+
+using namespace cloris;
+
+static const char* g_tcp_host  = "127.0.0.1:6379";
+static const char* g_unix_host = "unix:///tmp/redis.sock";
+static const char* g_password  = "";
+static int g_requests   = 100000;
+static int g_timeout_ms = 1000;
+
+// latency of every request in ns, empty if the endpoint can't be used
+static std::vector<int64_t> RunRequests(const std::string& host) {
+    std::vector<int64_t> latencies;
+    std::unique_ptr<RedisManager> manager(new RedisManager());
+    std::string err;
+    if (!manager->Init(host, g_password, g_timeout_ms, NULL, &err)) {
+        std::cout << "init " << host << " failed: " << err << std::endl;
+        return latencies;
+    }
+    RedisConnection conn = manager->Get();
+    if (!conn || !conn->Do("SET bench_key %s", "0123456789abcdef").ok()) {
+        std::cout << "SET on " << host << " failed" << std::endl;
+        return latencies;
+    }
+    // warm up both sides before timing
+    for (int i = 0; i < 1000; ++i) {
+        conn->Do("GET bench_key");
+    }
+    latencies.reserve(g_requests);
+    for (int i = 0; i < g_requests; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        RedisReply reply = conn->Do("GET bench_key");
+        auto end = std::chrono::steady_clock::now();
+        if (reply.error()) {
+            std::cout << "GET on " << host << " failed: " << reply.err_str() << std::endl;
+            latencies.clear();
+            break;
+        }
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+    }
+    return latencies;
+}
+
+static void Report(const std::string& name, std::vector<int64_t> latencies) {
+    if (latencies.empty()) {
+        return;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    int64_t total = 0;
+    for (auto ns : latencies) {
+        total += ns;
+    }
+    size_t n = latencies.size();
+    std::cout << name
+              << "  avg " << total / (int64_t)n / 1000.0 << " us"
+              << "  p50 " << latencies[n / 2] / 1000.0 << " us"
+              << "  p99 " << latencies[n * 99 / 100] / 1000.0 << " us"
+              << "  p99.9 " << latencies[n * 999 / 1000] / 1000.0 << " us"
+              << "  qps " << (int64_t)(n * 1e9 / total) << std::endl;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) {
+        g_tcp_host = argv[1];
+    }
+    if (argc > 2) {
+        g_unix_host = argv[2];
+    }
+    if (argc > 3) {
+        g_requests = std::max(atoi(argv[3]), 1);
+    }
+    if (argc > 4) {
+        g_password = argv[4];
+    }
+    std::cout << g_requests << " GET requests one by one on one connection" << std::endl;
+    Report("tcp ", RunRequests(g_tcp_host));
+    Report("unix", RunRequests(g_unix_host));
+    return 0;
+}
@@ -0,0 +1,426 @@
+//
+// cloRedis bulk loader class implementation
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include "hiredis/hiredis.h"
+#include "internal/log.h"
+#include "bulkloader.h"
+
+#define BULK_READ_BYTES (64 << 10)
+#define BULK_POLL_MS 100
+
+namespace cloris {
+
+// encoded commands, sent as a whole by one connection
+struct RedisBulkLoader::Buffer {
+    std::string data;
+    int64_t commands;
+};
+
+struct RedisBulkLoader::Worker {
+    Worker() : context(NULL), failed(false), done(false), closed(false) { }
+    ~Worker() {
+        if (context) {
+            redisFree(context);
+        }
+    }
+
+    redisContext* context;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::unique_ptr<Buffer>> queue;  // at most BULK_QUEUE_BUFFERS
+    std::atomic<bool> failed;
+    std::atomic<bool> done;                     // 'Run' returned
+    bool closed;                                // no more buffers will come
+    std::string err;
+};
+
+// append 'args' to 'out' in RESP
+static void encode_command(const std::vector<std::string>& args, std::string* out) {
+    char head[32];
+    out->append(head, snprintf(head, sizeof(head), "*%zu\r\n", args.size()));
+    for (auto& arg : args) {
+        out->append(head, snprintf(head, sizeof(head), "$%zu\r\n", arg.size()));
+        out->append(arg);
+        out->append("\r\n", 2);
+    }
+}
+
+BulkSource bulk_file_source(FILE* file, int db, bool db_column) {
+    std::shared_ptr<std::string> line = std::make_shared<std::string>();
+    return [file, db, db_column, line](BulkRecord* record) {
+        record->args.clear();
+        while (record->args.empty()) {
+            line->clear();
+            int c;
+            while ((c = getc(file)) != EOF && c != '\n') {
+                line->push_back((char)c);
+            }
+            if (c == EOF && line->empty()) {
+                return false;
+            }
+            if (!line->empty() && line->back() == '\r') {
+                line->pop_back();
+            }
+            size_t start = 0;
+            while (!line->empty() && start <= line->size()) {
+                size_t end = line->find('\t', start);
+                end = (end == std::string::npos) ? line->size() : end;
+                record->args.push_back(line->substr(start, end - start));
+                start = end + 1;
+            }
+            record->db = db;
+            if (db_column && !record->args.empty()) {
+                // a bad DB field gives a negative DB, the record is counted as an error
+                char* eptr = NULL;
+                long value = strtol(record->args[0].c_str(), &eptr, 10);
+                record->db = (eptr && *eptr == '\0' && !record->args[0].empty()) ? (int)value : -1;
+                record->args.erase(record->args.begin());
+                if (record->args.empty()) {
+                    record->args.push_back("");
+                }
+            }
+        }
+        return true;
+    };
+}
+
+RedisBulkLoader::RedisBulkLoader()
+    : timeout_ms_(DEFAULT_TIMEOUT_MS),
+      inited_(false),
+      replies_(0),
+      errors_(0),
+      bytes_(0) {
+    cLog(TRACE, "RedisBulkLoader constructor ");
+}
+
+RedisBulkLoader::~RedisBulkLoader() {
+    cLog(TRACE, "RedisBulkLoader ~ destructor");
+}
+
+bool RedisBulkLoader::Init(const std::string& host,
+             const std::string& password,
+             int timeout_ms,
+             BulkLoadOption* option,
+             std::string* err_msg) {
+    if (inited_) {
+        cLog(ERROR, ERR_REENTERING);
+        if (err_msg) {
+            *err_msg = ERR_REENTERING;
+        }
+        return false;
+    }
+    std::vector<ServiceAddress> address_vec = parse_address_vector(host);
+    if (address_vec.size() != 1) {
+        cLog(ERROR, ERR_BAD_HOST);
+        if (err_msg) {
+            *err_msg = ERR_BAD_HOST;
+        }
+        return false;
+    }
+    if (option) {
+        option_ = *option;
+    }
+    option_.connections = std::max(option_.connections, 1);
+    option_.pipeline_depth = std::max(option_.pipeline_depth, 1);
+    addr_ = address_vec[0];
+    password_ = password;
+    timeout_ms_ = timeout_ms;
+    // fail early if redis can't be used
+    std::unique_ptr<Worker> probe(Connect(DEFAULT_DB, err_msg));
+    if (!probe) {
+        return false;
+    }
+    inited_ = true;
+    return true;
+}
+
+RedisBulkLoader::Worker* RedisBulkLoader::Connect(int db, std::string* err_msg) {
+    std::unique_ptr<Worker> worker(new Worker);
+    struct timeval timeout = { timeout_ms_ / 1000, (timeout_ms_ % 1000) * 1000 };
+    worker->context = (addr_.port == 0) ? redisConnectUnixWithTimeout(addr_.host.c_str(), timeout)
+        : redisConnectWithTimeout(addr_.host.c_str(), addr_.port, timeout);
+    if (!worker->context || worker->context->err) {
+        cLog(ERROR, "bulk load connect to %s failed", addr_.full_host.c_str());
+        if (err_msg) {
+            *err_msg = worker->context ? worker->context->errstr : ERR_BAD_CONNECTION;
+        }
+        return NULL;
+    }
+    redisSetTimeout(worker->context, timeout);
+    for (int step = password_.empty() ? 1 : 0; step < 2; ++step) {
+        redisReply* reply = (redisReply*)((step == 0) ? redisCommand(worker->context, "AUTH %s", password_.c_str())
+                : redisCommand(worker->context, "SELECT %d", db));
+        bool ok = reply && reply->type != REDIS_REPLY_ERROR;
+        if (err_msg && !ok) {
+            *err_msg = reply ? reply->str : worker->context->errstr;
+        }
+        if (reply) {
+            freeReplyObject(reply);
+        }
+        if (!ok) {
+            return NULL;
+        }
+    }
+    // from now on the socket is driven by poll
+    int flags = fcntl(worker->context->fd, F_GETFL);
+    if (flags < 0 || fcntl(worker->context->fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        if (err_msg) {
+            *err_msg = strerror(errno);
+        }
+        return NULL;
+    }
+    return worker.release();
+}
+
+// write buffers while keeping at most 'pipeline_depth' commands unanswered,
+// and count replies as they come
+void RedisBulkLoader::Run(Worker* worker) {
+    // a reader without functions builds no reply, it only tells the type
+    redisReader* reader = redisReaderCreateWithFunctions(NULL);
+    std::unique_ptr<Buffer> sending;
+    size_t offset = 0;
+    int64_t in_flight = 0;
+    int64_t waited_ms = 0;
+    std::vector<char> rbuf(BULK_READ_BYTES);
+    while (true) {
+        if (!sending) {
+            std::unique_lock<std::mutex> lk(worker->mutex);
+            // a buffer goes out once the replies of the previous ones make room,
+            // or right away if nothing is in flight
+            if (!worker->queue.empty() && (in_flight == 0
+                    || in_flight + worker->queue.front()->commands <= option_.pipeline_depth)) {
+                sending = std::move(worker->queue.front());
+                worker->queue.pop_front();
+                offset = 0;
+                in_flight += sending->commands;
+                worker->cond.notify_all();
+            } else if (in_flight == 0) {
+                if (worker->closed && worker->queue.empty()) {
+                    break;
+                }
+                worker->cond.wait_for(lk, std::chrono::milliseconds(BULK_POLL_MS));
+                continue;
+            }
+        }
+        struct pollfd pfd;
+        pfd.fd = worker->context->fd;
+        pfd.events = (in_flight > 0 ? POLLIN : 0) | (sending ? POLLOUT : 0);
+        pfd.revents = 0;
+        int ret = poll(&pfd, 1, BULK_POLL_MS);
+        if (ret < 0 && errno != EINTR) {
+            worker->err = strerror(errno);
+            break;
+        }
+        if (ret <= 0) {
+            waited_ms += BULK_POLL_MS;
+            if (waited_ms >= option_.reply_timeout_ms) {
+                worker->err = "bulk load timeout";
+                break;
+            }
+            continue;
+        }
+        waited_ms = 0;
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = write(pfd.fd, sending->data.data() + offset, sending->data.size() - offset);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                worker->err = strerror(errno);
+                break;
+            }
+            if (n > 0) {
+                offset += n;
+                bytes_ += n;
+                if (offset == sending->data.size()) {
+                    sending.reset();
+                }
+            }
+        }
+        if (pfd.revents & (POLLIN | POLLERR | POLLHUP)) {
+            ssize_t n = read(pfd.fd, rbuf.data(), rbuf.size());
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                worker->err = (n == 0) ? "server closed the connection" : strerror(errno);
+                break;
+            }
+            if (n > 0 && redisReaderFeed(reader, rbuf.data(), n) != REDIS_OK) {
+                worker->err = reader->errstr;
+                break;
+            }
+            void* type = NULL;
+            int err = REDIS_OK;
+            while ((err = redisReaderGetReply(reader, &type)) == REDIS_OK && type) {
+                --in_flight;
+                ++replies_;
+                if ((size_t)type == REDIS_REPLY_ERROR) {
+                    ++errors_;
+                }
+            }
+            if (err != REDIS_OK) {
+                worker->err = reader->errstr;
+                break;
+            }
+        }
+    }
+    redisReaderFree(reader);
+    if (!worker->err.empty()) {
+        cLog(ERROR, "bulk load to %s broken: %s", addr_.full_host.c_str(), worker->err.c_str());
+        // commands in flight or still queued are lost
+        std::lock_guard<std::mutex> lk(worker->mutex);
+        int64_t lost = in_flight;
+        for (auto& buffer : worker->queue) {
+            lost += buffer->commands;
+        }
+        worker->queue.clear();
+        errors_ += lost;
+        worker->failed = true;
+        worker->cond.notify_all();
+    }
+    worker->done = true;
+}
+
+BulkLoadStats RedisBulkLoader::Snapshot(uint64_t records, uint64_t start_ms) const {
+    BulkLoadStats stats;
+    stats.records = records;
+    stats.replies = replies_;
+    stats.errors = errors_;
+    stats.bytes = bytes_;
+    stats.elapsed_ms = __get_current_time_ms() - start_ms;
+    return stats;
+}
+
+bool RedisBulkLoader::Load(const BulkSource& source, BulkLoadStats* stats, std::string* err_msg) {
+    if (!inited_) {
+        if (err_msg) {
+            *err_msg = ERR_NOT_INITED;
+        }
+        return false;
+    }
+    replies_ = 0;
+    errors_ = 0;
+    bytes_ = 0;
+    uint64_t start_ms = __get_current_time_ms();
+    uint64_t last_progress_ms = start_ms;
+    uint64_t records = 0;
+    bool ok = true;
+    // connections and the buffer being filled of every DB, set up on its first record
+    std::vector<std::vector<std::unique_ptr<Worker>>> workers(MAX_DB_NUM);
+    std::vector<std::unique_ptr<Buffer>> filling(MAX_DB_NUM);
+    std::vector<size_t> next(MAX_DB_NUM, 0);
+
+    auto progress = [&]() {
+        if (option_.progress && __get_current_time_ms() - last_progress_ms >= (uint64_t)option_.progress_interval_ms) {
+            last_progress_ms = __get_current_time_ms();
+            option_.progress(Snapshot(records, start_ms));
+        }
+    };
+    // hand 'buffer' of 'db' to its next connection, waiting while all are busy
+    auto dispatch = [&](int db) {
+        std::unique_ptr<Buffer>& buffer = filling[db];
+        Worker* worker = workers[db][next[db]++ % workers[db].size()].get();
+        std::unique_lock<std::mutex> lk(worker->mutex);
+        while (!worker->failed && worker->queue.size() >= BULK_QUEUE_BUFFERS) {
+            worker->cond.wait_for(lk, std::chrono::milliseconds(BULK_POLL_MS));
+            lk.unlock();
+            progress();
+            lk.lock();
+        }
+        if (worker->failed) {
+            errors_ += buffer->commands;
+            ok = false;
+        } else {
+            worker->queue.push_back(std::move(buffer));
+            worker->cond.notify_all();
+        }
+        buffer.reset();
+    };
+
+    BulkRecord record;
+    while (source(&record)) {
+        ++records;
+        int db = record.db;
+        if (db < 0 || db >= MAX_DB_NUM || record.args.empty()) {
+            ++errors_;
+            continue;
+        }
+        if (workers[db].empty()) {
+            for (int i = 0; i < option_.connections; ++i) {
+                std::string err;
+                Worker* worker = Connect(db, &err);
+                if (!worker) {
+                    if (err_msg) {
+                        *err_msg = err;
+                    }
+                    ok = false;
+                    break;
+                }
+                workers[db].emplace_back(worker);
+                worker->thread = std::thread(&RedisBulkLoader::Run, this, worker);
+            }
+            if (!ok) {
+                break;
+            }
+        }
+        if (!filling[db]) {
+            filling[db].reset(new Buffer);
+            filling[db]->data.reserve(option_.buffer_bytes + (option_.buffer_bytes >> 3));
+            filling[db]->commands = 0;
+        }
+        encode_command(record.args, &filling[db]->data);
+        ++filling[db]->commands;
+        if ((int64_t)filling[db]->data.size() >= option_.buffer_bytes
+                || filling[db]->commands >= option_.pipeline_depth) {
+            dispatch(db);
+        }
+        progress();
+    }
+
+    // the rest, then wait for every reply
+    for (int db = 0; db < MAX_DB_NUM; ++db) {
+        if (filling[db] && !workers[db].empty()) {
+            dispatch(db);
+        }
+        for (auto& worker : workers[db]) {
+            std::lock_guard<std::mutex> lk(worker->mutex);
+            worker->closed = true;
+            worker->cond.notify_all();
+        }
+    }
+    for (int db = 0; db < MAX_DB_NUM; ++db) {
+        for (auto& worker : workers[db]) {
+            while (!worker->done) {
+                usleep(BULK_POLL_MS * 1000 / 10);
+                progress();
+            }
+            worker->thread.join();
+            if (worker->failed) {
+                ok = false;
+                if (err_msg) {
+                    *err_msg = ERR_BULK_BROKEN ": " + worker->err;
+                }
+            }
+        }
+    }
+    BulkLoadStats result = Snapshot(records, start_ms);
+    if (option_.progress) {
+        option_.progress(result);
+    }
+    if (stats) {
+        *stats = result;
+    }
+    return ok;
+}
+
+} // namespace cloris
@@ -0,0 +1,111 @@
+//
+// cloRedis bulk loader class definition
+// RedisBulkLoader streams records to redis the way 'redis-cli --pipe' does:
+// records are encoded in RESP into large buffers, and each of 'connections'
+// connections per DB keeps up to 'pipeline_depth' commands in flight. Replies
+// are parsed only to be counted, no reply object is built.
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#ifndef CLORIS_CLOREDIS_BULKLOADER_H_
+#define CLORIS_CLOREDIS_BULKLOADER_H_
+
+#include <stdio.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include "cloredis.h"
+
+#define DEFAULT_BULK_CONNECTIONS 4
+#define DEFAULT_BULK_PIPELINE_DEPTH 10000
+#define DEFAULT_BULK_BUFFER_BYTES (1 << 20)
+#define DEFAULT_BULK_PROGRESS_INTERVAL_MS 1000
+#define DEFAULT_BULK_REPLY_TIMEOUT_MS 10000
+#define BULK_QUEUE_BUFFERS 4            // encoded buffers waiting per connection
+
+#define ERR_BULK_BROKEN "bulk load connection broken"
+
+namespace cloris {
+
+struct BulkRecord {
+    int db;
+    std::vector<std::string> args;      // the command and its arguments
+};
+
+struct BulkLoadStats {
+    BulkLoadStats() : records(0), replies(0), errors(0), bytes(0), elapsed_ms(0) { }
+    double records_per_sec() const { return elapsed_ms ? records * 1000.0 / elapsed_ms : 0.0; }
+
+    uint64_t records;       // read from the source
+    uint64_t replies;       // replies received, error replies included
+    uint64_t errors;        // error replies, and records not sent for a bad DB or a broken connection
+    uint64_t bytes;         // bytes written
+    int64_t elapsed_ms;
+};
+
+struct BulkLoadOption {
+    BulkLoadOption()
+        : connections(DEFAULT_BULK_CONNECTIONS),
+          pipeline_depth(DEFAULT_BULK_PIPELINE_DEPTH),
+          buffer_bytes(DEFAULT_BULK_BUFFER_BYTES),
+          progress_interval_ms(DEFAULT_BULK_PROGRESS_INTERVAL_MS),
+          reply_timeout_ms(DEFAULT_BULK_REPLY_TIMEOUT_MS) {
+    }
+
+    // connections per DB, records of a DB are spread over them buffer by buffer
+    int connections;
+    // commands sent and not answered yet per connection
+    int pipeline_depth;
+    // records are encoded into buffers of about this size before being sent
+    int64_t buffer_bytes;
+    // 'progress' is called from the loading thread at this interval
+    int progress_interval_ms;
+    std::function<void(const BulkLoadStats&)> progress;
+    // a connection waiting that long for a reply is given up
+    int reply_timeout_ms;
+};
+
+// gives the next record, false at the end
+typedef std::function<bool(BulkRecord* record)> BulkSource;
+
+// records of 'file', one per line with the arguments separated by tabs; the
+// DB is 'db', or the first field of each line if 'db_column'
+BulkSource bulk_file_source(FILE* file, int db, bool db_column);
+
+class RedisBulkLoader {
+public:
+    RedisBulkLoader();
+    ~RedisBulkLoader();
+    // 'host' is one redis, the master to load into
+    bool Init(const std::string& host,
+              const std::string& password = "",
+              int timeout_ms = DEFAULT_TIMEOUT_MS,
+              BulkLoadOption* option = NULL,
+              std::string* err_msg = NULL);
+
+    // send every record of 'source' and wait for all replies. False if a
+    // connection broke, error replies only count in 'stats'
+    bool Load(const BulkSource& source, BulkLoadStats* stats = NULL, std::string* err_msg = NULL);
+private:
+    struct Buffer;
+    struct Worker;
+
+    Worker* Connect(int db, std::string* err_msg);
+    void Run(Worker* worker);
+    BulkLoadStats Snapshot(uint64_t records, uint64_t start_ms) const;
+
+    ServiceAddress addr_;
+    std::string password_;
+    int timeout_ms_;
+    bool inited_;
+    BulkLoadOption option_;
+    std::atomic<uint64_t> replies_;
+    std::atomic<uint64_t> errors_;
+    std::atomic<uint64_t> bytes_;
+};
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_BULKLOADER_H_
@@ -0,0 +1,193 @@
+//
+// cloRedis cache-aside class implementation
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "internal/log.h"
+#include "cacheaside.h"
+
+namespace cloris {
+
+struct RedisCacheAside::Counters {
+    Counters() : hits(0), stale_hits(0), misses(0), refreshes(0), load_errors(0) { }
+
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> stale_hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> refreshes;
+    std::atomic<uint64_t> load_errors;
+};
+
+// a value is stored as "<expiry_ms> <delta_ms>\n<value>", 'delta_ms' being
+// the time the loader took to compute it
+static std::string encode_entry(uint64_t expiry_ms, uint64_t delta_ms, const std::string& value) {
+    std::string entry = std::to_string(expiry_ms) + " " + std::to_string(delta_ms) + "\n";
+    entry.append(value);
+    return entry;
+}
+
+static bool decode_entry(const std::string& entry, uint64_t* expiry_ms, uint64_t* delta_ms, std::string* value) {
+    size_t eol = entry.find('\n');
+    unsigned long long expiry = 0, delta = 0;
+    if (eol == std::string::npos || sscanf(entry.c_str(), "%llu %llu", &expiry, &delta) != 2) {
+        return false;
+    }
+    *expiry_ms = expiry;
+    *delta_ms = delta;
+    value->assign(entry, eol + 1, std::string::npos);
+    return true;
+}
+
+// XFetch: recompute before expiry with a probability rising as it nears,
+// earlier for values slow to compute
+static bool should_refresh(uint64_t now_ms, uint64_t expiry_ms, uint64_t delta_ms, double beta) {
+    double r = (rand() + 1.0) / ((double)RAND_MAX + 1.0);
+    return now_ms - delta_ms * beta * log(r) >= expiry_ms;
+}
+
+RedisCacheAside::RedisCacheAside(RedisManager* manager, int db, const CacheAsideOption* option)
+    : manager_(manager),
+      db_(db),
+      lock_seq_(0) {
+    if (option) {
+        option_ = *option;
+    }
+    cLog(TRACE, "RedisCacheAside constructor ");
+}
+
+RedisCacheAside::~RedisCacheAside() {
+    cLog(TRACE, "RedisCacheAside ~ destructor");
+}
+
+RedisCacheAside::Counters* RedisCacheAside::CountersOf(const std::string& key) {
+    // keys without a prefix are counted together
+    size_t end = key.find(option_.prefix_separator);
+    std::string prefix = (end == std::string::npos) ? std::string("") : key.substr(0, end);
+    std::lock_guard<std::mutex> lk(counters_mtx_);
+    std::unique_ptr<Counters>& counters = counters_[prefix];
+    if (!counters) {
+        counters.reset(new Counters);
+    }
+    return counters.get();
+}
+
+bool RedisCacheAside::Get(const std::string& key, const Loader& loader, std::string* value, std::string* err_msg) {
+    Counters* counters = CountersOf(key);
+    RedisReply reply = manager_->Do(db_, "GET %b", key.data(), key.size());
+    if (reply.error()) {
+        cLog(ERROR, "cache-aside GET %s failed: %s", key.c_str(), reply.err_str().c_str());
+    }
+    uint64_t expiry_ms = 0, delta_ms = 0;
+    std::string cached;
+    if (reply.is_string() && decode_entry(reply.toString(), &expiry_ms, &delta_ms, &cached)) {
+        uint64_t now_ms = __get_current_time_ms();
+        if (!should_refresh(now_ms, expiry_ms, delta_ms, option_.beta)) {
+            ++counters->hits;
+            value->swap(cached);
+            return true;
+        }
+        // early or expired: one caller recomputes, the others keep the value they have
+        std::string token;
+        if (TryLock(key, &token)) {
+            ++counters->refreshes;
+            bool ok = Load(key, loader, value, counters);
+            Unlock(key, token);
+            if (ok) {
+                return true;
+            }
+        }
+        if (now_ms < expiry_ms) {
+            ++counters->hits;
+        } else {
+            ++counters->stale_hits;
+        }
+        value->swap(cached);
+        return true;
+    }
+
+    ++counters->misses;
+    std::string token;
+    if (TryLock(key, &token)) {
+        bool ok = Load(key, loader, value, counters);
+        Unlock(key, token);
+        if (!ok && err_msg) {
+            *err_msg = ERR_LOAD_FAILED;
+        }
+        return ok;
+    }
+    // another caller recomputes, wait for its value a while
+    for (int64_t waited = 0; waited < option_.lock_wait_ms; waited += CACHE_ASIDE_POLL_MS) {
+        usleep(CACHE_ASIDE_POLL_MS * 1000);
+        // the value is written to master, read it there
+        reply = manager_->DoRoute(db_, ROUTE_MASTER, "GET %b", key.data(), key.size());
+        if (reply.is_string() && decode_entry(reply.toString(), &expiry_ms, &delta_ms, value)) {
+            return true;
+        }
+    }
+    if (!Load(key, loader, value, counters)) {
+        if (err_msg) {
+            *err_msg = ERR_LOAD_FAILED;
+        }
+        return false;
+    }
+    return true;
+}
+
+bool RedisCacheAside::Load(const std::string& key, const Loader& loader, std::string* value, Counters* counters) {
+    uint64_t start_ms = __get_current_time_ms();
+    if (!loader(key, value)) {
+        ++counters->load_errors;
+        return false;
+    }
+    uint64_t now_ms = __get_current_time_ms();
+    std::string entry = encode_entry(now_ms + option_.ttl_ms, now_ms - start_ms, *value);
+    RedisReply reply = manager_->Do(db_, "SET %b %b PX %lld", key.data(), key.size(),
+            entry.data(), entry.size(), (long long)(option_.ttl_ms + option_.stale_ms));
+    // the value is good even if it couldn't be cached
+    cLogIf(!reply.ok(), ERROR, "cache-aside SET %s failed: %s", key.c_str(), reply.err_str().c_str());
+    return true;
+}
+
+bool RedisCacheAside::TryLock(const std::string& key, std::string* token) {
+    std::string lock_key = key + CACHE_ASIDE_LOCK_SUFFIX;
+    *token = std::to_string(getpid()) + "-" + std::to_string((uintptr_t)this) + "-" + std::to_string(++lock_seq_);
+    RedisReply reply = manager_->Do(db_, "SET %b %b NX PX %lld", lock_key.data(), lock_key.size(),
+            token->data(), token->size(), (long long)option_.lock_ms);
+    // nobody can hold the lock of a redis that can't be reached, compute then
+    return !reply.is_nil();
+}
+
+void RedisCacheAside::Unlock(const std::string& key, const std::string& token) {
+    // only our own lock is dropped; if it expired and was taken again between
+    // the two commands, the worst is one more recompute
+    std::string lock_key = key + CACHE_ASIDE_LOCK_SUFFIX;
+    RedisReply reply = manager_->DoRoute(db_, ROUTE_MASTER, "GET %b", lock_key.data(), lock_key.size());
+    if (reply.toString() == token) {
+        manager_->Do(db_, "DEL %b", lock_key.data(), lock_key.size());
+    }
+}
+
+bool RedisCacheAside::Invalidate(const std::string& key) {
+    return manager_->Do(db_, "DEL %b", key.data(), key.size()).ok();
+}
+
+std::map<std::string, CacheAsideStats> RedisCacheAside::stats() const {
+    std::map<std::string, CacheAsideStats> result;
+    std::lock_guard<std::mutex> lk(counters_mtx_);
+    for (auto& item : counters_) {
+        CacheAsideStats& stats = result[item.first];
+        stats.hits = item.second->hits;
+        stats.stale_hits = item.second->stale_hits;
+        stats.misses = item.second->misses;
+        stats.refreshes = item.second->refreshes;
+        stats.load_errors = item.second->load_errors;
+    }
+    return result;
+}
+
+} // namespace cloris
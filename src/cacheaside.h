@@ -0,0 +1,111 @@
+//
+// cloRedis cache-aside class definition
+// RedisCacheAside reads a key through RedisManager and, on a miss, computes it
+// by a loader and stores it. Values are refreshed before they expire with a
+// probability growing as expiry nears and with the time the loader takes
+// (XFetch), a short lock key lets one caller recompute while the others are
+// served the value they have, stale or not, so an expiry doesn't stampede the
+// source behind the cache.
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#ifndef CLORIS_CLOREDIS_CACHEASIDE_H_
+#define CLORIS_CLOREDIS_CACHEASIDE_H_
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "cloredis.h"
+
+#define CACHE_ASIDE_LOCK_SUFFIX ":lock"
+#define CACHE_ASIDE_POLL_MS 10                  // between two reads while waiting for a recompute
+#define DEFAULT_CACHE_ASIDE_TTL_MS 60000
+#define DEFAULT_CACHE_ASIDE_STALE_MS 60000
+#define DEFAULT_CACHE_ASIDE_BETA 1.0
+#define DEFAULT_CACHE_ASIDE_LOCK_MS 3000
+#define DEFAULT_CACHE_ASIDE_LOCK_WAIT_MS 1000
+
+#define ERR_LOAD_FAILED "loader failed"
+
+namespace cloris {
+
+struct CacheAsideOption {
+    CacheAsideOption()
+        : ttl_ms(DEFAULT_CACHE_ASIDE_TTL_MS),
+          stale_ms(DEFAULT_CACHE_ASIDE_STALE_MS),
+          beta(DEFAULT_CACHE_ASIDE_BETA),
+          lock_ms(DEFAULT_CACHE_ASIDE_LOCK_MS),
+          lock_wait_ms(DEFAULT_CACHE_ASIDE_LOCK_WAIT_MS),
+          prefix_separator(':') {
+    }
+
+    // a value is fresh for 'ttl_ms', then served stale for up to 'stale_ms'
+    // more while it is recomputed
+    int64_t ttl_ms;
+    int64_t stale_ms;
+    // XFetch factor, above 1 refreshes earlier, 0 only at expiry
+    double beta;
+    // life of the lock key of a recompute, it should be longer than the loader takes
+    int64_t lock_ms;
+    // how long a caller with no value waits for the recompute of another one
+    // before running the loader itself
+    int64_t lock_wait_ms;
+    // statistics are kept per key prefix, the part before the first separator,
+    // keys without one are counted under ""
+    char prefix_separator;
+};
+
+struct CacheAsideStats {
+    CacheAsideStats() : hits(0), stale_hits(0), misses(0), refreshes(0), load_errors(0) { }
+    double hit_rate() const {
+        uint64_t total = hits + stale_hits + misses;
+        return total ? (double)(hits + stale_hits) / total : 0.0;
+    }
+
+    uint64_t hits;
+    uint64_t stale_hits;        // expired values served while another caller recomputes
+    uint64_t misses;            // no value in redis
+    uint64_t refreshes;         // recomputes of a value still in redis, early or at expiry
+    uint64_t load_errors;
+};
+
+class RedisCacheAside {
+public:
+    // computes the value of 'key', false if it can't
+    typedef std::function<bool(const std::string& key, std::string* value)> Loader;
+
+    // 'manager' must outlive the cache-aside
+    RedisCacheAside(RedisManager* manager, int db = DEFAULT_DB, const CacheAsideOption* option = NULL);
+    ~RedisCacheAside();
+
+    // value of 'key' from redis, or computed by 'loader' and stored
+    bool Get(const std::string& key, const Loader& loader, std::string* value, std::string* err_msg = NULL);
+    // drop 'key' so that the next read recomputes it
+    bool Invalidate(const std::string& key);
+
+    // statistics by key prefix
+    std::map<std::string, CacheAsideStats> stats() const;
+private:
+    struct Counters;
+
+    // run 'loader' and store its value with the time it took, for XFetch
+    bool Load(const std::string& key, const Loader& loader, std::string* value, Counters* counters);
+    bool TryLock(const std::string& key, std::string* token);
+    void Unlock(const std::string& key, const std::string& token);
+    Counters* CountersOf(const std::string& key);
+
+    RedisManager* manager_;
+    const int db_;
+    CacheAsideOption option_;
+    mutable std::mutex counters_mtx_;
+    std::unordered_map<std::string, std::unique_ptr<Counters>> counters_;
+    std::atomic<uint64_t> lock_seq_;
+};
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_CACHEASIDE_H_
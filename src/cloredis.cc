@@ -4,19 +4,46 @@
 // Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
 //
 
+#include <poll.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
 #include <vector>
 #include <boost/algorithm/string.hpp>
 #include "internal/singleton.h"
 #include "internal/log.h"
+#include "internal/sentinel.h"
+#include "internal/replica_lag.h"
+#include "internal/hedge.h"
+#include "internal/singleflight.h"
+#include "internal/script_registry.h"
+#include "command.h"
 #include "cloredis.h"
 
+// how often sleeping background threads look at 'stopping_'
+#define STOP_CHECK_MS 100
+
 namespace cloris {
 
-static std::vector<ServiceAddress> parse_address_vector(const std::string& host) {
+std::vector<ServiceAddress> parse_address_vector(const std::string& host) {
     std::vector<ServiceAddress> addr_vec;
     std::vector<std::string> vec_raw;
     boost::split(vec_raw, host, boost::is_any_of(","));
     for (auto &full_host : vec_raw) {
+        std::string trimmed = boost::trim_copy(full_host);
+        if (boost::starts_with(trimmed, UNIX_SOCKET_SCHEME)) {
+            // 'unix:///path', only absolute paths
+            std::string path = trimmed.substr(strlen(UNIX_SOCKET_SCHEME));
+            if (path.size() > 1 && path[0] == '/') {
+                ServiceAddress addr;
+                addr.port = 0;
+                addr.host = path;
+                addr.full_host = trimmed;
+                addr_vec.push_back(addr);
+            }
+            continue;
+        }
         std::vector<std::string> addr_pair;
         boost::split(addr_pair, full_host, boost::is_any_of(":"));
         if (addr_pair.size() == 2) {
@@ -35,14 +62,88 @@ static std::vector<ServiceAddress> parse_address_vector(const std::string& host)
     return addr_vec;
 }
 
+struct RedisManager::Topology {
+    ServiceAddress master_addr;
+    std::vector<ServiceAddress> slave_addr;
+    ConnectionPoolOption option;
+    std::atomic<RedisConnectionPool*> master[MAX_DB_NUM];
+    std::atomic<RedisConnectionPool*> slave[MAX_DB_NUM][MAX_SLAVE_CNT];
+    std::atomic<int64_t> slave_lag_ms[MAX_SLAVE_CNT];   // -1 until probed, or when broken
+    std::atomic<bool> slave_ejected[MAX_SLAVE_CNT];     // out of the read rotation
+    std::mutex mutex;   // serializes the lazy creation of pools
+
+    Topology() {
+        for (int j = 0; j < MAX_SLAVE_CNT; ++j) {
+            slave_lag_ms[j] = -1;
+            slave_ejected[j] = false;
+        }
+        for (int i = 0; i < MAX_DB_NUM; ++i) {
+            master[i] = NULL;
+            for (int j = 0; j < MAX_SLAVE_CNT; ++j) {
+                slave[i][j] = NULL;
+            }
+        }
+    }
+    ~Topology() {
+        for (int i = 0; i < MAX_DB_NUM; ++i) {
+            delete master[i].load();
+            for (int j = 0; j < MAX_SLAVE_CNT; ++j) {
+                delete slave[i][j].load();
+            }
+        }
+    }
+    // whether every connection borrowed from it has been returned
+    bool drained() const {
+        for (int i = 0; i < MAX_DB_NUM; ++i) {
+            RedisConnectionPool* pool = master[i].load();
+            if (pool && pool->active_cnt() != pool->conn_in_pool()) {
+                return false;
+            }
+            for (int j = 0; j < MAX_SLAVE_CNT; ++j) {
+                pool = slave[i][j].load();
+                if (pool && pool->active_cnt() != pool->conn_in_pool()) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+void key_hash_tag(const char** key, size_t* len) {
+    const char* s = (const char*)memchr(*key, '{', *len);
+    if (!s) {
+        return;
+    }
+    const char* e = (const char*)memchr(s + 1, '}', *key + *len - s - 1);
+    // no '}' or nothing between '{}', the whole key is used
+    if (!e || e == s + 1) {
+        return;
+    }
+    *key = s + 1;
+    *len = e - s - 1;
+}
+
+// managers are told apart by id rather than address, a new manager may reuse
+// the address of a deleted one
+static uint64_t next_manager_id() {
+    static std::atomic<uint64_t> next_id(0);
+    return ++next_id;
+}
+
 RedisManager::RedisManager() 
     : password_(""),
       timeout_ms_(-1),
       inited_(false),
-      slave_cnt_(0) {
+      id_(next_manager_id()),
+      read_your_writes_ms_(DEFAULT_READ_YOUR_WRITES_MS),
+      sentinel_(NULL),
+      probe_interval_ms_(DEFAULT_PROBE_INTERVAL_MS),
+      max_lag_ms_(DEFAULT_MAX_REPLICA_LAG_MS),
+      stopping_(false),
+      has_retired_(false),
+      scripts_(std::make_shared<ScriptRegistry>()) {
     cLog(TRACE, "RedisManager constructor ");
-    memset(master_, 0, sizeof(RedisConnectionPool*) * MAX_DB_NUM);
-    memset(slave_, 0, sizeof(RedisConnectionPool**) * MAX_DB_NUM);
 }
 
 RedisManager::~RedisManager() {
@@ -51,16 +152,21 @@ RedisManager::~RedisManager() {
 }
 
 void RedisManager::Flush() {
-    for (int i = 0; i < MAX_DB_NUM; ++i) {
-        if (master_[i]) {
-            delete master_[i];
-        }
-        if (slave_[i]) {
-            for (int j = 0; j < slave_cnt_; ++j) {
-                delete slave_[i][j];
-            }
-            free(slave_[i]);
-        }
+    stopping_ = true;
+    if (sentinel_thread_.joinable()) {
+        sentinel_thread_.join();
+    }
+    if (probe_thread_.joinable()) {
+        probe_thread_.join();
+    }
+    stopping_ = false;
+    delete sentinel_;
+    sentinel_ = NULL;
+    std::atomic_store(&topology_, TopologyPtr());
+    std::atomic_store(&hedge_, std::shared_ptr<HedgePolicy>());
+    {
+        std::lock_guard<std::mutex> lk(retired_mtx_);
+        retired_.clear();
     }
     inited_ = false;
 }
@@ -69,30 +175,41 @@ RedisManager* RedisManager::instance() {
     return Singleton<RedisManager>::instance();
 }
 
-void RedisManager::InitConnectionPool(RedisRole role, int db, int slave_slot) {
-    RedisConnectionPool::InitHandler handler; 
-    if (role == MASTER) {
-        handler = std::bind(&RedisConnectionImpl::Init, std::placeholders::_1, 
-                master_addr_.host, 
-                master_addr_.port, 
-                password_,
-                timeout_ms_, 
-                db);
-        master_[db] = new RedisConnectionPool(&option_, handler);
-    } else {
-        handler = std::bind(&RedisConnectionImpl::Init, std::placeholders::_1, 
-                slave_addr_[slave_slot].host, 
-                slave_addr_[slave_slot].port, 
+RedisManager::TopologyPtr RedisManager::NewTopology(const ServiceAddress& master, 
+        const std::vector<ServiceAddress>& slaves,
+        const ConnectionPoolOption& option) {
+    TopologyPtr topology = std::make_shared<Topology>();
+    topology->master_addr = master;
+    topology->option = option;
+    for (auto &p : slaves) {
+        if (topology->slave_addr.size() + 1 >= MAX_SLAVE_CNT) {
+            break;
+        }
+        topology->slave_addr.push_back(p);
+    }
+    return topology;
+}
+
+RedisConnectionPool* RedisManager::GetPool(Topology* topology, RedisRole role, int db, int slave_slot) {
+    std::atomic<RedisConnectionPool*>& slot = (role == MASTER) ? topology->master[db] : topology->slave[db][slave_slot];
+    RedisConnectionPool* pool = slot.load(std::memory_order_acquire);
+    if (pool) {
+        return pool;
+    }
+    std::lock_guard<std::mutex> lk(topology->mutex);
+    pool = slot.load(std::memory_order_relaxed);
+    if (!pool) {
+        const ServiceAddress& addr = (role == MASTER) ? topology->master_addr : topology->slave_addr[slave_slot];
+        RedisConnectionPool::InitHandler handler = std::bind(&RedisConnectionImpl::Init, std::placeholders::_1, 
+                addr.host, 
+                addr.port, 
                 password_,
                 timeout_ms_, 
                 db);
-        if (!slave_[db]) {
-            int msize = sizeof(RedisConnectionPool*) * slave_addr_.size();
-            slave_[db] = (RedisConnectionPool**)malloc(msize);
-            memset(slave_[db], 0, msize); 
-        }
-        slave_[db][slave_slot] = new RedisConnectionPool(&option_, handler);
+        pool = new RedisConnectionPool(&topology->option, handler);
+        slot.store(pool, std::memory_order_release);
     }
+    return pool;
 }
 
 bool RedisManager::Init(const std::string& host, 
@@ -116,17 +233,19 @@ bool RedisManager::Init(const std::string& host,
         }
         return false;
     }
-    master_addr_ = address_vec[0];
     if (option) {
         option_ = *option;
     }
     password_ = password;
     timeout_ms_ = timeout_ms;
 
-    InitConnectionPool(MASTER, DEFAULT_DB, 0);
-    RedisConnection conn = master_[DEFAULT_DB]->Get(err_msg);
+    TopologyPtr topology = NewTopology(address_vec[0], std::vector<ServiceAddress>(), option_);
+    std::atomic_store(&topology_, topology);
+    RedisConnection conn = GetPool(topology.get(), MASTER, DEFAULT_DB, 0)->Get(err_msg);
     cLogIf(!conn, ERROR, err_msg ? err_msg->c_str() : "");
-
+    if (conn) {
+        LoadScripts(topology.get(), scripts_->bodies());
+    }
     return conn ? true : false;
 }
 
@@ -151,7 +270,6 @@ bool RedisManager::InitEx(const std::string& master_host,
         return false;
     }
 
-    master_addr_ = master_address_vec[0];
     if (option) {
         option_ = *option;
     }
@@ -160,58 +278,725 @@ bool RedisManager::InitEx(const std::string& master_host,
 
     // slave is optional
     std::vector<ServiceAddress> slave_address_vec = parse_address_vector(slave_hosts);
-    if (slave_address_vec.size() > 0 && slave_address_vec.size() < MAX_SLAVE_CNT) {
-        for (auto &p : slave_address_vec) {
-            slave_addr_.push_back(p);
-        }
+    if (slave_address_vec.size() >= MAX_SLAVE_CNT) {
+        slave_address_vec.clear();
     }
-    slave_cnt_ = slave_addr_.size();
+    TopologyPtr topology = NewTopology(master_address_vec[0], slave_address_vec, option_);
+    std::atomic_store(&topology_, topology);
 
-    InitConnectionPool(MASTER, DEFAULT_DB, 0);
-    InitConnectionPool(SLAVE, DEFAULT_DB, 0);
-    RedisConnection master_conn = master_[DEFAULT_DB]->Get(err_msg);
-    RedisConnection slave_conn = slave_[DEFAULT_DB][0]->Get(err_msg);
+    RedisConnection master_conn = GetPool(topology.get(), MASTER, DEFAULT_DB, 0)->Get(err_msg);
+    if (master_conn) {
+        LoadScripts(topology.get(), scripts_->bodies());
+    }
+    if (topology->slave_addr.empty()) {
+        return master_conn ? true : false;
+    }
+    RedisConnection slave_conn = GetPool(topology.get(), SLAVE, DEFAULT_DB, 0)->Get(err_msg);
     return (master_conn && slave_conn) ? true : false;
 }
 
+bool RedisManager::InitSentinel(const std::string& sentinel_hosts,
+               const std::string& master_name,
+               const std::string& password, 
+               int timeout_ms,
+               ConnectionPoolOption* option,
+               std::string* err_msg) {
+    if (inited_) {
+        if (err_msg) {
+            *err_msg = ERR_REENTERING;
+        }
+        return false;
+    }
+    inited_ = true;
+    std::vector<ServiceAddress> sentinel_address_vec = parse_address_vector(sentinel_hosts);
+    if (sentinel_address_vec.empty()) {
+        if (err_msg) {
+            *err_msg = ERR_BAD_HOST;
+        }
+        return false;
+    }
+    if (option) {
+        option_ = *option;
+    }
+    password_ = password;
+    timeout_ms_ = timeout_ms;
+
+    sentinel_ = new Sentinel(sentinel_address_vec, master_name, timeout_ms);
+    ServiceAddress master;
+    std::vector<ServiceAddress> slaves;
+    if (!sentinel_->Resolve(&master, &slaves, err_msg)) {
+        cLog(ERROR, "resolve master %s failed", master_name.c_str());
+        return false;
+    }
+    TopologyPtr topology = NewTopology(master, slaves, option_);
+    std::atomic_store(&topology_, topology);
+    sentinel_thread_ = std::thread(&RedisManager::WatchSentinel, this);
+
+    RedisConnection conn = GetPool(topology.get(), MASTER, DEFAULT_DB, 0)->Get(err_msg);
+    if (conn) {
+        LoadScripts(topology.get(), scripts_->bodies());
+    }
+    return conn ? true : false;
+}
+
+bool RedisManager::Reload(const std::string& master_host,
+               const std::string& slave_hosts,
+               ConnectionPoolOption* option,
+               std::string* err_msg) {
+    if (!inited_ || sentinel_) {
+        if (err_msg) {
+            *err_msg = sentinel_ ? ERR_RELOAD_SENTINEL : ERR_NOT_INITED;
+        }
+        return false;
+    }
+    std::vector<ServiceAddress> master_address_vec = parse_address_vector(master_host);
+    std::vector<ServiceAddress> slave_address_vec = parse_address_vector(slave_hosts);
+    if (master_address_vec.size() != 1 || slave_address_vec.size() >= MAX_SLAVE_CNT) {
+        if (err_msg) {
+            *err_msg = ERR_BAD_HOST;
+        }
+        return false;
+    }
+    // one reload at a time, the later one wins
+    std::lock_guard<std::mutex> lk(reload_mtx_);
+    TopologyPtr old = std::atomic_load(&topology_);
+    if (!old) {
+        if (err_msg) {
+            *err_msg = ERR_NOT_INITED;
+        }
+        return false;
+    }
+    TopologyPtr topology = NewTopology(master_address_vec[0], slave_address_vec, option ? *option : old->option);
+    if (!WarmTopology(topology.get(), old.get(), err_msg)) {
+        cLog(ERROR, "reload to master %s aborted", master_address_vec[0].full_host.c_str());
+        return false;
+    }
+    // no EVALSHA on the new servers has to wait for a NOSCRIPT round trip
+    LoadScripts(topology.get(), scripts_->bodies());
+    old.reset();
+    SwapTopology(topology);
+    FreeDrainedTopology();
+    return true;
+}
+
+bool RedisManager::WarmTopology(Topology* topology, Topology* old, std::string* err_msg) {
+    // one thread per server, so a reload waits for the slowest server only
+    int server_cnt = 1 + topology->slave_addr.size();
+    std::vector<std::string> errors(server_cnt);
+    std::vector<std::thread> threads;
+    for (int k = 0; k < server_cnt; ++k) {
+        threads.emplace_back([this, topology, old, k, &errors]() {
+            RedisRole role = (k == 0) ? MASTER : SLAVE;
+            int index = (k == 0) ? 0 : k - 1;
+            bool has_old = (role == MASTER) || index < (int)old->slave_addr.size();
+            for (int db = 0; db < MAX_DB_NUM && errors[k].empty(); ++db) {
+                RedisConnectionPool* old_pool = has_old ? 
+                    ((role == MASTER) ? old->master[db].load() : old->slave[db][index].load()) : NULL;
+                // as many connections as the old pool has open, one at least for DEFAULT_DB
+                int count = old_pool ? old_pool->active_cnt() : 0;
+                if (db == DEFAULT_DB) {
+                    count = std::max(count, 1);
+                }
+                if (topology->option.max_idle > 0) {
+                    count = std::min(count, topology->option.max_idle);
+                }
+                if (count == 0) {
+                    continue;
+                }
+                RedisConnectionPool* pool = GetPool(topology, role, db, index);
+                std::vector<RedisConnection> conns;
+                for (int i = 0; i < count; ++i) {
+                    conns.emplace_back(pool->Get(&errors[k]));
+                    if (!conns.back()) {
+                        if (errors[k].empty()) {
+                            errors[k] = ERR_BAD_CONNECTION;
+                        }
+                        break;
+                    }
+                }
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (int k = 0; k < server_cnt; ++k) {
+        if (!errors[k].empty()) {
+            const ServiceAddress& addr = (k == 0) ? topology->master_addr : topology->slave_addr[k - 1];
+            cLog(ERROR, "warm up %s failed: %s", addr.full_host.c_str(), errors[k].c_str());
+            if (err_msg) {
+                *err_msg = addr.full_host + ": " + errors[k];
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+void RedisManager::SwapTopology(const TopologyPtr& topology) {
+    TopologyPtr old = std::atomic_exchange(&topology_, topology);
+    cLog(INFO, "redis master is now %s with %d slaves", topology->master_addr.full_host.c_str(), (int)topology->slave_addr.size());
+    if (old) {
+        std::lock_guard<std::mutex> lk(retired_mtx_);
+        retired_.push_back(old);
+        has_retired_ = true;
+    }
+}
+
+void RedisManager::FreeDrainedTopology() {
+    std::unique_lock<std::mutex> lk(retired_mtx_, std::try_to_lock);
+    if (!lk.owns_lock()) {
+        // another thread is at it
+        return;
+    }
+    for (auto iter = retired_.begin(); iter != retired_.end(); ) {
+        // once no thread holds it, no connection can be borrowed from it any more
+        if (iter->use_count() == 1 && (*iter)->drained()) {
+            cLog(INFO, "free pools of retired master %s", (*iter)->master_addr.full_host.c_str());
+            iter = retired_.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+    has_retired_ = !retired_.empty();
+}
+
+void RedisManager::WatchSentinel() {
+    uint64_t last_resolve_ms = __get_current_time_ms();
+    while (!stopping_) {
+        bool event = sentinel_->WaitEvent(SENTINEL_POLL_MS);
+        if (event || last_resolve_ms + SENTINEL_RESOLVE_INTERVAL_MS < __get_current_time_ms()) {
+            last_resolve_ms = __get_current_time_ms();
+            ServiceAddress master;
+            std::vector<ServiceAddress> slaves;
+            TopologyPtr current = std::atomic_load(&topology_);
+            if (sentinel_->Resolve(&master, &slaves)) {
+                bool changed = !current 
+                    || current->master_addr.full_host != master.full_host
+                    || current->slave_addr.size() != slaves.size();
+                for (size_t i = 0; !changed && i < slaves.size(); ++i) {
+                    changed = current->slave_addr[i].full_host != slaves[i].full_host;
+                }
+                if (changed) {
+                    TopologyPtr topology = NewTopology(master, slaves, current ? current->option : option_);
+                    LoadScripts(topology.get(), scripts_->bodies());
+                    SwapTopology(topology);
+                }
+            }
+        }
+        FreeDrainedTopology();
+    }
+}
+
 RedisConnectionImpl* RedisManager::Get(int db, std::string* err_msg, RedisRole role, int index) {
-    if (db >= MAX_DB_NUM) {
+    if (db < 0 || db >= MAX_DB_NUM) {
+        return NULL;
+    }
+    TopologyPtr topology = std::atomic_load(&topology_);
+    if (!topology) {
+        if (err_msg) {
+            *err_msg = ERR_NOT_INITED;
+        }
         return NULL;
     }
+    if (has_retired_) {
+        FreeDrainedTopology();
+    }
     
+    // with shared pools, the pool of DEFAULT_DB serves every db
+    int pool_db = topology->option.share_db_pool ? DEFAULT_DB : db;
     // if no slave instance exists, role is ignored
-    if ((role == MASTER) || (slave_cnt_ < 1)) {
-        if (master_[db]) {
-            return master_[db]->Get(err_msg);
-        } else {
-            InitConnectionPool(MASTER, db, 0);
-            return master_[db]->Get(err_msg);
-        }
+    int slave_cnt = topology->slave_addr.size();
+    if ((role == MASTER) || (slave_cnt < 1)) {
+        return Borrow(GetPool(topology.get(), MASTER, pool_db, 0), db, err_msg);
     } else {
-        int real_index = (index >= 0 && index < slave_cnt_) ? index : (rand() % slave_cnt_);
-        if (slave_[db] && slave_[db][real_index]) {
-            return slave_[db][real_index]->Get(err_msg);
-        } else {
-            InitConnectionPool(SLAVE, db, real_index);
-            return slave_[db][real_index]->Get(err_msg);
+        int real_index = (index >= 0 && index < slave_cnt) ? index : PickSlave(topology.get(), -1);
+        if (real_index < 0) {
+            // every slave is out of the read rotation
+            return Borrow(GetPool(topology.get(), MASTER, pool_db, 0), db, err_msg);
         }
+        return Borrow(GetPool(topology.get(), SLAVE, pool_db, real_index), db, err_msg);
     }
 }
 
-int RedisManager::ActiveConnectionCount(RedisRole role) {
-    int count = 0;
+int RedisManager::PickSlave(Topology* topology, int64_t max_lag_ms, int exclude) {
+    int slave_cnt = topology->slave_addr.size();
+    if (slave_cnt < 1) {
+        return -1;
+    }
+    int start = rand() % slave_cnt;
+    for (int i = 0; i < slave_cnt; ++i) {
+        int index = (start + i) % slave_cnt;
+        if (index == exclude || topology->slave_ejected[index]) {
+            continue;
+        }
+        int64_t lag = topology->slave_lag_ms[index];
+        if (max_lag_ms < 0 || (lag >= 0 && lag <= max_lag_ms)) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+RedisConnectionImpl* RedisManager::GetBounded(int db, int64_t max_staleness_ms, std::string* err_msg) {
+    if (db < 0 || db >= MAX_DB_NUM) {
+        return NULL;
+    }
+    TopologyPtr topology = std::atomic_load(&topology_);
+    if (!topology) {
+        if (err_msg) {
+            *err_msg = ERR_NOT_INITED;
+        }
+        return NULL;
+    }
+    int pool_db = topology->option.share_db_pool ? DEFAULT_DB : db;
+    int index = PickSlave(topology.get(), max_staleness_ms < 0 ? 0 : max_staleness_ms);
+    if (index < 0) {
+        return Borrow(GetPool(topology.get(), MASTER, pool_db, 0), db, err_msg);
+    }
+    return Borrow(GetPool(topology.get(), SLAVE, pool_db, index), db, err_msg);
+}
+
+RedisReply RedisManager::DoBounded(int db, int64_t max_staleness_ms, const char* format, ...) {
+    RedisConnection conn = GetBounded(db, max_staleness_ms);
+    if (!conn) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    va_list ap;
+    va_start(ap, format);
+    RedisReply reply = conn->DoV(format, ap);
+    va_end(ap);
+    return reply;
+}
+
+bool RedisManager::StartReplicaProbe(int interval_ms, int64_t max_lag_ms) {
+    if (!inited_ || probe_thread_.joinable() || interval_ms <= 0) {
+        return false;
+    }
+    probe_interval_ms_ = interval_ms;
+    max_lag_ms_ = max_lag_ms;
+    probe_thread_ = std::thread(&RedisManager::ProbeReplicas, this);
+    return true;
+}
+
+void RedisManager::ProbeReplicas() {
+    ReplicaLagTracker tracker;
+    Topology* last = NULL;
+    while (!stopping_) {
+        TopologyPtr topology = std::atomic_load(&topology_);
+        if (!topology) {
+            break;
+        }
+        if (topology.get() != last) {
+            // offsets of another master
+            tracker.Reset();
+            last = topology.get();
+        }
+        std::string value;
+        {
+            RedisConnection conn = GetPool(topology.get(), MASTER, DEFAULT_DB, 0)->Get();
+            RedisReply info = conn ? conn->Do("INFO replication") : RedisReply();
+            // RESP3 gives INFO as a verbatim string
+            if ((info.is_string() || info.is_verbatim()) && info_field(info.toString(), "master_repl_offset", &value)) {
+                tracker.AddMasterOffset(__get_current_time_ms(), atoll(value.c_str()));
+            }
+        }
+        for (size_t i = 0; i < topology->slave_addr.size(); ++i) {
+            RedisConnection conn = GetPool(topology.get(), SLAVE, DEFAULT_DB, i)->Get();
+            RedisReply info = conn ? conn->Do("INFO replication") : RedisReply();
+            std::string text = (info.is_string() || info.is_verbatim()) ? info.toString() : "";
+            int64_t lag = -1;
+            if (info_field(text, "master_link_status", &value) && value == "up"
+                    && (!info_field(text, "master_sync_in_progress", &value) || value == "0")
+                    && info_field(text, "slave_repl_offset", &value)) {
+                lag = tracker.LagMs(__get_current_time_ms(), atoll(value.c_str()));
+            }
+            bool ejected = (lag < 0) || (max_lag_ms_ >= 0 && lag > max_lag_ms_);
+            cLogIf(ejected != topology->slave_ejected[i], WARN, "slave %s %s the read rotation, lag %ld ms",
+                    topology->slave_addr[i].full_host.c_str(), ejected ? "leaves" : "rejoins", (long)lag);
+            topology->slave_lag_ms[i] = lag;
+            topology->slave_ejected[i] = ejected;
+        }
+        topology.reset();
+        for (int waited = 0; waited < probe_interval_ms_ && !stopping_; waited += STOP_CHECK_MS) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(std::min(STOP_CHECK_MS, probe_interval_ms_ - waited)));
+        }
+    }
+}
+
+int64_t RedisManager::replica_lag_ms(int index) const {
+    TopologyPtr topology = std::atomic_load(&topology_);
+    if (!topology || index < 0 || index >= (int)topology->slave_addr.size()) {
+        return -1;
+    }
+    return topology->slave_lag_ms[index];
+}
+
+void RedisManager::EnableHedgedReads(double percentile, double budget) {
+    std::atomic_store(&hedge_, std::make_shared<HedgePolicy>(percentile, budget));
+}
+
+void RedisManager::DisableHedgedReads() {
+    std::atomic_store(&hedge_, std::shared_ptr<HedgePolicy>());
+}
+
+uint64_t RedisManager::hedge_cnt() const {
+    std::shared_ptr<HedgePolicy> hedge = std::atomic_load(&hedge_);
+    return hedge ? hedge->hedge_cnt() : 0;
+}
+
+uint64_t RedisManager::hedge_win_cnt() const {
+    std::shared_ptr<HedgePolicy> hedge = std::atomic_load(&hedge_);
+    return hedge ? hedge->win_cnt() : 0;
+}
+
+void RedisManager::EnableCoalescing() {
+    std::atomic_store(&flights_, std::make_shared<SingleFlight>());
+}
+
+void RedisManager::DisableCoalescing() {
+    std::atomic_store(&flights_, std::shared_ptr<SingleFlight>());
+}
+
+uint64_t RedisManager::coalesced_cnt() const {
+    std::shared_ptr<SingleFlight> flights = std::atomic_load(&flights_);
+    return flights ? flights->shared_cnt() : 0;
+}
+
+std::string RedisManager::RegisterScript(const std::string& body) {
+    std::string sha = scripts_->Add(body);
+    TopologyPtr topology = std::atomic_load(&topology_);
+    if (topology) {
+        LoadScripts(topology.get(), std::vector<std::string>(1, body));
+    }
+    return sha;
+}
+
+void RedisManager::LoadScripts(Topology* topology, const std::vector<std::string>& bodies) {
+    if (bodies.empty()) {
+        return;
+    }
+    // the script cache is per server, not per DB
+    int server_cnt = 1 + topology->slave_addr.size();
+    for (int k = 0; k < server_cnt; ++k) {
+        RedisRole role = (k == 0) ? MASTER : SLAVE;
+        const ServiceAddress& addr = (k == 0) ? topology->master_addr : topology->slave_addr[k - 1];
+        (void)addr; // only logged, and logs are compiled out without USE_DEBUG
+        std::string err;
+        RedisConnection conn = GetPool(topology, role, DEFAULT_DB, k == 0 ? 0 : k - 1)->Get(&err);
+        if (!conn) {
+            // EvalScript loads them on NOSCRIPT once the server is back
+            cLog(WARN, "scripts not loaded to %s: %s", addr.full_host.c_str(), err.c_str());
+            continue;
+        }
+        for (auto& body : bodies) {
+            conn->Append("SCRIPT LOAD %b", body.data(), body.size());
+        }
+        while (conn->pending_replies() > 0) {
+            RedisReply reply = conn->GetReply();
+            cLogIf(!reply.is_string(), WARN, "SCRIPT LOAD to %s failed: %s", addr.full_host.c_str(), reply.err_str().c_str());
+        }
+    }
+}
+
+RedisReply RedisManager::EvalScript(int db, const std::string& sha,
+        const std::vector<std::string>& keys,
+        const std::vector<std::string>& args,
+        RedisRole role) {
+    std::vector<std::string> command;
+    command.reserve(3 + keys.size() + args.size());
+    command.push_back("EVALSHA");
+    command.push_back(sha);
+    command.push_back(std::to_string(keys.size()));
+    command.insert(command.end(), keys.begin(), keys.end());
+    command.insert(command.end(), args.begin(), args.end());
+    RedisConnection conn = Get(db, NULL, role);
+    if (!conn) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    RedisReply reply = conn->DoArgv(command);
+    if (reply.error() && reply.err_str().compare(0, 8, "NOSCRIPT") == 0) {
+        // the server lost its script cache, by a restart or 'SCRIPT FLUSH'
+        std::string body;
+        if (!scripts_->Find(sha, &body)) {
+            return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_SCRIPT_UNKNOWN);
+        }
+        cLog(INFO, "script %s reloaded on NOSCRIPT", sha.c_str());
+        RedisReply loaded = conn->Do("SCRIPT LOAD %b", body.data(), body.size());
+        if (!loaded.is_string()) {
+            return loaded;
+        }
+        reply = conn->DoArgv(command);
+    }
+    // a script run on master may have written
     if (role == MASTER) {
-        for (int i = 0; i < MAX_DB_NUM; ++i) {
-            if (master_[i]) {
-                count += master_[i]->active_cnt();
+        WriteDone();
+    }
+    return reply;
+}
+
+static int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// index of the first of 'fds' with data to read within 'timeout_ms', -1 if none
+static int wait_readable(const std::vector<int>& fds, int timeout_ms) {
+    std::vector<struct pollfd> pfds(fds.size());
+    for (size_t i = 0; i < fds.size(); ++i) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+        pfds[i].revents = 0;
+    }
+    if (poll(pfds.data(), pfds.size(), timeout_ms) <= 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < pfds.size(); ++i) {
+        if (pfds[i].revents) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+RedisReply RedisManager::DoHedged(int db, HedgePolicy* hedge, const char* cmd, size_t len) {
+    TopologyPtr topology = std::atomic_load(&topology_);
+    if (!topology) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_NOT_INITED);
+    }
+    int pool_db = topology->option.share_db_pool ? DEFAULT_DB : db;
+    int first = PickSlave(topology.get(), -1);
+    RedisConnection conn = Borrow(GetPool(topology.get(), first < 0 ? MASTER : SLAVE, pool_db, std::max(first, 0)), db, NULL);
+    if (!conn) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    int64_t start = now_us();
+    if (!conn->AppendFormatted(cmd, len) || !conn->Flush()) {
+        return conn->Share();
+    }
+    int64_t delay_us = hedge->DelayUs();
+    int second = (first < 0 || delay_us < 0) ? -1 : PickSlave(topology.get(), -1, first);
+    // poll has ms precision, sub-ms delays wait 1 ms
+    if (second >= 0 && wait_readable(std::vector<int>(1, conn->fd()), (delay_us + 999) / 1000) < 0
+            && hedge->TakeHedge()) {
+        RedisConnection backup = Borrow(GetPool(topology.get(), SLAVE, pool_db, second), db, NULL);
+        if (backup && backup->AppendFormatted(cmd, len) && backup->Flush()) {
+            std::vector<int> fds;
+            fds.push_back(conn->fd());
+            fds.push_back(backup->fd());
+            if (wait_readable(fds, timeout_ms_) == 1) {
+                // the slow reply is given up with its connection
+                conn->Close();
+                hedge->AddWin();
+                hedge->AddLatency(now_us() - start);
+                return backup->GetReply();
             }
+            backup->Close();
         }
-    } else {
-        for (int i = 0; i < MAX_DB_NUM; ++i) {
-            for (int j = 0; j < slave_cnt_; ++j) {
-                if (slave_[i] && slave_[i][j]) {
-                    count += slave_[i][j]->active_cnt();
-                }
+    }
+    RedisReply reply = conn->GetReply();
+    hedge->AddLatency(now_us() - start);
+    return reply;
+}
+
+RedisConnectionImpl* RedisManager::Borrow(RedisConnectionPool* pool, int db, std::string* err_msg) {
+    if (!pool->option().share_db_pool) {
+        return pool->Get(err_msg);
+    }
+    // an idle connection already on 'db' saves a SELECT
+    RedisConnection conn = pool->GetPreferred([db](const RedisConnectionImpl* c) { return c->db() == db; }, err_msg);
+    if (!conn) {
+        return NULL;
+    }
+    if (!conn->Select(db)) {
+        // the connection is dropped when 'conn' goes out of scope
+        if (err_msg) {
+            *err_msg = conn->err_str();
+        }
+        return NULL;
+    }
+    RedisConnectionImpl* impl = conn.mutable_impl();
+    conn.set_impl(NULL);
+    return impl;
+}
+
+// the last write of the calling thread through every manager, taken once its
+// reply came back: when it was done and the last flight started by then
+struct LastWrite {
+    LastWrite() : ms(0), flight_seq(0) { }
+
+    uint64_t ms;
+    uint64_t flight_seq;
+};
+static thread_local std::map<uint64_t, LastWrite> t_last_write;
+
+void RedisManager::WriteDone() {
+    LastWrite& last = t_last_write[id_];
+    last.ms = __get_current_time_ms();
+    last.flight_seq = SingleFlight::sequence();
+}
+
+RedisRole RedisManager::Route(RouteHint hint, bool readonly) {
+    if (hint != ROUTE_AUTO) {
+        return (hint == ROUTE_SLAVE) ? SLAVE : MASTER;
+    }
+    if (!readonly) {
+        return MASTER;
+    }
+    if (read_your_writes_ms_ > 0) {
+        auto iter = t_last_write.find(id_);
+        if (iter != t_last_write.end() && iter->second.ms + read_your_writes_ms_ > __get_current_time_ms()) {
+            return MASTER;
+        }
+    }
+    return SLAVE;
+}
+
+RedisReply RedisManager::Do(int db, const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    RedisReply reply = DoRouteV(db, ROUTE_AUTO, format, ap);
+    va_end(ap);
+    return reply;
+}
+
+RedisReply RedisManager::DoRoute(int db, RouteHint hint, const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    RedisReply reply = DoRouteV(db, hint, format, ap);
+    va_end(ap);
+    return reply;
+}
+
+RedisReply RedisManager::DoFormatted(int db, RedisRole role, HedgePolicy* hedge, SingleFlight* flights, const char* cmd, size_t len) {
+    if (flights) {
+        // the same command on another DB or role is another request
+        std::string key(1, (char)db);
+        key.push_back((char)role);
+        key.append(cmd, len);
+        auto iter = t_last_write.find(id_);
+        uint64_t last_write_seq = (iter != t_last_write.end()) ? iter->second.flight_seq : 0;
+        return flights->Do(key, last_write_seq, [=]() {
+            return DoFormatted(db, role, hedge, NULL, cmd, len);
+        });
+    }
+    if (hedge) {
+        return DoHedged(db, hedge, cmd, len);
+    }
+    RedisConnection conn = Get(db, NULL, role);
+    if (!conn) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    if (!conn->AppendFormatted(cmd, len)) {
+        return conn->Share();
+    }
+    return conn->GetReply();
+}
+
+RedisReply RedisManager::DoRouteV(int db, RouteHint hint, const char* format, va_list ap) {
+    bool readonly = is_readonly_command(format);
+    RedisRole role = Route(hint, readonly);
+    std::shared_ptr<HedgePolicy> hedge = std::atomic_load(&hedge_);
+    std::shared_ptr<SingleFlight> flights = std::atomic_load(&flights_);
+    bool hedged = hedge && readonly && role == SLAVE && db >= 0 && db < MAX_DB_NUM;
+    bool coalesced = flights && readonly;
+    if (hedged || coalesced) {
+        char* cmd = NULL;
+        int len = redisvFormatCommand(&cmd, format, ap);
+        if (len < 0) {
+            return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_FORMAT);
+        }
+        RedisReply reply = DoFormatted(db, role, hedged ? hedge.get() : NULL, coalesced ? flights.get() : NULL, cmd, len);
+        redisFreeCommand(cmd);
+        return reply;
+    }
+    RedisConnection conn = Get(db, NULL, role);
+    if (!conn) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    RedisReply reply = conn->DoV(format, ap);
+    if (!readonly) {
+        WriteDone();
+    }
+    return reply;
+}
+
+RedisReply RedisManager::DoArgv(int db, const std::vector<std::string>& args, RouteHint hint) {
+    bool readonly = is_readonly_command(args);
+    RedisRole role = Route(hint, readonly);
+    std::shared_ptr<HedgePolicy> hedge = std::atomic_load(&hedge_);
+    std::shared_ptr<SingleFlight> flights = std::atomic_load(&flights_);
+    bool hedged = hedge && readonly && role == SLAVE && db >= 0 && db < MAX_DB_NUM;
+    bool coalesced = flights && readonly;
+    if (hedged || coalesced) {
+        std::vector<const char*> argv(args.size());
+        std::vector<size_t> argvlen(args.size());
+        for (size_t i = 0; i < args.size(); ++i) {
+            argv[i] = args[i].data();
+            argvlen[i] = args[i].size();
+        }
+        char* cmd = NULL;
+        int len = redisFormatCommandArgv(&cmd, args.size(), argv.data(), argvlen.data());
+        if (len < 0) {
+            return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_FORMAT);
+        }
+        RedisReply reply = DoFormatted(db, role, hedged ? hedge.get() : NULL, coalesced ? flights.get() : NULL, cmd, len);
+        redisFreeCommand(cmd);
+        return reply;
+    }
+    RedisConnection conn = Get(db, NULL, role);
+    if (!conn) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    RedisReply reply = conn->DoArgv(args);
+    if (!readonly) {
+        WriteDone();
+    }
+    return reply;
+}
+
+bool RedisManager::DoNoReply(int db, const std::vector<std::vector<std::string>>& commands, std::string* err_msg) {
+    RedisConnection conn = Get(db, err_msg, MASTER);
+    if (!conn) {
+        return false;
+    }
+    bool ok = conn->BeginNoReply();
+    for (size_t i = 0; ok && i < commands.size(); ++i) {
+        ok = conn->AppendArgv(commands[i]);
+    }
+    ok = ok && conn->EndNoReply();
+    // reads of the calling thread follow the writes to master
+    WriteDone();
+    if (!ok && err_msg) {
+        *err_msg = conn->err_str();
+    }
+    return ok;
+}
+
+int RedisManager::slave_cnt() const {
+    TopologyPtr topology = std::atomic_load(&topology_);
+    return topology ? topology->slave_addr.size() : 0;
+}
+
+ServiceAddress RedisManager::master_address() const {
+    TopologyPtr topology = std::atomic_load(&topology_);
+    return topology ? topology->master_addr : ServiceAddress();
+}
+
+int RedisManager::ActiveConnectionCount(RedisRole role) {
+    TopologyPtr topology = std::atomic_load(&topology_);
+    int count = 0;
+    if (!topology) {
+        return count;
+    }
+    for (int i = 0; i < MAX_DB_NUM; ++i) {
+        if (role == MASTER) {
+            RedisConnectionPool* pool = topology->master[i].load();
+            count += pool ? pool->active_cnt() : 0;
+        } else {
+            for (size_t j = 0; j < topology->slave_addr.size(); ++j) {
+                RedisConnectionPool* pool = topology->slave[i][j].load();
+                count += pool ? pool->active_cnt() : 0;
             }
         }
     }
@@ -219,19 +1004,19 @@ int RedisManager::ActiveConnectionCount(RedisRole role) {
 }
 
 int RedisManager::ConnectionInPool(RedisRole role) {
+    TopologyPtr topology = std::atomic_load(&topology_);
     int count = 0;
-    if (role == MASTER) {
-        for (int i = 0; i < MAX_DB_NUM; ++i) {
-            if (master_[i]) {
-                count += master_[i]->conn_in_pool();
-            }
-        }
-    } else {
-        for (int i = 0; i < MAX_DB_NUM; ++i) {
-            for (int j = 0; j < slave_cnt_; ++j) {
-                if (slave_[i] && slave_[i][j]) {
-                    count += slave_[i][j]->conn_in_pool();
-                }
+    if (!topology) {
+        return count;
+    }
+    for (int i = 0; i < MAX_DB_NUM; ++i) {
+        if (role == MASTER) {
+            RedisConnectionPool* pool = topology->master[i].load();
+            count += pool ? pool->conn_in_pool() : 0;
+        } else {
+            for (size_t j = 0; j < topology->slave_addr.size(); ++j) {
+                RedisConnectionPool* pool = topology->slave[i][j].load();
+                count += pool ? pool->conn_in_pool() : 0;
             }
         }
     }
@@ -7,12 +7,25 @@
 #ifndef CLORIS_CLOREDIS_H_
 #define CLORIS_CLOREDIS_H_
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include "connection.h"
 
 #define MAX_DB_NUM 16
 #define MAX_SLAVE_CNT 16
 #define DEFAULT_DB 0
+#define DEFAULT_READ_YOUR_WRITES_MS 1000
+#define DEFAULT_PROBE_INTERVAL_MS 1000
+#define DEFAULT_MAX_REPLICA_LAG_MS 5000
+#define DEFAULT_HEDGE_PERCENTILE 0.95
+#define DEFAULT_HEDGE_BUDGET 0.05
+
+#define ERR_BAD_FORMAT      "bad command format"
+#define ERR_RELOAD_SENTINEL "topology is followed from sentinel"
+#define ERR_SCRIPT_UNKNOWN  "script not registered"
 
 #define CLOREDIS_SONAME libcloredis
 #define CLOREDIS_MAJOR 0
@@ -25,12 +38,32 @@ enum RedisRole {
     SLAVE  = 1,
 };
 
+enum RouteHint {
+    ROUTE_AUTO   = 0,   // read-only commands to a slave, others to master
+    ROUTE_MASTER = 1,
+    ROUTE_SLAVE  = 2,
+};
+
+// a unix socket endpoint is 'unix:///path/to/redis.sock'
+#define UNIX_SOCKET_SCHEME "unix://"
+
 struct ServiceAddress {
-    std::string host;
+    std::string host;       // socket path for a unix socket
     std::string full_host;
-    int port;
+    int port;               // 0 for a unix socket
 };
 
+// parse comma separated 'host:port' or 'unix:///path' list, malformed items are skipped
+std::vector<ServiceAddress> parse_address_vector(const std::string& host);
+// narrow 'key' to its hash tag, the part between the first '{' and the next '}',
+// if there is a non-empty one; keys sharing a tag are placed on the same node
+void key_hash_tag(const char** key, size_t* len);
+
+class Sentinel;
+class HedgePolicy;
+class SingleFlight;
+class ScriptRegistry;
+
 class RedisManager {
 public: 
     static RedisManager* instance();
@@ -47,25 +80,138 @@ public:
                    int timeout_ms = DEFAULT_TIMEOUT_MS,
                    ConnectionPoolOption* option = NULL,
                    std::string* err_msg = NULL); 
+    // resolve the master and slaves monitored as 'master_name' by a comma separated
+    // sentinel list, then follow failovers: new borrows go to the promoted master,
+    // connections borrowed before stay usable and their pools are freed once all 
+    // of them are returned
+    bool InitSentinel(const std::string& sentinel_hosts,
+                   const std::string& master_name,
+                   const std::string& password = "", 
+                   int timeout_ms = DEFAULT_TIMEOUT_MS,
+                   ConnectionPoolOption* option = NULL,
+                   std::string* err_msg = NULL); 
     RedisConnectionImpl* Get(int db = DEFAULT_DB, std::string* err_msg = NULL, RedisRole role = MASTER, int index = -1);
+    // switch to another master/slaves, and pool options if 'option' is given, 
+    // without stopping traffic: new pools are connected first, as many connections
+    // as the current ones have, then replace the current pools at once. Borrowed
+    // connections stay usable and their old pools are freed when all are returned.
+    // Nothing changes if any server can't be connected. Not for sentinel managers
+    bool Reload(const std::string& master_host,
+                   const std::string& slave_hosts,
+                   ConnectionPoolOption* option = NULL,
+                   std::string* err_msg = NULL);
     void Flush();
 
+    // run a command on master or on a slave as the command table says: read-only
+    // commands go to slaves, unless the calling thread wrote through this manager
+    // within the last 'read_your_writes_ms'
+    RedisReply Do(int db, const char* format, ...);
+    RedisReply DoRoute(int db, RouteHint hint, const char* format, ...);
+    RedisReply DoArgv(int db, const std::vector<std::string>& args, RouteHint hint = ROUTE_AUTO);
+    // fire-and-forget writes: send 'commands' to master as one batch under
+    // 'CLIENT REPLY OFF', true once redis has read them all. Their own replies,
+    // errors included, are never seen
+    bool DoNoReply(int db, const std::vector<std::vector<std::string>>& commands, std::string* err_msg = NULL);
+    // 0 sends reads to slaves right after a write
+    void set_read_your_writes_ms(int ms) { read_your_writes_ms_ = ms; }
+
+    // probe every slave by 'INFO replication' each 'interval_ms'. A slave lagging
+    // more than 'max_lag_ms', cut from its master or in a full resync leaves the
+    // read rotation until it catches up
+    bool StartReplicaProbe(int interval_ms = DEFAULT_PROBE_INTERVAL_MS, int64_t max_lag_ms = DEFAULT_MAX_REPLICA_LAG_MS);
+    // bounded staleness: a slave lagging at most 'max_staleness_ms' by the last
+    // probe, or master if there is none
+    RedisConnectionImpl* GetBounded(int db, int64_t max_staleness_ms, std::string* err_msg = NULL);
+    RedisReply DoBounded(int db, int64_t max_staleness_ms, const char* format, ...);
+    // lag of slave 'index' in ms by the last probe, -1 if unknown or broken
+    int64_t replica_lag_ms(int index) const;
+
+    // hedged reads: once on, a read-only command routed to a slave by Do/DoRoute/
+    // DoArgv is sent again to another slave if no reply came within the
+    // 'percentile' latency of recent reads. The first reply wins and the other
+    // connection is closed. Hedges are at most 'budget' of the reads
+    void EnableHedgedReads(double percentile = DEFAULT_HEDGE_PERCENTILE, double budget = DEFAULT_HEDGE_BUDGET);
+    void DisableHedgedReads();
+    // hedges sent, and how many of them answered first
+    uint64_t hedge_cnt() const;
+    uint64_t hedge_win_cnt() const;
+
+    // request coalescing: once on, identical read-only commands run at the same
+    // time by Do/DoRoute/DoArgv on the same DB and role share one request, all of
+    // them get its reply. A thread never joins a request started before its own
+    // last write was answered
+    void EnableCoalescing();
+    void DisableCoalescing();
+    // reads served by the request of another thread
+    uint64_t coalesced_cnt() const;
+
+    // Lua scripts: 'RegisterScript' keeps 'body' under its SHA1, computed locally,
+    // and returns it. Registered scripts are sent by 'SCRIPT LOAD' to master and
+    // every slave at init and at registration, and to the new servers before a
+    // Reload or a sentinel failover switches to them. 'EvalScript' runs one by
+    // EVALSHA, and on NOSCRIPT loads it on that server and runs it again
+    std::string RegisterScript(const std::string& body);
+    RedisReply EvalScript(int db, const std::string& sha,
+                   const std::vector<std::string>& keys,
+                   const std::vector<std::string>& args = std::vector<std::string>(),
+                   RedisRole role = MASTER);
+
     int ActiveConnectionCount(RedisRole role = MASTER);
     int ConnectionInUse(RedisRole role = MASTER);
     int ConnectionInPool(RedisRole role = MASTER);
-    int slave_cnt() const { return slave_cnt_; }
+    int slave_cnt() const;
+    ServiceAddress master_address() const;
 private:
-    void InitConnectionPool(RedisRole role, int db, int slave_slot);
+    // addresses and per-DB pools of one master/slaves layout, a failover
+    // replaces it as a whole
+    struct Topology;
+    typedef std::shared_ptr<Topology> TopologyPtr;
+
+    TopologyPtr NewTopology(const ServiceAddress& master, 
+            const std::vector<ServiceAddress>& slaves,
+            const ConnectionPoolOption& option);
+    RedisConnectionPool* GetPool(Topology* topology, RedisRole role, int db, int slave_slot);
+    RedisConnectionImpl* Borrow(RedisConnectionPool* pool, int db, std::string* err_msg);
+    bool WarmTopology(Topology* topology, Topology* old, std::string* err_msg);
+    void SwapTopology(const TopologyPtr& topology);
+    void FreeDrainedTopology();
+    void WatchSentinel();
+    RedisRole Route(RouteHint hint, bool readonly);
+    // to be called once the reply of a write came back, see 'read_your_writes_ms'
+    // and 'EnableCoalescing'
+    void WriteDone();
+    RedisReply DoRouteV(int db, RouteHint hint, const char* format, va_list ap);
+    // index of a slave in the read rotation lagging at most 'max_lag_ms' 
+    // (any lag if negative) other than 'exclude', -1 if none
+    int PickSlave(Topology* topology, int64_t max_lag_ms, int exclude = -1);
+    // run 'cmd' in protocol form on a slave, hedged by another one
+    RedisReply DoHedged(int db, HedgePolicy* hedge, const char* cmd, size_t len);
+    // run 'cmd' in protocol form on 'role', coalesced by 'flights' and hedged by 'hedge' if not NULL
+    RedisReply DoFormatted(int db, RedisRole role, HedgePolicy* hedge, SingleFlight* flights, const char* cmd, size_t len);
+    void ProbeReplicas();
+    // 'SCRIPT LOAD' every script of 'bodies' to master and slaves of 'topology'
+    void LoadScripts(Topology* topology, const std::vector<std::string>& bodies);
 
-    ServiceAddress master_addr_;
-    std::vector<ServiceAddress> slave_addr_;
-    ConnectionPoolOption option_;
+    ConnectionPoolOption option_;       // of the first topology, each topology has its own
     std::string password_;
     int timeout_ms_;
     bool inited_;
-    int  slave_cnt_;
-    RedisConnectionPool *master_[MAX_DB_NUM];
-    RedisConnectionPool **slave_[MAX_DB_NUM];
+    const uint64_t id_;
+    int read_your_writes_ms_;
+    TopologyPtr topology_;              // accessed by std::atomic_load/atomic_store
+    std::vector<TopologyPtr> retired_;  // replaced, kept until their connections are returned
+    std::mutex retired_mtx_;
+    std::mutex reload_mtx_;
+    Sentinel* sentinel_;
+    std::thread sentinel_thread_;
+    std::thread probe_thread_;
+    int probe_interval_ms_;
+    int64_t max_lag_ms_;
+    std::atomic<bool> stopping_;
+    std::atomic<bool> has_retired_;
+    std::shared_ptr<HedgePolicy> hedge_;    // accessed by std::atomic_load/atomic_store
+    std::shared_ptr<SingleFlight> flights_; // accessed by std::atomic_load/atomic_store
+    std::shared_ptr<ScriptRegistry> scripts_;
 };
 
 } // namespace cloris
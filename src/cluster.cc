@@ -0,0 +1,590 @@
+//
+// cloRedis cluster manager class implementation
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#include <string.h>
+#include <stdlib.h>
+#include <set>
+#include "internal/log.h"
+#include "cluster.h"
+
+namespace cloris {
+
+// CRC16-CCITT (XMODEM) as used by redis cluster, polynomial 0x1021
+static const uint16_t crc16tab[256] = {
+    0x0000,0x1021,0x2042,0x3063,0x4084,0x50a5,0x60c6,0x70e7,
+    0x8108,0x9129,0xa14a,0xb16b,0xc18c,0xd1ad,0xe1ce,0xf1ef,
+    0x1231,0x0210,0x3273,0x2252,0x52b5,0x4294,0x72f7,0x62d6,
+    0x9339,0x8318,0xb37b,0xa35a,0xd3bd,0xc39c,0xf3ff,0xe3de,
+    0x2462,0x3443,0x0420,0x1401,0x64e6,0x74c7,0x44a4,0x5485,
+    0xa56a,0xb54b,0x8528,0x9509,0xe5ee,0xf5cf,0xc5ac,0xd58d,
+    0x3653,0x2672,0x1611,0x0630,0x76d7,0x66f6,0x5695,0x46b4,
+    0xb75b,0xa77a,0x9719,0x8738,0xf7df,0xe7fe,0xd79d,0xc7bc,
+    0x48c4,0x58e5,0x6886,0x78a7,0x0840,0x1861,0x2802,0x3823,
+    0xc9cc,0xd9ed,0xe98e,0xf9af,0x8948,0x9969,0xa90a,0xb92b,
+    0x5af5,0x4ad4,0x7ab7,0x6a96,0x1a71,0x0a50,0x3a33,0x2a12,
+    0xdbfd,0xcbdc,0xfbbf,0xeb9e,0x9b79,0x8b58,0xbb3b,0xab1a,
+    0x6ca6,0x7c87,0x4ce4,0x5cc5,0x2c22,0x3c03,0x0c60,0x1c41,
+    0xedae,0xfd8f,0xcdec,0xddcd,0xad2a,0xbd0b,0x8d68,0x9d49,
+    0x7e97,0x6eb6,0x5ed5,0x4ef4,0x3e13,0x2e32,0x1e51,0x0e70,
+    0xff9f,0xefbe,0xdfdd,0xcffc,0xbf1b,0xaf3a,0x9f59,0x8f78,
+    0x9188,0x81a9,0xb1ca,0xa1eb,0xd10c,0xc12d,0xf14e,0xe16f,
+    0x1080,0x00a1,0x30c2,0x20e3,0x5004,0x4025,0x7046,0x6067,
+    0x83b9,0x9398,0xa3fb,0xb3da,0xc33d,0xd31c,0xe37f,0xf35e,
+    0x02b1,0x1290,0x22f3,0x32d2,0x4235,0x5214,0x6277,0x7256,
+    0xb5ea,0xa5cb,0x95a8,0x8589,0xf56e,0xe54f,0xd52c,0xc50d,
+    0x34e2,0x24c3,0x14a0,0x0481,0x7466,0x6447,0x5424,0x4405,
+    0xa7db,0xb7fa,0x8799,0x97b8,0xe75f,0xf77e,0xc71d,0xd73c,
+    0x26d3,0x36f2,0x0691,0x16b0,0x6657,0x7676,0x4615,0x5634,
+    0xd94c,0xc96d,0xf90e,0xe92f,0x99c8,0x89e9,0xb98a,0xa9ab,
+    0x5844,0x4865,0x7806,0x6827,0x18c0,0x08e1,0x3882,0x28a3,
+    0xcb7d,0xdb5c,0xeb3f,0xfb1e,0x8bf9,0x9bd8,0xabbb,0xbb9a,
+    0x4a75,0x5a54,0x6a37,0x7a16,0x0af1,0x1ad0,0x2ab3,0x3a92,
+    0xfd2e,0xed0f,0xdd6c,0xcd4d,0xbdaa,0xad8b,0x9de8,0x8dc9,
+    0x7c26,0x6c07,0x5c64,0x4c45,0x3ca2,0x2c83,0x1ce0,0x0cc1,
+    0xef1f,0xff3e,0xcf5d,0xdf7c,0xaf9b,0xbfba,0x8fd9,0x9ff8,
+    0x6e17,0x7e36,0x4e55,0x5e74,0x2e93,0x3eb2,0x0ed1,0x1ef0,
+};
+
+static uint16_t crc16(const char* buf, size_t len) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; ++i) {
+        crc = (crc << 8) ^ crc16tab[((crc >> 8) ^ (uint8_t)buf[i]) & 0x00FF];
+    }
+    return crc;
+}
+
+// parse 'MOVED 3999 127.0.0.1:6381' or 'ASK 3999 127.0.0.1:6381'
+static bool parse_redirect(const char* msg, const char* prefix, int* slot, std::string* host, int* port) {
+    size_t prefix_len = strlen(prefix);
+    if (strncmp(msg, prefix, prefix_len) != 0) {
+        return false;
+    }
+    const char* p = msg + prefix_len;
+    char* end = NULL;
+    long s = strtol(p, &end, 10);
+    if (end == p || *end != ' ' || s < 0 || s >= CLUSTER_SLOTS) {
+        return false;
+    }
+    const char* addr = end + 1;
+    const char* colon = strrchr(addr, ':');
+    if (!colon) {
+        return false;
+    }
+    *slot = (int)s;
+    host->assign(addr, colon - addr);
+    *port = atoi(colon + 1);
+    return *port > 0;
+}
+
+int RedisClusterManager::KeyHashSlot(const char* key, size_t len) {
+    key_hash_tag(&key, &len);
+    return crc16(key, len) & (CLUSTER_SLOTS - 1);
+}
+
+RedisClusterManager::RedisClusterManager()
+    : timeout_ms_(DEFAULT_TIMEOUT_MS),
+      inited_(false),
+      last_refresh_ms_(0) {
+    cLog(TRACE, "RedisClusterManager constructor ");
+    for (int i = 0; i < CLUSTER_SLOTS; ++i) {
+        slots_[i].store(NULL, std::memory_order_relaxed);
+    }
+}
+
+RedisClusterManager::~RedisClusterManager() {
+    cLog(TRACE, "RedisClusterManager ~ destructor");
+    for (auto& item : nodes_) {
+        delete item.second->pool;
+        delete item.second;
+    }
+    nodes_.clear();
+    inited_ = false;
+}
+
+ClusterNode* RedisClusterManager::GetNode(const std::string& host, int port) {
+    std::string full_host = (port == 0) ? UNIX_SOCKET_SCHEME + host : host + ":" + std::to_string(port);
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto iter = nodes_.find(full_host);
+    if (iter != nodes_.end()) {
+        return iter->second;
+    }
+    ClusterNode* node = new ClusterNode;
+    node->addr.host = host;
+    node->addr.port = port;
+    node->addr.full_host = full_host;
+    // cluster nodes only have db 0
+    RedisConnectionPool::InitHandler handler = std::bind(&RedisConnectionImpl::Init, std::placeholders::_1,
+            host,
+            port,
+            password_,
+            timeout_ms_,
+            DEFAULT_DB);
+    node->pool = new RedisConnectionPool(&option_, handler);
+    nodes_[full_host] = node;
+    cLog(INFO, "cluster node %s added", full_host.c_str());
+    return node;
+}
+
+bool RedisClusterManager::Init(const std::string& seed_hosts,
+             const std::string& password,
+             int timeout_ms,
+             ConnectionPoolOption* option,
+             std::string* err_msg) {
+    if (inited_) {
+        cLog(ERROR, ERR_REENTERING);
+        if (err_msg) {
+            *err_msg = ERR_REENTERING;
+        }
+        return false;
+    }
+    std::vector<ServiceAddress> seeds = parse_address_vector(seed_hosts);
+    if (seeds.empty()) {
+        cLog(ERROR, ERR_BAD_HOST);
+        if (err_msg) {
+            *err_msg = ERR_BAD_HOST;
+        }
+        return false;
+    }
+    inited_ = true;
+    if (option) {
+        option_ = *option;
+    }
+    password_ = password;
+    timeout_ms_ = timeout_ms;
+
+    for (auto& seed : seeds) {
+        if (RefreshFrom(GetNode(seed.host, seed.port), err_msg)) {
+            return true;
+        }
+    }
+    cLog(ERROR, "no seed node answers CLUSTER SLOTS");
+    return false;
+}
+
+bool RedisClusterManager::RefreshFrom(ClusterNode* node, std::string* err_msg) {
+    RedisConnection conn = node->pool->Get(err_msg);
+    if (!conn) {
+        if (err_msg) {
+            *err_msg = ERR_BAD_CONNECTION;
+        }
+        return false;
+    }
+    // [[start, end, [master_host, master_port, ...], [replica ...] ...] ...]
+    RedisReply slots = conn->Do("CLUSTER SLOTS");
+    if (!slots.is_array() || slots.size() == 0) {
+        cLog(ERROR, "CLUSTER SLOTS on %s failed: %s", node->addr.full_host.c_str(), slots.err_str().c_str());
+        if (err_msg) {
+            *err_msg = slots.error() ? slots.err_str() : ERR_CLUSTER_SLOTS;
+        }
+        return false;
+    }
+    bool updated = false;
+    for (size_t i = 0; i < slots.size(); ++i) {
+        RedisReply range = slots[i];
+        if (!range.is_array() || range.size() < 3) {
+            continue;
+        }
+        int64_t start = range[0].toInt64();
+        int64_t end = range[1].toInt64();
+        RedisReply master = range[2];
+        if (start < 0 || end >= CLUSTER_SLOTS || start > end || master.size() < 2) {
+            continue;
+        }
+        std::string host = master[0].toString();
+        int port = master[1].toInt32();
+        // an empty host means the node we are asking
+        ClusterNode* owner = GetNode(host.empty() ? node->addr.host : host, port);
+        for (int64_t s = start; s <= end; ++s) {
+            slots_[s].store(owner, std::memory_order_release);
+        }
+        updated = true;
+    }
+    if (!updated) {
+        if (err_msg) {
+            *err_msg = ERR_CLUSTER_SLOTS;
+        }
+        return false;
+    }
+    last_refresh_ms_ = __get_current_time_ms();
+    return true;
+}
+
+bool RedisClusterManager::Refresh(std::string* err_msg) {
+    std::lock_guard<std::mutex> refresh_lk(refresh_mtx_);
+    std::vector<ClusterNode*> nodes;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for (auto& item : nodes_) {
+            nodes.push_back(item.second);
+        }
+    }
+    // start from a random node so that a dead one is not always asked first
+    size_t begin = nodes.empty() ? 0 : rand() % nodes.size();
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (RefreshFrom(nodes[(begin + i) % nodes.size()], err_msg)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// reload the slot map at most once per CLUSTER_REFRESH_INTERVAL_MS, threads do
+// not wait for a reload another thread is doing already
+void RedisClusterManager::MaybeRefresh() {
+    if (last_refresh_ms_ + CLUSTER_REFRESH_INTERVAL_MS > __get_current_time_ms()) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lk(refresh_mtx_, std::try_to_lock);
+        if (!lk.owns_lock()) {
+            return;
+        }
+        // mark it now so threads racing behind us skip the reload
+        last_refresh_ms_ = __get_current_time_ms();
+    }
+    Refresh();
+}
+
+RedisConnectionImpl* RedisClusterManager::GetBySlot(int slot, std::string* err_msg) {
+    if (slot < 0 || slot >= CLUSTER_SLOTS) {
+        if (err_msg) {
+            *err_msg = ERR_CLUSTER_NO_NODE;
+        }
+        return NULL;
+    }
+    ClusterNode* node = slots_[slot].load(std::memory_order_acquire);
+    if (!node) {
+        MaybeRefresh();
+        node = slots_[slot].load(std::memory_order_acquire);
+    }
+    if (!node) {
+        if (err_msg) {
+            *err_msg = ERR_CLUSTER_NO_NODE;
+        }
+        return NULL;
+    }
+    return node->pool->Get(err_msg);
+}
+
+RedisConnectionImpl* RedisClusterManager::Get(const std::string& key, std::string* err_msg) {
+    return GetBySlot(KeyHashSlot(key), err_msg);
+}
+
+std::vector<int> RedisClusterManager::MasterSlots() {
+    std::vector<int> slots;
+    std::set<ClusterNode*> seen;
+    for (int slot = 0; slot < CLUSTER_SLOTS; ++slot) {
+        ClusterNode* node = slots_[slot].load(std::memory_order_acquire);
+        if (node && seen.insert(node).second) {
+            slots.push_back(slot);
+        }
+    }
+    return slots;
+}
+
+RedisReply RedisClusterManager::Execute(int slot, const CommandHandler& handler) {
+    if (slot < 0 || slot >= CLUSTER_SLOTS) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_CLUSTER_NO_NODE);
+    }
+    ClusterNode* node = slots_[slot].load(std::memory_order_acquire);
+    bool asking = false;
+    RedisReply reply(NULL, true, STATE_ERROR_INVOKE, ERR_CLUSTER_NO_NODE);
+    for (int i = 0; i <= CLUSTER_MAX_REDIRECTS; ++i) {
+        if (!node) {
+            MaybeRefresh();
+            node = slots_[slot].load(std::memory_order_acquire);
+            if (!node) {
+                return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_CLUSTER_NO_NODE);
+            }
+        }
+        RedisConnection conn = node->pool->Get();
+        if (!conn) {
+            // the node may be down and its slots failed over to another one
+            MaybeRefresh();
+            return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+        }
+        if (asking) {
+            conn->Do("ASKING");
+        }
+        reply = handler(conn.mutable_impl());
+        if (reply.err_state() == STATE_ERROR_HIREDIS) {
+            MaybeRefresh();
+            return reply;
+        }
+        if (!reply.error()) {
+            return reply;
+        }
+        int redirect_slot;
+        std::string host;
+        int port;
+        if (parse_redirect(reply.err_msg(), "MOVED ", &redirect_slot, &host, &port)) {
+            // the slot has moved for good: fix it at once, reload the rest lazily
+            node = GetNode(host, port);
+            slots_[redirect_slot].store(node, std::memory_order_release);
+            asking = false;
+            MaybeRefresh();
+        } else if (parse_redirect(reply.err_msg(), "ASK ", &redirect_slot, &host, &port)) {
+            // the slot is migrating, only this command goes to the importing node
+            node = GetNode(host, port);
+            asking = true;
+        } else {
+            return reply;
+        }
+        cLog(DEBUG, "slot %d redirected to %s:%d", redirect_slot, host.c_str(), port);
+    }
+    return reply;
+}
+
+RedisReply RedisClusterManager::Do(const std::string& key, const char* format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    RedisReply reply = DoV(key, format, ap);
+    va_end(ap);
+    return reply;
+}
+
+RedisReply RedisClusterManager::DoV(const std::string& key, const char* format, va_list ap) {
+    return Execute(KeyHashSlot(key), [&](RedisConnectionImpl* conn) {
+        // a redirected command is formatted again, each attempt needs its own va_list
+        va_list aq;
+        va_copy(aq, ap);
+        RedisReply reply = conn->DoV(format, aq);
+        va_end(aq);
+        return reply;
+    });
+}
+
+RedisReply RedisClusterManager::DoArgv(const std::vector<std::string>& args, size_t key_index) {
+    int slot = (key_index < args.size()) ? KeyHashSlot(args[key_index]) : 0;
+    return Execute(slot, [&](RedisConnectionImpl* conn) {
+        return conn->DoArgv(args);
+    });
+}
+
+struct RedisClusterManager::BatchItem {
+    std::vector<std::string> argv;
+    int slot;
+    ClusterNode* node;      // set while the item is ASK redirected
+    bool asking;
+    RedisReply reply;
+};
+
+void RedisClusterManager::ExecuteBatch(std::vector<BatchItem>* items) {
+    std::vector<BatchItem*> pending;
+    for (auto& item : *items) {
+        item.node = NULL;
+        item.asking = false;
+        pending.push_back(&item);
+    }
+    bool need_refresh = false;
+    for (int i = 0; i <= CLUSTER_MAX_REDIRECTS && !pending.empty(); ++i) {
+        // group by node, the caller's order is kept inside every group
+        std::map<ClusterNode*, std::vector<BatchItem*> > groups;
+        for (BatchItem* item : pending) {
+            if (!item->asking) {
+                item->node = slots_[item->slot].load(std::memory_order_acquire);
+                if (!item->node) {
+                    MaybeRefresh();
+                    item->node = slots_[item->slot].load(std::memory_order_acquire);
+                }
+            }
+            if (!item->node) {
+                item->reply = RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_CLUSTER_NO_NODE);
+                continue;
+            }
+            groups[item->node].push_back(item);
+        }
+        pending.clear();
+
+        // send every pipeline before reading any reply
+        std::vector<RedisConnection> conns;
+        std::vector<bool> sent(groups.size(), false);
+        conns.reserve(groups.size());
+        for (auto& group : groups) {
+            conns.emplace_back(group.first->pool->Get());
+            RedisConnection& conn = conns.back();
+            if (!conn) {
+                need_refresh = true;
+                continue;
+            }
+            bool ok = true;
+            for (BatchItem* item : group.second) {
+                if (item->asking) {
+                    ok = ok && conn->AppendArgv({"ASKING"});
+                }
+                ok = ok && conn->AppendArgv(item->argv);
+            }
+            sent[conns.size() - 1] = ok && conn->Flush();
+        }
+
+        size_t index = 0;
+        for (auto& group : groups) {
+            RedisConnection& conn = conns[index];
+            bool group_sent = sent[index++];
+            for (BatchItem* item : group.second) {
+                if (!conn) {
+                    item->reply = RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+                    continue;
+                }
+                if (!group_sent) {
+                    // the pipeline never got out, every item gets the error of the connection
+                    item->reply = conn->Share();
+                    need_refresh = true;
+                    continue;
+                }
+                if (item->asking) {
+                    conn->GetReply();
+                }
+                item->reply = conn->GetReply();
+                if (item->reply.err_state() == STATE_ERROR_HIREDIS) {
+                    need_refresh = true;
+                    continue;
+                }
+                if (!item->reply.error()) {
+                    continue;
+                }
+                int redirect_slot;
+                std::string host;
+                int port;
+                if (parse_redirect(item->reply.err_msg(), "MOVED ", &redirect_slot, &host, &port)) {
+                    slots_[redirect_slot].store(GetNode(host, port), std::memory_order_release);
+                    item->asking = false;
+                    need_refresh = true;
+                    pending.push_back(item);
+                } else if (parse_redirect(item->reply.err_msg(), "ASK ", &redirect_slot, &host, &port)) {
+                    item->node = GetNode(host, port);
+                    item->asking = true;
+                    pending.push_back(item);
+                }
+            }
+        }
+    }
+    if (need_refresh) {
+        MaybeRefresh();
+    }
+}
+
+void RedisClusterManager::SplitBySlot(const std::string& command, 
+        const std::vector<std::string>& keys, 
+        const std::vector<std::string>* values,
+        std::vector<BatchItem>* items,
+        std::vector<std::vector<size_t> >* positions) {
+    std::map<int, size_t> slot_items;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int slot = KeyHashSlot(keys[i]);
+        auto iter = slot_items.find(slot);
+        if (iter == slot_items.end()) {
+            iter = slot_items.insert(std::make_pair(slot, items->size())).first;
+            items->emplace_back();
+            items->back().argv.push_back(command);
+            items->back().slot = slot;
+            positions->emplace_back();
+        }
+        BatchItem& item = (*items)[iter->second];
+        item.argv.push_back(keys[i]);
+        if (values) {
+            item.argv.push_back((*values)[i]);
+        }
+        (*positions)[iter->second].push_back(i);
+    }
+}
+
+std::vector<RedisReply> RedisClusterManager::Pipeline(const std::vector<std::vector<std::string> >& commands, size_t key_index) {
+    std::vector<BatchItem> items(commands.size());
+    for (size_t i = 0; i < commands.size(); ++i) {
+        items[i].argv = commands[i];
+        items[i].slot = (key_index < commands[i].size()) ? KeyHashSlot(commands[i][key_index]) : 0;
+    }
+    ExecuteBatch(&items);
+    std::vector<RedisReply> replies;
+    replies.reserve(items.size());
+    for (auto& item : items) {
+        replies.push_back(std::move(item.reply));
+    }
+    return replies;
+}
+
+std::vector<RedisReply> RedisClusterManager::MGet(const std::vector<std::string>& keys) {
+    std::vector<BatchItem> items;
+    std::vector<std::vector<size_t> > positions;
+    SplitBySlot("MGET", keys, NULL, &items, &positions);
+    ExecuteBatch(&items);
+    std::vector<RedisReply> replies(keys.size());
+    for (size_t i = 0; i < items.size(); ++i) {
+        const RedisReply& reply = items[i].reply;
+        bool ok = reply.is_array() && reply.size() == positions[i].size();
+        for (size_t j = 0; j < positions[i].size(); ++j) {
+            // elements share the MGET reply, an error is shared by all its keys
+            replies[positions[i][j]] = ok ? reply.get(j) : reply.Share();
+        }
+    }
+    return replies;
+}
+
+bool RedisClusterManager::MSet(const std::vector<std::string>& keys, const std::vector<std::string>& values, std::string* err_msg) {
+    if (keys.size() != values.size()) {
+        if (err_msg) {
+            *err_msg = ERR_BATCH_SIZE;
+        }
+        return false;
+    }
+    std::vector<BatchItem> items;
+    std::vector<std::vector<size_t> > positions;
+    SplitBySlot("MSET", keys, &values, &items, &positions);
+    ExecuteBatch(&items);
+    for (auto& item : items) {
+        if (item.reply.error()) {
+            if (err_msg) {
+                *err_msg = item.reply.err_str();
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t RedisClusterManager::KeyCount(const std::string& command, const std::vector<std::string>& keys, std::string* err_msg) {
+    std::vector<BatchItem> items;
+    std::vector<std::vector<size_t> > positions;
+    SplitBySlot(command, keys, NULL, &items, &positions);
+    ExecuteBatch(&items);
+    int64_t count = 0;
+    for (auto& item : items) {
+        if (!item.reply.is_int()) {
+            if (err_msg) {
+                *err_msg = item.reply.error() ? item.reply.err_str() : ERR_REPLY_TYPE;
+            }
+            return -1;
+        }
+        count += item.reply.toInt64();
+    }
+    return count;
+}
+
+int RedisClusterManager::node_cnt() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return nodes_.size();
+}
+
+int RedisClusterManager::ActiveConnectionCount() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    int count = 0;
+    for (auto& item : nodes_) {
+        count += item.second->pool->active_cnt();
+    }
+    return count;
+}
+
+int RedisClusterManager::ConnectionInPool() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    int count = 0;
+    for (auto& item : nodes_) {
+        count += item.second->pool->conn_in_pool();
+    }
+    return count;
+}
+
+} // namespace cloris
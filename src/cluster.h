@@ -0,0 +1,112 @@
+//
+// cloRedis cluster manager class definition
+// RedisClusterManager routes every key to the master owning its hash slot,
+// following MOVED/ASK redirects and keeping one connection pool per node
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#ifndef CLORIS_CLOREDIS_CLUSTER_H_
+#define CLORIS_CLOREDIS_CLUSTER_H_
+
+#include <stdarg.h>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <vector>
+#include "cloredis.h"
+
+#define CLUSTER_SLOTS 16384
+#define CLUSTER_MAX_REDIRECTS 5
+#define CLUSTER_REFRESH_INTERVAL_MS 1000
+
+#define ERR_CLUSTER_NO_NODE "no cluster node serves the slot"
+#define ERR_CLUSTER_SLOTS   "bad CLUSTER SLOTS reply"
+
+namespace cloris {
+
+// node of a redis cluster, created on first sight and kept until the manager is destructed
+struct ClusterNode {
+    ServiceAddress addr;
+    RedisConnectionPool* pool;
+};
+
+class RedisClusterManager {
+public:
+    typedef std::function<RedisReply(RedisConnectionImpl*)> CommandHandler;
+
+    RedisClusterManager();
+    ~RedisClusterManager();
+    // 'seed_hosts' is a comma separated list of cluster nodes, the slot map is
+    // bootstrapped by 'CLUSTER SLOTS' from the first one that answers
+    bool Init(const std::string& seed_hosts,
+              const std::string& password = "",
+              int timeout_ms = DEFAULT_TIMEOUT_MS,
+              ConnectionPoolOption* option = NULL,
+              std::string* err_msg = NULL);
+    // connection to the master serving 'key' according to the current slot map,
+    // redirects are not followed for commands run on it
+    RedisConnectionImpl* Get(const std::string& key, std::string* err_msg = NULL);
+    RedisConnectionImpl* GetBySlot(int slot, std::string* err_msg = NULL);
+    // one slot of every master in the current slot map, to reach each of them by GetBySlot
+    std::vector<int> MasterSlots();
+
+    // run a command on the node serving 'key', following MOVED/ASK redirects
+    RedisReply Do(const std::string& key, const char* format, ...);
+    RedisReply DoV(const std::string& key, const char* format, va_list ap);
+    // run a command whose key is args[key_index]
+    RedisReply DoArgv(const std::vector<std::string>& args, size_t key_index = 1);
+    // run 'handler' on a connection to the node serving 'slot', following redirects
+    RedisReply Execute(int slot, const CommandHandler& handler);
+
+    // Batch API. Commands are grouped by the node serving their slot and every node
+    // gets one pipeline; all pipelines are sent before any reply is read, so nodes
+    // work in parallel. Replies come back in the caller's order, and only commands
+    // answered by MOVED/ASK are sent again.
+    std::vector<RedisReply> Pipeline(const std::vector<std::vector<std::string> >& commands, size_t key_index = 1);
+    // MGET over keys of any slots, one reply per key
+    std::vector<RedisReply> MGet(const std::vector<std::string>& keys);
+    bool MSet(const std::vector<std::string>& keys, const std::vector<std::string>& values, std::string* err_msg = NULL);
+    // DEL/UNLINK/EXISTS/TOUCH over keys of any slots, returns the summed count, -1 on error
+    int64_t KeyCount(const std::string& command, const std::vector<std::string>& keys, std::string* err_msg = NULL);
+    int64_t Del(const std::vector<std::string>& keys, std::string* err_msg = NULL) { return KeyCount("DEL", keys, err_msg); }
+
+    // reload the whole slot map by 'CLUSTER SLOTS'
+    bool Refresh(std::string* err_msg = NULL);
+
+    static int KeyHashSlot(const char* key, size_t len);
+    static int KeyHashSlot(const std::string& key) { return KeyHashSlot(key.data(), key.size()); }
+
+    int node_cnt();
+    int ActiveConnectionCount();
+    int ConnectionInPool();
+    int ConnectionInUse() { return ActiveConnectionCount() - ConnectionInPool(); }
+private:
+    struct BatchItem;
+    void ExecuteBatch(std::vector<BatchItem>* items);
+    // one command per slot: 'command' followed by the keys (and values) of the slot,
+    // 'positions' gets the indexes of the keys each command covers
+    void SplitBySlot(const std::string& command, 
+            const std::vector<std::string>& keys, 
+            const std::vector<std::string>* values,
+            std::vector<BatchItem>* items,
+            std::vector<std::vector<size_t> >* positions);
+    ClusterNode* GetNode(const std::string& host, int port);
+    bool RefreshFrom(ClusterNode* node, std::string* err_msg);
+    void MaybeRefresh();
+
+    ConnectionPoolOption option_;
+    std::string password_;
+    int timeout_ms_;
+    bool inited_;
+    std::map<std::string, ClusterNode*> nodes_;
+    std::mutex mutex_;          // protects 'nodes_'
+    std::mutex refresh_mtx_;    // only one thread reloads the slot map at a time
+    std::atomic<uint64_t> last_refresh_ms_;
+    std::atomic<ClusterNode*> slots_[CLUSTER_SLOTS];
+};
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_CLUSTER_H_
@@ -0,0 +1,287 @@
+//
+// cloRedis command table implementation
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#include <ctype.h>
+#include <string.h>
+#include <unordered_map>
+#include "command.h"
+
+namespace cloris {
+
+#define R CMD_READONLY
+#define W CMD_WRITE
+#define M CMD_MOVABLE_KEYS
+#define A CMD_ADMIN
+
+// name, flags, first key, last key, key step
+static const CommandInfo command_table[] = {
+    // string
+    {"GET", R, 1, 1, 1},
+    {"GETRANGE", R, 1, 1, 1},
+    {"SUBSTR", R, 1, 1, 1},
+    {"STRLEN", R, 1, 1, 1},
+    {"MGET", R, 1, -1, 1},
+    {"GETBIT", R, 1, 1, 1},
+    {"BITCOUNT", R, 1, 1, 1},
+    {"BITPOS", R, 1, 1, 1},
+    {"SET", W, 1, 1, 1},
+    {"SETNX", W, 1, 1, 1},
+    {"SETEX", W, 1, 1, 1},
+    {"PSETEX", W, 1, 1, 1},
+    {"GETSET", W, 1, 1, 1},
+    {"GETDEL", W, 1, 1, 1},
+    {"GETEX", W, 1, 1, 1},
+    {"APPEND", W, 1, 1, 1},
+    {"SETRANGE", W, 1, 1, 1},
+    {"MSET", W, 1, -1, 2},
+    {"MSETNX", W, 1, -1, 2},
+    {"INCR", W, 1, 1, 1},
+    {"DECR", W, 1, 1, 1},
+    {"INCRBY", W, 1, 1, 1},
+    {"DECRBY", W, 1, 1, 1},
+    {"INCRBYFLOAT", W, 1, 1, 1},
+    {"SETBIT", W, 1, 1, 1},
+    {"BITOP", W, 2, -1, 1},
+    {"BITFIELD", W, 1, 1, 1},
+    // key space
+    {"EXISTS", R, 1, -1, 1},
+    {"TYPE", R, 1, 1, 1},
+    {"TTL", R, 1, 1, 1},
+    {"PTTL", R, 1, 1, 1},
+    {"EXPIRETIME", R, 1, 1, 1},
+    {"PEXPIRETIME", R, 1, 1, 1},
+    {"KEYS", R, 0, 0, 0},
+    {"SCAN", R, 0, 0, 0},
+    {"RANDOMKEY", R, 0, 0, 0},
+    {"DBSIZE", R, 0, 0, 0},
+    {"DUMP", R, 1, 1, 1},
+    {"TOUCH", R, 1, -1, 1},
+    {"OBJECT", R, 2, 2, 1},
+    {"DEL", W, 1, -1, 1},
+    {"UNLINK", W, 1, -1, 1},
+    {"EXPIRE", W, 1, 1, 1},
+    {"PEXPIRE", W, 1, 1, 1},
+    {"EXPIREAT", W, 1, 1, 1},
+    {"PEXPIREAT", W, 1, 1, 1},
+    {"PERSIST", W, 1, 1, 1},
+    {"RENAME", W, 1, 2, 1},
+    {"RENAMENX", W, 1, 2, 1},
+    {"MOVE", W, 1, 1, 1},
+    {"COPY", W, 1, 2, 1},
+    {"RESTORE", W, 1, 1, 1},
+    {"SORT", W | M, 1, 1, 1},
+    {"SORT_RO", R, 1, 1, 1},
+    {"FLUSHDB", W | A, 0, 0, 0},
+    {"FLUSHALL", W | A, 0, 0, 0},
+    // hash
+    {"HGET", R, 1, 1, 1},
+    {"HMGET", R, 1, 1, 1},
+    {"HGETALL", R, 1, 1, 1},
+    {"HKEYS", R, 1, 1, 1},
+    {"HVALS", R, 1, 1, 1},
+    {"HLEN", R, 1, 1, 1},
+    {"HSTRLEN", R, 1, 1, 1},
+    {"HEXISTS", R, 1, 1, 1},
+    {"HSCAN", R, 1, 1, 1},
+    {"HRANDFIELD", R, 1, 1, 1},
+    {"HSET", W, 1, 1, 1},
+    {"HSETNX", W, 1, 1, 1},
+    {"HMSET", W, 1, 1, 1},
+    {"HDEL", W, 1, 1, 1},
+    {"HINCRBY", W, 1, 1, 1},
+    {"HINCRBYFLOAT", W, 1, 1, 1},
+    // list
+    {"LINDEX", R, 1, 1, 1},
+    {"LLEN", R, 1, 1, 1},
+    {"LRANGE", R, 1, 1, 1},
+    {"LPOS", R, 1, 1, 1},
+    {"LPUSH", W, 1, 1, 1},
+    {"RPUSH", W, 1, 1, 1},
+    {"LPUSHX", W, 1, 1, 1},
+    {"RPUSHX", W, 1, 1, 1},
+    {"LINSERT", W, 1, 1, 1},
+    {"LSET", W, 1, 1, 1},
+    {"LREM", W, 1, 1, 1},
+    {"LTRIM", W, 1, 1, 1},
+    {"LPOP", W, 1, 1, 1},
+    {"RPOP", W, 1, 1, 1},
+    {"RPOPLPUSH", W, 1, 2, 1},
+    {"LMOVE", W, 1, 2, 1},
+    {"BLPOP", W, 1, -2, 1},
+    {"BRPOP", W, 1, -2, 1},
+    {"BRPOPLPUSH", W, 1, 2, 1},
+    {"BLMOVE", W, 1, 2, 1},
+    // set
+    {"SCARD", R, 1, 1, 1},
+    {"SISMEMBER", R, 1, 1, 1},
+    {"SMISMEMBER", R, 1, 1, 1},
+    {"SMEMBERS", R, 1, 1, 1},
+    {"SRANDMEMBER", R, 1, 1, 1},
+    {"SSCAN", R, 1, 1, 1},
+    {"SINTER", R, 1, -1, 1},
+    {"SUNION", R, 1, -1, 1},
+    {"SDIFF", R, 1, -1, 1},
+    {"SINTERCARD", R | M, 0, 0, 0},
+    {"SADD", W, 1, 1, 1},
+    {"SREM", W, 1, 1, 1},
+    {"SPOP", W, 1, 1, 1},
+    {"SMOVE", W, 1, 2, 1},
+    {"SINTERSTORE", W, 1, -1, 1},
+    {"SUNIONSTORE", W, 1, -1, 1},
+    {"SDIFFSTORE", W, 1, -1, 1},
+    // sorted set
+    {"ZCARD", R, 1, 1, 1},
+    {"ZCOUNT", R, 1, 1, 1},
+    {"ZLEXCOUNT", R, 1, 1, 1},
+    {"ZSCORE", R, 1, 1, 1},
+    {"ZMSCORE", R, 1, 1, 1},
+    {"ZRANK", R, 1, 1, 1},
+    {"ZREVRANK", R, 1, 1, 1},
+    {"ZRANGE", R, 1, 1, 1},
+    {"ZREVRANGE", R, 1, 1, 1},
+    {"ZRANGEBYSCORE", R, 1, 1, 1},
+    {"ZREVRANGEBYSCORE", R, 1, 1, 1},
+    {"ZRANGEBYLEX", R, 1, 1, 1},
+    {"ZREVRANGEBYLEX", R, 1, 1, 1},
+    {"ZSCAN", R, 1, 1, 1},
+    {"ZRANDMEMBER", R, 1, 1, 1},
+    {"ZADD", W, 1, 1, 1},
+    {"ZINCRBY", W, 1, 1, 1},
+    {"ZREM", W, 1, 1, 1},
+    {"ZREMRANGEBYRANK", W, 1, 1, 1},
+    {"ZREMRANGEBYSCORE", W, 1, 1, 1},
+    {"ZREMRANGEBYLEX", W, 1, 1, 1},
+    {"ZPOPMIN", W, 1, 1, 1},
+    {"ZPOPMAX", W, 1, 1, 1},
+    {"BZPOPMIN", W, 1, -2, 1},
+    {"BZPOPMAX", W, 1, -2, 1},
+    {"ZRANGESTORE", W, 1, 2, 1},
+    {"ZUNIONSTORE", W | M, 1, 1, 1},
+    {"ZINTERSTORE", W | M, 1, 1, 1},
+    {"ZDIFFSTORE", W | M, 1, 1, 1},
+    // hyperloglog, geo, stream
+    {"PFCOUNT", R, 1, -1, 1},
+    {"PFADD", W, 1, 1, 1},
+    {"PFMERGE", W, 1, -1, 1},
+    {"GEOPOS", R, 1, 1, 1},
+    {"GEODIST", R, 1, 1, 1},
+    {"GEOHASH", R, 1, 1, 1},
+    {"GEOSEARCH", R, 1, 1, 1},
+    {"GEORADIUS_RO", R, 1, 1, 1},
+    {"GEORADIUSBYMEMBER_RO", R, 1, 1, 1},
+    {"GEOADD", W, 1, 1, 1},
+    {"GEORADIUS", W | M, 1, 1, 1},
+    {"GEORADIUSBYMEMBER", W | M, 1, 1, 1},
+    {"GEOSEARCHSTORE", W, 1, 2, 1},
+    {"XLEN", R, 1, 1, 1},
+    {"XRANGE", R, 1, 1, 1},
+    {"XREVRANGE", R, 1, 1, 1},
+    {"XREAD", R | M, 0, 0, 0},
+    {"XADD", W, 1, 1, 1},
+    {"XDEL", W, 1, 1, 1},
+    {"XTRIM", W, 1, 1, 1},
+    {"XACK", W, 1, 1, 1},
+    {"XCLAIM", W, 1, 1, 1},
+    {"XGROUP", W, 2, 2, 1},
+    {"XREADGROUP", W | M, 0, 0, 0},
+    // scripting and transactions
+    {"EVAL", W | M, 0, 0, 0},
+    {"EVALSHA", W | M, 0, 0, 0},
+    {"EVAL_RO", R | M, 0, 0, 0},
+    {"EVALSHA_RO", R | M, 0, 0, 0},
+    {"FCALL", W | M, 0, 0, 0},
+    {"FCALL_RO", R | M, 0, 0, 0},
+    {"SCRIPT", A, 0, 0, 0},
+    {"MULTI", W | A, 0, 0, 0},
+    {"EXEC", W | A, 0, 0, 0},
+    {"DISCARD", W | A, 0, 0, 0},
+    {"WATCH", A, 1, -1, 1},
+    {"UNWATCH", A, 0, 0, 0},
+    // pubsub and connection
+    {"PUBLISH", W, 0, 0, 0},
+    {"SUBSCRIBE", A, 0, 0, 0},
+    {"PSUBSCRIBE", A, 0, 0, 0},
+    {"PING", R, 0, 0, 0},
+    {"ECHO", R, 0, 0, 0},
+    {"TIME", R, 0, 0, 0},
+    {"AUTH", A, 0, 0, 0},
+    {"SELECT", A, 0, 0, 0},
+    {"HELLO", A, 0, 0, 0},
+    {"CLIENT", A, 0, 0, 0},
+    {"INFO", A, 0, 0, 0},
+    {"CONFIG", A, 0, 0, 0},
+    {"WAIT", A, 0, 0, 0},
+};
+
+#undef R
+#undef W
+#undef M
+#undef A
+
+static const std::unordered_map<std::string, const CommandInfo*>& command_map() {
+    static std::unordered_map<std::string, const CommandInfo*> map = [] {
+        std::unordered_map<std::string, const CommandInfo*> m;
+        for (auto& info : command_table) {
+            m[info.name] = &info;
+        }
+        return m;
+    }();
+    return map;
+}
+
+const CommandInfo* lookup_command(const char* name, size_t len) {
+    // no command name is longer than this
+    char upper[32];
+    if (len == 0 || len >= sizeof(upper)) {
+        return NULL;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        upper[i] = toupper((unsigned char)name[i]);
+    }
+    auto iter = command_map().find(std::string(upper, len));
+    return (iter == command_map().end()) ? NULL : iter->second;
+}
+
+const CommandInfo* lookup_command(const std::string& name) {
+    return lookup_command(name.data(), name.size());
+}
+
+bool is_readonly_command(const char* format) {
+    const char* p = format;
+    while (*p == ' ') {
+        ++p;
+    }
+    size_t len = strcspn(p, " ");
+    // a name built from an argument like "%s %s" can't be known
+    if (memchr(p, '%', len)) {
+        return false;
+    }
+    const CommandInfo* info = lookup_command(p, len);
+    return info && (info->flags & CMD_READONLY);
+}
+
+bool is_readonly_command(const std::vector<std::string>& argv) {
+    if (argv.empty()) {
+        return false;
+    }
+    const CommandInfo* info = lookup_command(argv[0]);
+    return info && (info->flags & CMD_READONLY);
+}
+
+std::vector<size_t> command_key_indexes(const std::vector<std::string>& argv) {
+    std::vector<size_t> indexes;
+    const CommandInfo* info = argv.empty() ? NULL : lookup_command(argv[0]);
+    if (!info || info->first_key <= 0 || info->key_step <= 0) {
+        return indexes;
+    }
+    int last = (info->last_key < 0) ? (int)argv.size() + info->last_key : info->last_key;
+    for (int i = info->first_key; i <= last && i < (int)argv.size(); i += info->key_step) {
+        indexes.push_back(i);
+    }
+    return indexes;
+}
+
+} // namespace cloris
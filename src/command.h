@@ -0,0 +1,45 @@
+//
+// cloRedis command table definition
+// Static metadata of redis commands: whether they write, and where their keys
+// are, the way 'COMMAND INFO' reports them. Used to route reads to slaves.
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#ifndef CLORIS_CLOREDIS_COMMAND_H_
+#define CLORIS_CLOREDIS_COMMAND_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+namespace cloris {
+
+enum CommandFlag {
+    CMD_READONLY     = 1,   // never modifies data, may run on a slave
+    CMD_WRITE        = 2,
+    CMD_MOVABLE_KEYS = 4,   // keys can't be found from first/last/step (EVAL, ZUNIONSTORE ...)
+    CMD_ADMIN        = 8,   // server or connection state, always run on master
+};
+
+struct CommandInfo {
+    const char* name;       // upper case
+    int flags;
+    int first_key;          // index of the first key in argv, 0 if no key
+    int last_key;           // index of the last key, negative counts from the end
+    int key_step;
+};
+
+// look a command up by name, case insensitive, NULL if unknown
+const CommandInfo* lookup_command(const char* name, size_t len);
+const CommandInfo* lookup_command(const std::string& name);
+// whether the command in 'format' or 'argv[0]' can run on a slave; unknown
+// commands and formats not starting with a literal name are taken as writes
+bool is_readonly_command(const char* format);
+bool is_readonly_command(const std::vector<std::string>& argv);
+// indexes of the keys in 'argv' according to first/last/step
+std::vector<size_t> command_key_indexes(const std::vector<std::string>& argv);
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_COMMAND_H_
@@ -4,6 +4,7 @@
 // Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
 //
 
+#include <errno.h>
 #include <boost/algorithm/string.hpp>
 #include <sstream>
 #include "hiredis/hiredis.h"
@@ -19,7 +20,11 @@ RedisConnectionImpl::RedisConnectionImpl(RedisConnectionPool* pool)
     : RedisReply(), 
       redis_context_(NULL),
       pool_(pool),
-      action_count_(0) {
+      action_count_(0),
+      pending_replies_(0),
+      db_(0),
+      protocol_(2),
+      reply_off_(false) {
 }
 
 RedisConnectionImpl::~RedisConnectionImpl() {
@@ -35,9 +40,21 @@ bool RedisConnectionImpl::IsRawConnection() {
 
 void RedisConnectionImpl::Done() {
     cLog(DEBUG, "Reclaim connection");
+    // read out the rest of an unfinished pipeline so the connection can be reused
+    while (pending_replies_ > 0) {
+        this->GetReply();
+    }
+    // the pool only holds connections with replies on
+    if (reply_off_) {
+        this->EndNoReply();
+    }
     bool is_conn_ok = this->ok() || this->IsRawConnection();
     // convert to raw connection
     Update(NULL, true, STATE_OK, NULL); 
+    if (is_conn_ok && redis_context_) {
+        // do not let an idle connection hold the buffers of a large reply
+        redisTrimBuffers(redis_context_);
+    }
     if (pool_) {
         pool_->Put(this, is_conn_ok);
     } else {
@@ -52,23 +69,87 @@ bool RedisConnectionImpl::Connect(const std::string& host, int port, const std::
         cLog(ERROR, "internal implementation bug, redis_context is not NULL in 'Connect'");
         return false;
     }
-    redis_context_ = redisConnectWithTimeout(host.c_str(), port, timeout);
+    if (port == 0) {
+        redis_context_ = redisConnectUnixWithTimeout(host.c_str(), timeout);
+    } else {
+        redis_context_ = redisConnectWithTimeout(host.c_str(), port, timeout);
+    }
     if (!redis_context_) {
         this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
         cLog(ERROR, "No memory in creating new request");
         return false;
     }
     if (redis_context_->err) {
-        this->Update(NULL, true, STATE_ERROR_HIREDIS, redis_context_->errstr);
+        int sys_errno = errno; // cLog may clobber it
+        cLog(ERROR, "hiredis error: %s", redis_context_->errstr);
+        this->UpdateHiredisError(redis_context_->err, sys_errno);
+        return false;
+    }
+    if (pool_ && pool_->option().max_retained_buffer >= 0) {
+        redisSetMaxBuffer(redis_context_, pool_->option().max_retained_buffer);
+    }
+    redis_context_->push_cb = &RedisConnectionImpl::OnPush;
+    redis_context_->push_privdata = this;
+    if (password.size() > 0 && !this->Do("AUTH %s", password.c_str()).ok()) {
         return false;
     }
-    if (password.size() == 0) {
-        this->Update(NULL, true, STATE_OK, "");
+    protocol_ = 2;
+    if (pool_ && pool_->option().protocol == 3) {
+        if (this->Do("HELLO 3").ok()) {
+            protocol_ = 3;
+        } else if (this->reply_) {
+            // redis before 6 has no HELLO, go on with RESP2
+            cLog(WARN, "HELLO 3 refused by %s:%d, using RESP2: %s", host.c_str(), port, this->err_msg());
+        } else {
+            return false;
+        }
+    }
+    // a new connection is on db 0
+    db_ = 0;
+    if (!this->Select(db)) {
+        return false;
+    }
+    this->Update(NULL, true, STATE_OK, "");
+    return true;
+}
+
+void RedisConnectionImpl::set_push_handler(const PushHandler& handler) {
+    push_handler_ = handler;
+}
+
+void RedisConnectionImpl::OnPush(void* privdata, void* reply) {
+    RedisConnectionImpl* conn = static_cast<RedisConnectionImpl*>(privdata);
+    RedisReply push((redisReply*)reply, true, STATE_OK, "");
+    if (conn->push_handler_) {
+        conn->push_handler_(std::move(push));
+    } else {
+        cLog(DEBUG, "push message dropped, no handler");
+    }
+}
+
+int RedisConnectionImpl::fd() const {
+    return redis_context_ ? redis_context_->fd : -1;
+}
+
+void RedisConnectionImpl::Close() {
+    if (redis_context_) {
+        redisFree(redis_context_);
+        redis_context_ = NULL;
+    }
+    this->pending_replies_ = 0;
+    this->reply_off_ = false;
+    this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+}
+
+bool RedisConnectionImpl::Select(int db) {
+    if (db == db_) {
         return true;
     }
-    this->Do("AUTH %s", password.c_str());
-    this->Do("SELECT %d", db);
-    return this->ok();
+    if (!this->Do("SELECT %d", db).ok()) {
+        return false;
+    }
+    db_ = db;
+    return true;
 }
 
 bool RedisConnectionImpl::Init(void *p, const std::string& host, int port, const std::string& password, int timeout_ms, int db) {
@@ -77,34 +158,245 @@ bool RedisConnectionImpl::Init(void *p, const std::string& host, int port, const
     return obj->Connect(host, port, password, timeout, db);
 }
 
-RedisConnectionImpl& RedisConnectionImpl::Do(const char *format, ...) {
+RedisReply RedisConnectionImpl::Do(const char *format, ...) {
     va_list ap;
     va_start(ap, format);
-    RedisConnectionImpl& resp = this->__Do(format, ap);
+    RedisReply resp = this->DoV(format, ap);
     va_end(ap);
     return resp;
 }
 
-RedisConnectionImpl& RedisConnectionImpl::__Do(const char *format, va_list ap) {
+RedisReply RedisConnectionImpl::DoV(const char *format, va_list ap) {
     ++this->action_count_;
-    std::string value("");
-
     if (!redis_context_) {
         this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
-        return *this; 
+        return this->Share(); 
+    }
+    if (reply_off_) {
+        // no reply would ever come
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_REPLY_OFF);
+        return this->Share(); 
+    }
+    if (pending_replies_ > 0) {
+        // the first reply read would be one of the pipeline's
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_REPLIES_PENDING);
+        return this->Share(); 
     }
     redisReply* reply = (redisReply*)redisvCommand(redis_context_, format, ap);
-    if (redis_context_->err) {
-        this->Update(NULL, true, STATE_ERROR_HIREDIS, redis_context_->errstr);
-        return *this; 
+    return this->TakeReply(reply);
+}
+
+RedisReply RedisConnectionImpl::DoArgv(int argc, const char **argv, const size_t *argvlen) {
+    ++this->action_count_;
+    if (!redis_context_) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+        return this->Share(); 
+    }
+    if (reply_off_) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_REPLY_OFF);
+        return this->Share(); 
     }
+    if (pending_replies_ > 0) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_REPLIES_PENDING);
+        return this->Share(); 
+    }
+    redisReply* reply = (redisReply*)redisCommandArgvRef(redis_context_, argc, argv, argvlen);
+    return this->TakeReply(reply);
+}
+
+RedisReply RedisConnectionImpl::DoArgv(const std::vector<std::string>& args) {
+    std::vector<const char*> argv(args.size());
+    std::vector<size_t> argvlen(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        argv[i] = args[i].data();
+        argvlen[i] = args[i].size();
+    }
+    return this->DoArgv(args.size(), argv.data(), argvlen.data());
+}
 
-    if (reply != NULL) {
+bool RedisConnectionImpl::Append(const char *format, ...) {
+    if (!redis_context_) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+        return false; 
+    }
+    va_list ap;
+    va_start(ap, format);
+    int ret = redisvAppendCommand(redis_context_, format, ap);
+    va_end(ap);
+    if (ret != REDIS_OK) {
+        int sys_errno = errno;
+        cLog(ERROR, "hiredis error: %s", redis_context_->errstr);
+        this->UpdateHiredisError(redis_context_->err, sys_errno);
+        return false;
+    }
+    if (!reply_off_) {
+        ++this->pending_replies_;
+    }
+    return true;
+}
+
+bool RedisConnectionImpl::AppendArgv(int argc, const char **argv, const size_t *argvlen) {
+    if (!redis_context_) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+        return false; 
+    }
+    if (redisAppendCommandArgv(redis_context_, argc, argv, argvlen) != REDIS_OK) {
+        int sys_errno = errno;
+        cLog(ERROR, "hiredis error: %s", redis_context_->errstr);
+        this->UpdateHiredisError(redis_context_->err, sys_errno);
+        return false;
+    }
+    if (!reply_off_) {
+        ++this->pending_replies_;
+    }
+    return true;
+}
+
+bool RedisConnectionImpl::AppendArgv(const std::vector<std::string>& args) {
+    std::vector<const char*> argv(args.size());
+    std::vector<size_t> argvlen(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        argv[i] = args[i].data();
+        argvlen[i] = args[i].size();
+    }
+    return this->AppendArgv(args.size(), argv.data(), argvlen.data());
+}
+
+bool RedisConnectionImpl::BeginNoReply() {
+    if (reply_off_) {
+        return true;
+    }
+    // 'EndNoReply' would read one of them as the reply of CLIENT REPLY ON,
+    // and every later reply would shift by one
+    if (pending_replies_ > 0) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_REPLIES_PENDING);
+        return false;
+    }
+    static const char* argv[] = { "CLIENT", "REPLY", "OFF" };
+    static const size_t argvlen[] = { 6, 5, 3 };
+    // CLIENT REPLY OFF has no reply itself
+    reply_off_ = true;
+    if (!this->AppendArgv(3, argv, argvlen)) {
+        reply_off_ = false;
+        return false;
+    }
+    return true;
+}
+
+bool RedisConnectionImpl::EndNoReply() {
+    if (!reply_off_) {
+        return true;
+    }
+    static const char* argv[] = { "CLIENT", "REPLY", "ON" };
+    static const size_t argvlen[] = { 6, 5, 2 };
+    reply_off_ = false;
+    // the commands queued before go out in the same write, and the reply
+    // tells they were all read by redis
+    if (!this->AppendArgv(3, argv, argvlen)) {
+        return false;
+    }
+    return this->GetReply().ok();
+}
+
+bool RedisConnectionImpl::AppendSkip(int argc, const char **argv, const size_t *argvlen) {
+    if (reply_off_) {
+        return this->AppendArgv(argc, argv, argvlen);
+    }
+    static const char* skip_argv[] = { "CLIENT", "REPLY", "SKIP" };
+    static const size_t skip_argvlen[] = { 6, 5, 4 };
+    // neither CLIENT REPLY SKIP nor the next command has a reply
+    reply_off_ = true;
+    bool ok = this->AppendArgv(3, skip_argv, skip_argvlen) && this->AppendArgv(argc, argv, argvlen);
+    reply_off_ = false;
+    return ok;
+}
+
+bool RedisConnectionImpl::AppendSkip(const std::vector<std::string>& args) {
+    std::vector<const char*> argv(args.size());
+    std::vector<size_t> argvlen(args.size());
+    for (size_t i = 0; i < args.size(); ++i) {
+        argv[i] = args[i].data();
+        argvlen[i] = args[i].size();
+    }
+    return this->AppendSkip(args.size(), argv.data(), argvlen.data());
+}
+
+bool RedisConnectionImpl::AppendFormatted(const char *cmd, size_t len) {
+    if (!redis_context_) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+        return false; 
+    }
+    if (redisAppendFormattedCommand(redis_context_, cmd, len) != REDIS_OK) {
+        int sys_errno = errno;
+        cLog(ERROR, "hiredis error: %s", redis_context_->errstr);
+        this->UpdateHiredisError(redis_context_->err, sys_errno);
+        return false;
+    }
+    if (!reply_off_) {
+        ++this->pending_replies_;
+    }
+    return true;
+}
+
+RedisReply RedisConnectionImpl::GetReply() {
+    if (!redis_context_) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+        return this->Share(); 
+    }
+    if (pending_replies_ <= 0) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_NO_PENDING_REPLY);
+        return this->Share(); 
+    }
+    ++this->action_count_;
+    void* reply = NULL;
+    if (redisGetReply(redis_context_, &reply) == REDIS_OK) {
+        --this->pending_replies_;
+    } else {
+        // the connection is broken, no more replies will come
+        this->pending_replies_ = 0;
+    }
+    return this->TakeReply((redisReply*)reply);
+}
+
+bool RedisConnectionImpl::Flush() {
+    if (!redis_context_) {
+        this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+        return false; 
+    }
+    int done = 0;
+    do {
+        if (redisBufferWrite(redis_context_, &done) != REDIS_OK) {
+            int sys_errno = errno;
+            cLog(ERROR, "hiredis error: %s", redis_context_->errstr);
+            this->UpdateHiredisError(redis_context_->err, sys_errno);
+            this->pending_replies_ = 0;
+            return false;
+        }
+    } while (!done);
+    return true;
+}
+
+RedisReply RedisConnectionImpl::TakeReply(redisReply* reply) {
+    if (redis_context_->err) {
+        int sys_errno = errno;
+        cLog(ERROR, "hiredis error: %s", redis_context_->errstr);
+        this->UpdateHiredisError(redis_context_->err, sys_errno);
+    } else if (reply != NULL) {
         this->Update(reply, true, STATE_OK, "");
     } else {
         this->Update(NULL, true, STATE_ERROR_INVOKE, ERR_REPLY_NULL);
     }
-    return *this;
+    return this->Share();
+}
+
+redisReadStats RedisConnectionImpl::read_stats() const {
+    redisReadStats stats;
+    if (redis_context_) {
+        stats = redis_context_->rstats;
+    } else {
+        memset(&stats, 0, sizeof(stats));
+    }
+    return stats;
 }
 
 RedisConnection::~RedisConnection() {
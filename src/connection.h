@@ -9,6 +9,8 @@
 #ifndef CLORIS_CLOREDIS_CONNECTION_H_
 #define  CLORIS_CLOREDIS_CONNECTION_H_
 
+#include <functional>
+#include <vector>
 #include "internal/connection_pool.h"
 #include "reply.h"
 
@@ -21,8 +23,13 @@
 #define ERR_BAD_CONNECTION  "bad redis connection"
 #define ERR_REPLY_NULL  "redisReply object is NULL"
 #define ERR_MALLOC_ERROR "memory malloc error"
+#define ERR_NO_PENDING_REPLY "no pending reply"
+#define ERR_BATCH_SIZE  "keys and values differ in number"
+#define ERR_REPLY_TYPE  "unexpected reply type"
+#define ERR_REPLY_OFF   "replies are off"
+#define ERR_REPLIES_PENDING "replies are pending"
 
-class redisContext;
+struct redisContext;
 
 namespace cloris {
 
@@ -36,13 +43,68 @@ class RedisConnectionImpl : public RedisReply {
     friend IdleList<RedisConnectionImpl>;
     friend RedisConnection;
 public:
+    // 'port' 0 means 'host' is the path of a unix socket
     static bool Init(void *p, const std::string& host, int port, const std::string& password, int timeout_ms, int db);
 	RedisConnectionImpl(RedisConnectionPool*);
-    RedisConnectionImpl& Do(const char *format, ...);
+    // The returned reply is owned by the caller and stays valid after the connection
+    // runs other commands or goes back to pool. The connection itself keeps a share
+    // of the last reply, so 'conn->Do(...); conn->ok()' works as well.
+    // Do fails while replies of appended commands are still to be read.
+    RedisReply Do(const char *format, ...);
+    RedisReply DoV(const char *format, va_list ap);
+    // run a command given as separate arguments, large arguments are sent 
+    // to redis straight from the caller's memory without being copied 
+    RedisReply DoArgv(int argc, const char **argv, const size_t *argvlen);
+    RedisReply DoArgv(const std::vector<std::string>& args);
+
+    // pipeline: queue commands by 'Append', they are sent on the first 'GetReply',
+    // which then returns their replies one by one in order
+    bool Append(const char *format, ...);
+    bool AppendArgv(int argc, const char **argv, const size_t *argvlen);
+    bool AppendArgv(const std::vector<std::string>& args);
+    // queue a command already in protocol form, like the output of 'redisFormatCommand'
+    bool AppendFormatted(const char *cmd, size_t len);
+    // fire-and-forget: commands appended between 'BeginNoReply' and 'EndNoReply'
+    // are sent under 'CLIENT REPLY OFF', no reply is read nor parsed for them and
+    // Do fails meanwhile. 'EndNoReply' sends the whole batch in one write and
+    // waits for the reply of 'CLIENT REPLY ON' only; a connection going back to
+    // pool with replies off gets them on again first. 'BeginNoReply' fails while
+    // replies of commands appended before are still to be read
+    bool BeginNoReply();
+    bool EndNoReply();
+    bool reply_off() const { return reply_off_; }
+    // queue one command without reply by 'CLIENT REPLY SKIP', among commands with replies
+    bool AppendSkip(int argc, const char **argv, const size_t *argvlen);
+    bool AppendSkip(const std::vector<std::string>& args);
+    RedisReply GetReply();
+    // send the appended commands now without waiting for their replies, so that
+    // pipelines on several connections are served by redis at the same time
+    bool Flush();
+    int pending_replies() const { return pending_replies_; }
+    // switch to 'db', SELECT is sent only if the connection is on another one.
+    // Use it rather than a raw 'SELECT' so that the connection knows its DB
+    bool Select(int db);
+    int db() const { return db_; }
+    // socket of the connection for waiting on several connections by poll, -1 if none
+    int fd() const;
+    // close the socket now, giving up pending replies; the connection is dropped
+    // when it goes back to pool
+    void Close();
+    // read-size statistics of the underlying socket, all zero if not connected
+    redisReadStats read_stats() const;
+    // RESP version the connection speaks, 3 only if asked by the pool option and
+    // accepted by the server
+    int protocol() const { return protocol_; }
+    // RESP3 push messages, like invalidations of client side caching, are given to
+    // 'handler' as they are read in between replies; they are dropped without one.
+    // The handler stays with the connection when it goes back to pool
+    typedef std::function<void(RedisReply)> PushHandler;
+    void set_push_handler(const PushHandler& handler);
 private:
+    static void OnPush(void* privdata, void* reply);
 	virtual ~RedisConnectionImpl(); // forbid allocation on stack
     bool IsRawConnection();
-    RedisConnectionImpl& __Do(const char *format, va_list ap);
+    RedisReply TakeReply(redisReply* reply);
     bool Connect(const std::string& host, int port, const std::string& password, struct timeval &timeout, int db); 
     void Done();
     RedisConnectionImpl() = delete;
@@ -52,6 +114,11 @@ private:
 	redisContext* redis_context_;
     RedisConnectionPool* pool_;
     int action_count_;
+    int pending_replies_;
+    int db_;
+    int protocol_;
+    bool reply_off_;
+    PushHandler push_handler_;
 };
 
 class RedisConnection {
@@ -92,19 +92,16 @@ void AccessRedisByHgetAll() {
     conn->Do("HGETALL language");
 
     // Both demos below are OK for array-type redisReply traversing.
-    // It's noteworthy that "RedisReply" MUST BE use in the life time of "RedisConnection",
-    // (that is, RedisReply must be use before RedisConnection is destructed)
-    // code fragment likes below is strictly forbidden!
+    // "RedisReply" returned by 'Do' owns its result, so it can also be kept 
+    // and used after "RedisConnection" is destructed:
     //
     // RedisReply reply;
     // {
     //     RedisConnection conn = manager->Get(6);
-    //     reply = conn->get(0); 
-    //     ...
+    //     reply = conn->Do("HGETALL language"); 
     //     // object 'conn' will destruct here    
     // }
-    //  ...
-    // std::string value = reply.toString(); // unpredictable result
+    // std::string value = reply.get(0).toString(); // still valid
     // 
     // demo1
     std::cout << "demo1 ==>" << std::endl;
@@ -120,6 +117,28 @@ void AccessRedisByHgetAll() {
     }
 }
 
+void AccessRedisByPipeline() {
+    std::unique_ptr<RedisManager> manager(new RedisManager());
+    if (!manager->Init(g_host_master, g_password, g_timeout_ms)) {
+        std::cout << "init redis manager failed" << std::endl;
+        return;
+    }
+    std::vector<cloris::RedisReply> replies;
+    {
+        cloris::RedisConnection conn = manager->Get(6);
+        // commands are sent together by the first 'GetReply'
+        conn->Append("SET pkey1 %s", "value1");
+        conn->Append("GET pkey1");
+        conn->Append("GET pkey2");
+        while (conn->pending_replies() > 0) {
+            replies.push_back(conn->GetReply());
+        }
+    }
+    // replies outlive the connection
+    std::cout << replies[1].toString() << std::endl; // value1
+    std::cout << replies[2].is_nil() << std::endl;   // 1
+}
+
 int main(int argc, char** argv) {
     (void)argc;
     (void)argv;
@@ -127,6 +146,7 @@ int main(int argc, char** argv) {
     AccessMasterSlave();
     AccessRedisWithErrorCheck();
     AccessRedisByHgetAll();
+    AccessRedisByPipeline();
     return 0;
 }
 
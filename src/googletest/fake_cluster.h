@@ -0,0 +1,264 @@
+//
+// Local stand-in of a redis cluster for unit test: every node is a forked
+// process speaking RESP on 127.0.0.1, the slot table lives in shared memory
+// so a test can move or migrate slots while the nodes are running.
+// Copyright (c) 2018 James Wei (weijianlhp@163.com). All rights reserved.
+//
+
+#ifndef CLORIS_CLOREDIS_FAKE_CLUSTER_H_
+#define CLORIS_CLOREDIS_FAKE_CLUSTER_H_
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "cluster.h"
+
+namespace cloris {
+
+class FakeCluster {
+    struct SlotTable {
+        int owner[CLUSTER_SLOTS];
+        int migrating[CLUSTER_SLOTS];   // node importing the slot, -1 if none
+        int ports[16];
+        int redirects;                  // MOVED/ASK replies sent, all nodes
+    };
+    struct Client {
+        std::string in;
+        bool asking;
+    };
+public:
+    // slots are split evenly among 'node_cnt' nodes like 'redis-cli --cluster create'
+    explicit FakeCluster(int node_cnt) : node_cnt_(node_cnt) {
+        table_ = (SlotTable*)mmap(NULL, sizeof(SlotTable), PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        for (int s = 0; s < CLUSTER_SLOTS; ++s) {
+            table_->owner[s] = s * node_cnt / CLUSTER_SLOTS;
+            table_->migrating[s] = -1;
+        }
+        table_->redirects = 0;
+        for (int i = 0; i < node_cnt; ++i) {
+            struct sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+            listen(fd, 128);
+            socklen_t len = sizeof(addr);
+            getsockname(fd, (struct sockaddr*)&addr, &len);
+            table_->ports[i] = ntohs(addr.sin_port);
+            pid_t pid = fork();
+            if (pid == 0) {
+                Serve(i, fd);
+                _exit(0);
+            }
+            close(fd);
+            pids_.push_back(pid);
+        }
+    }
+    ~FakeCluster() {
+        for (pid_t pid : pids_) {
+            kill(pid, SIGKILL);
+            waitpid(pid, NULL, 0);
+        }
+        munmap(table_, sizeof(SlotTable));
+    }
+
+    std::string hosts() const {
+        std::string value;
+        for (int i = 0; i < node_cnt_; ++i) {
+            value += (i ? ",127.0.0.1:" : "127.0.0.1:") + std::to_string(table_->ports[i]);
+        }
+        return value;
+    }
+    int port(int node) const { return table_->ports[node]; }
+    int owner(int slot) const { return table_->owner[slot]; }
+    int redirects() const { return table_->redirects; }
+    // finish moving 'slot' to 'node', clients get MOVED from now on
+    void Move(int slot, int node) {
+        table_->owner[slot] = node;
+        table_->migrating[slot] = -1;
+    }
+    // start migrating 'slot' to 'node', clients get ASK from now on
+    void Migrate(int slot, int node) { table_->migrating[slot] = node; }
+
+private:
+    static std::string Error(const std::string& msg) { return "-" + msg + "\r\n"; }
+    static std::string Bulk(const std::string& s) {
+        return "$" + std::to_string(s.size()) + "\r\n" + s + "\r\n";
+    }
+
+    // parse one multibulk request from 'in', false if it is not complete yet
+    static bool Parse(std::string* in, std::vector<std::string>* argv) {
+        size_t pos = 0;
+        size_t eol = in->find("\r\n", pos);
+        if (eol == std::string::npos || (*in)[0] != '*') {
+            return false;
+        }
+        int argc = atoi(in->c_str() + 1);
+        pos = eol + 2;
+        argv->clear();
+        for (int i = 0; i < argc; ++i) {
+            eol = in->find("\r\n", pos);
+            if (eol == std::string::npos) {
+                return false;
+            }
+            size_t len = atoi(in->c_str() + pos + 1);
+            if (in->size() < eol + 2 + len + 2) {
+                return false;
+            }
+            argv->push_back(in->substr(eol + 2, len));
+            pos = eol + 2 + len + 2;
+        }
+        in->erase(0, pos);
+        return true;
+    }
+
+    std::string SlotsReply() {
+        std::string ranges;
+        int cnt = 0;
+        for (int s = 0; s < CLUSTER_SLOTS; ) {
+            int e = s;
+            while (e + 1 < CLUSTER_SLOTS && table_->owner[e + 1] == table_->owner[s]) {
+                ++e;
+            }
+            ranges += "*3\r\n:" + std::to_string(s) + "\r\n:" + std::to_string(e) + "\r\n"
+                + "*2\r\n" + Bulk("127.0.0.1") + ":" + std::to_string(table_->ports[table_->owner[s]]) + "\r\n";
+            ++cnt;
+            s = e + 1;
+        }
+        return "*" + std::to_string(cnt) + "\r\n" + ranges;
+    }
+
+    std::string Execute(int self, Client* client, const std::vector<std::string>& argv) {
+        std::string cmd = argv[0];
+        for (auto& c : cmd) {
+            c = toupper(c);
+        }
+        bool asking = client->asking;
+        client->asking = false;
+        if (cmd == "PING") {
+            return "+PONG\r\n";
+        } else if (cmd == "AUTH" || cmd == "SELECT") {
+            return "+OK\r\n";
+        } else if (cmd == "ASKING") {
+            client->asking = true;
+            return "+OK\r\n";
+        } else if (cmd == "CLUSTER" && argv.size() > 1) {
+            return (argv[1] == "MYID") ? Bulk("node" + std::to_string(self)) : SlotsReply();
+        }
+        // keyed commands: all keys must hash to the same slot served here
+        size_t step = (cmd == "MSET") ? 2 : 1;
+        size_t last = (cmd == "MGET" || cmd == "DEL" || cmd == "MSET") ? argv.size() : 2;
+        if (argv.size() < 2) {
+            return Error("ERR wrong number of arguments");
+        }
+        int slot = RedisClusterManager::KeyHashSlot(argv[1]);
+        for (size_t i = 1; i < last; i += step) {
+            if (RedisClusterManager::KeyHashSlot(argv[i]) != slot) {
+                return Error("CROSSSLOT Keys in request don't hash to the same slot");
+            }
+        }
+        int owner = table_->owner[slot];
+        int migrating = table_->migrating[slot];
+        if (!(owner == self && migrating < 0) && !(migrating == self && asking)) {
+            __sync_fetch_and_add(&table_->redirects, 1);
+            if (owner == self) {
+                return Error("ASK " + std::to_string(slot) + " 127.0.0.1:" + std::to_string(table_->ports[migrating]));
+            }
+            return Error("MOVED " + std::to_string(slot) + " 127.0.0.1:" + std::to_string(table_->ports[owner]));
+        }
+        if (cmd == "SET" && argv.size() == 3) {
+            data_[argv[1]] = argv[2];
+            return "+OK\r\n";
+        } else if (cmd == "MSET") {
+            for (size_t i = 1; i + 1 < argv.size(); i += 2) {
+                data_[argv[i]] = argv[i + 1];
+            }
+            return "+OK\r\n";
+        } else if (cmd == "GET" || cmd == "MGET") {
+            std::string value = (cmd == "MGET") ? "*" + std::to_string(argv.size() - 1) + "\r\n" : "";
+            for (size_t i = 1; i < last; ++i) {
+                auto iter = data_.find(argv[i]);
+                value += (iter == data_.end()) ? "$-1\r\n" : Bulk(iter->second);
+            }
+            return value;
+        } else if (cmd == "DEL") {
+            int cnt = 0;
+            for (size_t i = 1; i < argv.size(); ++i) {
+                cnt += data_.erase(argv[i]);
+            }
+            return ":" + std::to_string(cnt) + "\r\n";
+        }
+        return Error("ERR unknown command '" + argv[0] + "'");
+    }
+
+    void Serve(int self, int listen_fd) {
+        std::vector<struct pollfd> fds(1);
+        std::map<int, Client> clients;
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for (;;) {
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                continue;
+            }
+            for (size_t i = fds.size(); i-- > 1; ) {
+                if (!fds[i].revents) {
+                    continue;
+                }
+                char buf[16 * 1024];
+                ssize_t n = read(fds[i].fd, buf, sizeof(buf));
+                if (n <= 0) {
+                    close(fds[i].fd);
+                    clients.erase(fds[i].fd);
+                    fds.erase(fds.begin() + i);
+                    continue;
+                }
+                Client& client = clients[fds[i].fd];
+                client.in.append(buf, n);
+                std::vector<std::string> argv;
+                std::string out;
+                while (Parse(&client.in, &argv)) {
+                    out += argv.empty() ? Error("ERR empty request") : Execute(self, &client, argv);
+                }
+                for (size_t off = 0; off < out.size(); ) {
+                    ssize_t w = write(fds[i].fd, out.data() + off, out.size() - off);
+                    if (w <= 0 && errno != EINTR) {
+                        break;
+                    }
+                    off += (w > 0) ? w : 0;
+                }
+            }
+            if (fds[0].revents & POLLIN) {
+                struct pollfd pfd;
+                pfd.fd = accept(listen_fd, NULL, NULL);
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                if (pfd.fd >= 0) {
+                    clients[pfd.fd].asking = false;
+                    fds.push_back(pfd);
+                }
+            }
+        }
+    }
+
+    int node_cnt_;
+    SlotTable* table_;
+    std::vector<pid_t> pids_;
+    std::map<std::string, std::string> data_;
+};
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_FAKE_CLUSTER_H_
@@ -3,10 +3,29 @@
 // Copyright (c) 2018 James Wei (weijianlhp@163.com). All rights reserved.
 //
 
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <map>
+#include <set>
 #include <gtest/gtest.h>
 #include <cloriconf/config.h>
 #include "internal/log.h"
+#include "internal/replica_lag.h"
+#include "internal/hedge.h"
+#include "internal/singleflight.h"
+#include "internal/sha1.h"
 #include "cloredis.h"
+#include "aggregator.h"
+#include "bulkloader.h"
+#include "cacheaside.h"
+#include "cluster.h"
+#include "command.h"
+#include "mutator.h"
+#include "nearcache.h"
+#include "scan.h"
+#include "shard.h"
+#include "fake_cluster.h"
 
 using namespace cloris;
 
@@ -16,6 +35,10 @@ host=172.17.224.212:6379 \n\
 slave_host=172.17.224.212:6380,172.17.224.212:6381\n\
 timeout=1000\n\
 password=cloris520 \n\
+sentinel_host=172.17.224.212:26379,172.17.224.212:26380\n\
+sentinel_master=mymaster\n\
+shard_host=172.17.224.212:6379,172.17.224.212:6382,172.17.224.212:6383\n\
+unix_host=unix:///tmp/redis.sock\n\
 ";
 
 TEST(cloredis, basic_test) {
@@ -227,6 +250,1390 @@ TEST(cloredis, slave_test) {
     delete manager;
 }
 
+TEST(cloredis, argv_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    {
+        RedisConnection conn = manager->Get(4);
+        ASSERT_TRUE(conn);
+        // a value far above the zero-copy threshold and the socket buffer
+        std::string big_value(4 * 1024 * 1024, 'v');
+        std::vector<std::string> args = {"SET", "argv_key", big_value};
+        ASSERT_STREQ("OK", conn->DoArgv(args).toString().c_str());
+        ASSERT_EQ(big_value, conn->Do("GET argv_key").toString());
+        // the bulk reply is read in chunks sized by its known length 
+        redisReadStats stats = conn->read_stats();
+        ASSERT_LT(0u, stats.sized_reads);
+        ASSERT_LE(big_value.size(), stats.bytes);
+
+        const char* argv[] = {"SET", "argv_key", "small value"};
+        ASSERT_TRUE(conn->DoArgv(3, argv, NULL).ok());
+        ASSERT_EQ("small value", conn->Do("GET argv_key").toString());
+        ASSERT_EQ(1, conn->Do("DEL argv_key").toInt32());
+    }
+    delete manager;
+}
+
+TEST(cloredis, reply_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    RedisReply list_reply;
+    RedisReply element;
+    std::vector<RedisReply> replies;
+    {
+        RedisConnection conn = manager->Get(4);
+        ASSERT_TRUE(conn);
+        conn->Do("DEL reply_list");
+        conn->Do("RPUSH reply_list a b c");
+        list_reply = conn->Do("LRANGE reply_list 0 -1");
+        RedisReply count = conn->Do("LLEN reply_list");
+        ASSERT_EQ(3, count.toInt32());
+        ASSERT_EQ(3, conn->toInt32());  // the connection still sees its last reply
+
+        ASSERT_TRUE(conn->Append("SET reply_key %d", 100));
+        ASSERT_TRUE(conn->Append("INCR reply_key"));
+        ASSERT_TRUE(conn->Append("GET reply_key"));
+        ASSERT_EQ(3, conn->pending_replies());
+        // Do would take a pipelined reply for its own
+        ASSERT_STREQ(ERR_REPLIES_PENDING, conn->Do("GET reply_key").err_msg());
+        ASSERT_STREQ(ERR_REPLIES_PENDING, conn->DoArgv({"GET", "reply_key"}).err_msg());
+        ASSERT_EQ(3, conn->pending_replies());
+        while (conn->pending_replies() > 0) {
+            replies.push_back(conn->GetReply());
+        }
+        ASSERT_TRUE(conn->GetReply().error());
+        conn->Do("DEL reply_list reply_key");
+    }
+    {
+        RedisReply tmp = list_reply.get(2);
+        element = std::move(tmp);
+    }
+    // replies are still valid after the connection went back to pool
+    ASSERT_EQ(3u, list_reply.size());
+    ASSERT_EQ("a", list_reply[0].toString());
+    list_reply = RedisReply();
+    ASSERT_EQ("c", element.toString());
+    ASSERT_EQ(3u, replies.size());
+    ASSERT_EQ(101, replies[1].toInt32());
+    ASSERT_EQ("101", replies[2].toString());
+    delete manager;
+}
+
+TEST(cloredis, cluster_slot_test) {
+    ASSERT_EQ(12739, RedisClusterManager::KeyHashSlot("123456789"));
+    ASSERT_EQ(RedisClusterManager::KeyHashSlot("{user1000}.following"), 
+              RedisClusterManager::KeyHashSlot("{user1000}.followers"));
+    ASSERT_EQ(RedisClusterManager::KeyHashSlot("user1000"), 
+              RedisClusterManager::KeyHashSlot("{user1000}.following"));
+    // empty tag hashes the whole key, only the first tag counts
+    ASSERT_NE(RedisClusterManager::KeyHashSlot("bar"), RedisClusterManager::KeyHashSlot("foo{}{bar}"));
+    ASSERT_EQ(RedisClusterManager::KeyHashSlot("{bar"), RedisClusterManager::KeyHashSlot("foo{{bar}}zap"));
+    ASSERT_EQ(RedisClusterManager::KeyHashSlot("bar"), RedisClusterManager::KeyHashSlot("foo{bar}{zap}"));
+}
+
+TEST(cloredis, cluster_test) {
+    FakeCluster cluster(3);
+    RedisClusterManager* manager = new RedisClusterManager();
+    ASSERT_TRUE(manager->Init(cluster.hosts()));
+    ASSERT_EQ(3, manager->node_cnt());
+    for (int i = 0; i < 100; ++i) {
+        std::string key = "cluster_key_" + std::to_string(i);
+        ASSERT_TRUE(manager->Do(key, "SET %s %d", key.c_str(), i).ok());
+    }
+    for (int i = 0; i < 100; ++i) {
+        std::string key = "cluster_key_" + std::to_string(i);
+        ASSERT_EQ(i, manager->DoArgv({"GET", key}).toInt32());
+    }
+    ASSERT_EQ(0, cluster.redirects());
+
+    // MOVED fixes the slot map at once
+    int slot = RedisClusterManager::KeyHashSlot("{moved}");
+    int target = (cluster.owner(slot) + 1) % 3;
+    cluster.Move(slot, target);
+    ASSERT_TRUE(manager->Do("{moved}", "SET {moved}a 1").ok());
+    ASSERT_EQ(1, cluster.redirects());
+    ASSERT_EQ("1", manager->Do("{moved}", "GET {moved}a").toString());
+    ASSERT_EQ(1, cluster.redirects());
+    {
+        RedisConnection conn = manager->GetBySlot(slot);
+        ASSERT_TRUE(conn);
+        ASSERT_EQ("node" + std::to_string(target), conn->Do("CLUSTER MYID").toString());
+    }
+
+    // ASK redirects one command only and keeps the slot map
+    slot = RedisClusterManager::KeyHashSlot("{ask}");
+    int owner = cluster.owner(slot);
+    target = (owner + 1) % 3;
+    cluster.Migrate(slot, target);
+    ASSERT_TRUE(manager->Do("{ask}", "SET {ask}a 2").ok());
+    ASSERT_EQ("2", manager->Do("{ask}", "GET {ask}a").toString());
+    ASSERT_EQ(3, cluster.redirects());
+    {
+        RedisConnection conn = manager->GetBySlot(slot);
+        ASSERT_TRUE(conn);
+        ASSERT_EQ("node" + std::to_string(owner), conn->Do("CLUSTER MYID").toString());
+    }
+    cluster.Move(slot, target);
+    ASSERT_EQ("2", manager->Do("{ask}", "GET {ask}a").toString());
+
+    // cross slot keys are refused by node, not redirected
+    ASSERT_TRUE(manager->Do("{ask}", "MGET {ask}a {moved}a").error());
+
+    // a full reload picks up every moved slot
+    for (int s = 0; s < 100; ++s) {
+        cluster.Move(s, 2);
+    }
+    ASSERT_TRUE(manager->Refresh());
+    {
+        RedisConnection conn = manager->GetBySlot(50);
+        ASSERT_TRUE(conn);
+        ASSERT_EQ("node2", conn->Do("CLUSTER MYID").toString());
+    }
+    ASSERT_EQ(0, manager->ConnectionInUse());
+    delete manager;
+}
+
+TEST(cloredis, cluster_batch_test) {
+    FakeCluster cluster(3);
+    RedisClusterManager* manager = new RedisClusterManager();
+    ASSERT_TRUE(manager->Init(cluster.hosts()));
+    std::vector<std::string> keys, values;
+    for (int i = 0; i < 500; ++i) {
+        keys.push_back("batch_key_" + std::to_string(i));
+        values.push_back(std::to_string(i));
+    }
+    ASSERT_TRUE(manager->MSet(keys, values));
+    keys.push_back("batch_key_none");
+    std::vector<RedisReply> replies = manager->MGet(keys);
+    ASSERT_EQ(501u, replies.size());
+    for (int i = 0; i < 500; ++i) {
+        ASSERT_EQ(i, replies[i].toInt32());
+    }
+    ASSERT_TRUE(replies[500].is_nil());
+    ASSERT_EQ(0, cluster.redirects());
+
+    // only the keys of redirected slots are sent again
+    int moved_slot = RedisClusterManager::KeyHashSlot(keys[7]);
+    cluster.Move(moved_slot, (cluster.owner(moved_slot) + 1) % 3);
+    int ask_slot = RedisClusterManager::KeyHashSlot(keys[9]);
+    cluster.Migrate(ask_slot, (cluster.owner(ask_slot) + 1) % 3);
+    keys.pop_back();
+    ASSERT_TRUE(manager->MSet(keys, values));
+    ASSERT_EQ(2, cluster.redirects());
+    replies = manager->MGet(keys);
+    for (int i = 0; i < 500; ++i) {
+        ASSERT_EQ(i, replies[i].toInt32());
+    }
+    ASSERT_EQ(3, cluster.redirects());
+
+    std::vector<std::vector<std::string> > commands;
+    for (int i = 0; i < 10; ++i) {
+        commands.push_back({"SET", keys[i], "v" + values[i]});
+        commands.push_back({"GET", keys[i]});
+    }
+    replies = manager->Pipeline(commands);
+    ASSERT_EQ(20u, replies.size());
+    for (int i = 0; i < 10; ++i) {
+        ASSERT_TRUE(replies[2 * i].ok());
+        ASSERT_EQ("v" + values[i], replies[2 * i + 1].toString());
+    }
+
+    ASSERT_EQ(500, manager->Del(keys));
+    ASSERT_EQ(0, manager->KeyCount("DEL", keys));
+    ASSERT_EQ(0, manager->ConnectionInUse());
+    delete manager;
+}
+
+TEST(cloredis, sentinel_test) {
+    std::string sentinel_host = Config::instance()->GetString("redis.sentinel_host");
+    std::string master_name   = Config::instance()->GetString("redis.sentinel_master");
+    int32_t timeout           = Config::instance()->GetInt32("redis.timeout");
+    std::string password      = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->InitSentinel(sentinel_host, master_name, password, timeout));
+    ServiceAddress master = manager->master_address();
+    {
+        RedisConnection conn = manager->Get();
+        ASSERT_TRUE(conn);
+        ASSERT_TRUE(conn->Do("SET sentinel_key 1").ok());
+
+        // fail over while a connection is borrowed
+        RedisManager* sentinel = new RedisManager();
+        ASSERT_TRUE(sentinel->Init(parse_address_vector(sentinel_host)[0].full_host, "", timeout));
+        {
+            RedisConnection sentinel_conn = sentinel->Get();
+            ASSERT_TRUE(sentinel_conn);
+            ASSERT_TRUE(sentinel_conn->Do("SENTINEL failover %s", master_name.c_str()).ok());
+        }
+        delete sentinel;
+        for (int i = 0; i < 300 && manager->master_address().full_host == master.full_host; ++i) {
+            usleep(100 * 1000);
+        }
+        ASSERT_NE(master.full_host, manager->master_address().full_host);
+        ASSERT_TRUE(conn->Do("PING").ok());
+    }
+    {
+        RedisConnection conn = manager->Get();
+        ASSERT_TRUE(conn);
+        ASSERT_TRUE(conn->Do("PING").ok());
+    }
+    ASSERT_EQ(0, manager->ConnectionInUse());
+    delete manager;
+}
+
+TEST(cloredis, shard_test) {
+    std::string shard_host = Config::instance()->GetString("redis.shard_host");
+    int32_t timeout        = Config::instance()->GetInt32("redis.timeout");
+    std::string password   = Config::instance()->GetString("redis.password");
+
+    RedisShardedManager* manager = new RedisShardedManager();
+    manager->EnableHashTag(true);
+    ASSERT_TRUE(manager->Init(shard_host, password, timeout));
+    ASSERT_EQ(3, manager->shard_cnt());
+    ASSERT_EQ(manager->ShardOf("{user1000}.following").full_host, manager->ShardOf("{user1000}.followers").full_host);
+
+    std::vector<std::string> keys, values;
+    std::map<std::string, int> shard_keys;
+    for (int i = 0; i < 1000; ++i) {
+        keys.push_back("shard_key_" + std::to_string(i));
+        values.push_back(std::to_string(i));
+        ++shard_keys[manager->ShardOf(keys.back()).full_host];
+    }
+    ASSERT_EQ(3u, shard_keys.size());
+    for (auto& item : shard_keys) {
+        ASSERT_GT(item.second, 200);
+    }
+    ASSERT_TRUE(manager->MSet(keys, values));
+    std::vector<RedisReply> replies = manager->MGet(keys);
+    ASSERT_EQ(1000u, replies.size());
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_EQ(i, replies[i].toInt32());
+    }
+    ASSERT_EQ("7", manager->Do(keys[7], "GET %s", keys[7].c_str()).toString());
+
+    // a new shard only takes keys, removing it gives them back
+    std::vector<std::string> before;
+    for (auto& key : keys) {
+        before.push_back(manager->ShardOf(key).full_host);
+    }
+    ASSERT_TRUE(manager->AddShard("127.0.0.1:1"));
+    ASSERT_FALSE(manager->AddShard("127.0.0.1:1"));
+    int moved = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        std::string now = manager->ShardOf(keys[i]).full_host;
+        if (now != before[i]) {
+            ASSERT_EQ("127.0.0.1:1", now);
+            ++moved;
+        }
+    }
+    ASSERT_GT(moved, 150);
+    ASSERT_LT(moved, 350);
+    ASSERT_TRUE(manager->RemoveShard("127.0.0.1:1"));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        ASSERT_EQ(before[i], manager->ShardOf(keys[i]).full_host);
+    }
+    ASSERT_EQ(0, manager->ConnectionInUse());
+    delete manager;
+}
+
+TEST(cloredis, shared_db_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    ConnectionPoolOption option;
+    option.share_db_pool = true;
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout, &option));
+    for (int db = 1; db < 9; ++db) {
+        RedisConnection conn = manager->Get(db);
+        ASSERT_TRUE(conn);
+        ASSERT_EQ(db, conn->db());
+        ASSERT_TRUE(conn->Do("SET shared_db_key %d", db).ok());
+    }
+    // one socket served all the dbs
+    ASSERT_EQ(1, manager->ActiveConnectionCount());
+    RedisConnectionImpl* on_db5 = NULL;
+    {
+        RedisConnection conn1 = manager->Get(3);
+        RedisConnection conn2 = manager->Get(5);
+        ASSERT_TRUE(conn1 && conn2);
+        ASSERT_EQ(2, manager->ActiveConnectionCount());
+        on_db5 = conn2.mutable_impl();
+    }
+    {
+        // the idle connection already on db 5 is preferred
+        RedisConnection conn = manager->Get(5);
+        ASSERT_EQ(on_db5, conn.mutable_impl());
+        ASSERT_EQ("5", conn->Do("GET shared_db_key").toString());
+    }
+    delete manager;
+
+    manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    for (int db = 1; db < 9; ++db) {
+        RedisConnection conn = manager->Get(db);
+        ASSERT_TRUE(conn);
+        ASSERT_EQ(db, conn->Do("GET shared_db_key").toInt32());
+        conn->Do("DEL shared_db_key");
+    }
+    delete manager;
+}
+
+TEST(cloredis, command_table_test) {
+    ASSERT_TRUE(is_readonly_command("GET %s"));
+    ASSERT_TRUE(is_readonly_command("  hgetall %b"));
+    ASSERT_FALSE(is_readonly_command("SET %s %s"));
+    ASSERT_FALSE(is_readonly_command("%s %s"));
+    ASSERT_FALSE(is_readonly_command("NOSUCHCMD"));
+    ASSERT_TRUE(is_readonly_command(std::vector<std::string>{"mget", "a", "b"}));
+    ASSERT_TRUE(lookup_command("evalsha")->flags & CMD_MOVABLE_KEYS);
+    ASSERT_EQ(std::vector<size_t>({1, 3}), command_key_indexes({"MSET", "a", "1", "b", "2"}));
+    ASSERT_EQ(std::vector<size_t>({1, 2}), command_key_indexes({"BLPOP", "a", "b", "0"}));
+    ASSERT_TRUE(command_key_indexes({"EVAL", "return 1", "0"}).empty());
+}
+
+TEST(cloredis, route_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    std::string slave_host = Config::instance()->GetString("redis.slave_host"); 
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->InitEx(host, slave_host, password, timeout));
+    int slave_idle = manager->ConnectionInPool(SLAVE);
+    ASSERT_TRUE(manager->Do(2, "SET route_key %d", 1).ok());
+    // a read right after a write stays on master
+    manager->Do(2, "GET route_key");
+    ASSERT_EQ(slave_idle, manager->ConnectionInPool(SLAVE));
+    manager->set_read_your_writes_ms(0);
+    manager->Do(2, "GET route_key");
+    ASSERT_EQ(slave_idle + 1, manager->ConnectionInPool(SLAVE));
+    // per call override
+    ASSERT_FALSE(manager->DoRoute(2, ROUTE_SLAVE, "SET route_key 2").ok());
+    ASSERT_EQ(1, manager->DoArgv(2, {"GET", "route_key"}, ROUTE_MASTER).toInt32());
+    ASSERT_EQ(1, manager->DoArgv(2, {"DEL", "route_key"}).toInt32());
+    delete manager;
+}
+
+TEST(cloredis, replica_lag_test) {
+    ReplicaLagTracker tracker;
+    ASSERT_EQ(-1, tracker.LagMs(1000, 0));
+    tracker.AddMasterOffset(1000, 100);
+    tracker.AddMasterOffset(2000, 200);
+    tracker.AddMasterOffset(3000, 300);
+    ASSERT_EQ(0, tracker.LagMs(3500, 300));
+    ASSERT_EQ(500, tracker.LagMs(3500, 250));
+    ASSERT_EQ(2500, tracker.LagMs(3500, 50));
+    // a new master starts over
+    tracker.AddMasterOffset(4000, 10);
+    ASSERT_EQ(0, tracker.LagMs(4500, 10));
+
+    std::string value;
+    std::string info = "# Replication\r\nrole:slave\r\nmaster_link_status:up\r\nslave_repl_offset:42\r\n";
+    ASSERT_TRUE(info_field(info, "slave_repl_offset", &value));
+    ASSERT_EQ("42", value);
+    ASSERT_TRUE(info_field(info, "role", &value));
+    ASSERT_EQ("slave", value);
+    ASSERT_FALSE(info_field(info, "repl_offset", &value));
+
+    std::string host     = Config::instance()->GetString("redis.host");
+    std::string slave_host = Config::instance()->GetString("redis.slave_host"); 
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->InitEx(host, slave_host, password, timeout));
+    std::string role;
+    {
+        // nothing is known before the first probe, bounded reads go to master
+        RedisConnection conn = manager->GetBounded(2, 1000);
+        ASSERT_TRUE(conn);
+        ASSERT_TRUE(info_field(conn->Do("INFO replication").toString(), "role", &role));
+        ASSERT_EQ("master", role);
+    }
+    ASSERT_TRUE(manager->StartReplicaProbe(100, 5000));
+    for (int i = 0; i < 50 && (manager->replica_lag_ms(0) < 0 || manager->replica_lag_ms(1) < 0); ++i) {
+        usleep(100 * 1000);
+    }
+    ASSERT_GE(manager->replica_lag_ms(0), 0);
+    ASSERT_GE(manager->replica_lag_ms(1), 0);
+    {
+        RedisConnection conn = manager->GetBounded(2, 5000);
+        ASSERT_TRUE(conn);
+        ASSERT_TRUE(info_field(conn->Do("INFO replication").toString(), "role", &role));
+        ASSERT_EQ("slave", role);
+    }
+    delete manager;
+
+    // under RESP3 INFO comes as a verbatim string
+    ConnectionPoolOption option;
+    option.protocol = 3;
+    manager = new RedisManager();
+    ASSERT_TRUE(manager->InitEx(host, slave_host, password, timeout, &option));
+    ASSERT_TRUE(manager->Do(0, "INFO replication").is_verbatim());
+    ASSERT_TRUE(manager->StartReplicaProbe(100, 5000));
+    for (int i = 0; i < 50 && (manager->replica_lag_ms(0) < 0 || manager->replica_lag_ms(1) < 0); ++i) {
+        usleep(100 * 1000);
+    }
+    ASSERT_GE(manager->replica_lag_ms(0), 0);
+    ASSERT_GE(manager->replica_lag_ms(1), 0);
+    {
+        RedisConnection conn = manager->GetBounded(2, 5000);
+        ASSERT_TRUE(conn);
+        ASSERT_TRUE(info_field(conn->Do("INFO replication").toString(), "role", &role));
+        ASSERT_EQ("slave", role);
+    }
+    delete manager;
+}
+
+TEST(cloredis, hedge_test) {
+    HedgePolicy policy(0.5, 0.5);
+    ASSERT_FALSE(policy.TakeHedge());
+    for (int i = 1; i < HEDGE_RECOMPUTE_EVERY; ++i) {
+        policy.AddLatency(i);
+    }
+    ASSERT_EQ(-1, policy.DelayUs());
+    policy.AddLatency(HEDGE_RECOMPUTE_EVERY);
+    ASSERT_EQ(HEDGE_RECOMPUTE_EVERY / 2 + 1, policy.DelayUs());
+    // tokens are capped, hedges can't be saved up forever
+    for (int i = 0; i < HEDGE_MAX_TOKENS; ++i) {
+        ASSERT_TRUE(policy.TakeHedge());
+    }
+    ASSERT_FALSE(policy.TakeHedge());
+    ASSERT_EQ((uint64_t)HEDGE_MAX_TOKENS, policy.hedge_cnt());
+
+    std::string host     = Config::instance()->GetString("redis.host");
+    std::string slave_host = Config::instance()->GetString("redis.slave_host"); 
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->InitEx(host, slave_host, password, timeout));
+    ASSERT_EQ(2, manager->slave_cnt());
+    manager->EnableHedgedReads(0.9, 1.0);
+    for (int i = 0; i < 2 * HEDGE_RECOMPUTE_EVERY; ++i) {
+        ASSERT_FALSE(manager->Do(2, "GET hedge_key").error());
+    }
+    {
+        // stall slave 0 while some of its connections sit idle in the pool, the
+        // first read sent to it is answered by slave 1
+        RedisConnection stalled = manager->Get(2, NULL, SLAVE, 0);
+        ASSERT_TRUE(stalled);
+        {
+            std::vector<RedisConnection> idle;
+            for (int i = 0; i < 5; ++i) {
+                idle.emplace_back(manager->Get(2, NULL, SLAVE, 0));
+                ASSERT_TRUE(idle.back());
+            }
+        }
+        ASSERT_TRUE(stalled->AppendArgv(std::vector<std::string>{"DEBUG", "SLEEP", "1"}));
+        ASSERT_TRUE(stalled->Flush());
+        usleep(50 * 1000);
+        uint64_t wins = manager->hedge_win_cnt();
+        uint64_t start = __get_current_time_ms();
+        for (int i = 0; i < 50 && manager->hedge_win_cnt() == wins; ++i) {
+            ASSERT_FALSE(manager->Do(2, "GET hedge_key").error());
+        }
+        ASSERT_LT(__get_current_time_ms() - start, 900u);
+        ASSERT_GT(manager->hedge_win_cnt(), wins);
+        stalled->GetReply();
+    }
+    // writes are never hedged
+    uint64_t hedges = manager->hedge_cnt();
+    ASSERT_TRUE(manager->Do(2, "SET hedge_key 1").ok());
+    ASSERT_EQ(hedges, manager->hedge_cnt());
+    delete manager;
+}
+
+TEST(cloredis, reload_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    std::string slave_host = Config::instance()->GetString("redis.slave_host"); 
+    std::string shard_host = Config::instance()->GetString("redis.shard_host"); 
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+    std::vector<ServiceAddress> shards = parse_address_vector(shard_host);
+    ASSERT_EQ(3u, shards.size());
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_FALSE(manager->Reload(shards[1].full_host, ""));
+    ASSERT_TRUE(manager->InitEx(host, slave_host, password, timeout));
+    {
+        RedisConnection old_conn = manager->Get(4);
+        ASSERT_TRUE(old_conn);
+        ASSERT_TRUE(old_conn->Do("SET reload_key old").ok());
+
+        // a server that can't be reached leaves everything as it was
+        std::string err;
+        ASSERT_FALSE(manager->Reload("127.0.0.1:1", "", NULL, &err));
+        ASSERT_FALSE(err.empty());
+        ASSERT_EQ(host, manager->master_address().full_host);
+
+        ConnectionPoolOption option;
+        option.max_active = 1;
+        ASSERT_TRUE(manager->Reload(shards[1].full_host, "", &option));
+        ASSERT_EQ(shards[1].full_host, manager->master_address().full_host);
+        ASSERT_EQ(0, manager->slave_cnt());
+        // pools of DB 0 and DB 4 are warmed on the new master
+        ASSERT_EQ(2, manager->ConnectionInPool(MASTER));
+
+        // borrowed before the reload, still on the old master
+        ASSERT_EQ("old", old_conn->Do("GET reload_key").toString());
+        RedisConnection new_conn = manager->Get(4);
+        ASSERT_TRUE(new_conn);
+        ASSERT_TRUE(new_conn->Do("SET reload_key new").ok());
+        // the new pool options are in force
+        RedisConnection overload = manager->Get(4);
+        ASSERT_FALSE(overload);
+    }
+    ASSERT_EQ("new", manager->Do(4, "GET reload_key").toString());
+    ASSERT_TRUE(manager->Reload(host, slave_host));
+    ASSERT_EQ(2, manager->slave_cnt());
+    ASSERT_EQ("old", manager->DoRoute(4, ROUTE_MASTER, "GET reload_key").toString());
+    delete manager;
+}
+
+TEST(cloredis, unix_socket_test) {
+    std::vector<ServiceAddress> addrs = parse_address_vector(
+            "127.0.0.1:6379, unix:///var/run/redis.sock,unix://relative.sock,unix:///");
+    ASSERT_EQ(2u, addrs.size());
+    ASSERT_EQ("127.0.0.1", addrs[0].host);
+    ASSERT_EQ(6379, addrs[0].port);
+    ASSERT_EQ("/var/run/redis.sock", addrs[1].host);
+    ASSERT_EQ(0, addrs[1].port);
+    ASSERT_EQ("unix:///var/run/redis.sock", addrs[1].full_host);
+
+    // 'unix_host' is the socket of the server at 'host'
+    std::string host     = Config::instance()->GetString("redis.host");
+    std::string unix_host = Config::instance()->GetString("redis.unix_host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->InitEx(unix_host, unix_host, password, timeout));
+    ASSERT_EQ(unix_host, manager->master_address().full_host);
+    ASSERT_TRUE(manager->Do(5, "SET unix_key 1").ok());
+    ASSERT_EQ("1", manager->DoRoute(5, ROUTE_SLAVE, "GET unix_key").toString());
+    delete manager;
+
+    manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    ASSERT_EQ("1", manager->Do(5, "GET unix_key").toString());
+    delete manager;
+
+    manager = new RedisManager();
+    ASSERT_FALSE(manager->Init("unix:///nonexistent/redis.sock", password, timeout));
+    delete manager;
+}
+
+TEST(cloredis, near_cache_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    ASSERT_TRUE(manager->Do(6, "SET near_key v1").ok());
+
+    NearCacheOption option;
+    option.max_ttl_ms = 300;
+    RedisNearCache* cache = new RedisNearCache();
+    ASSERT_TRUE(cache->Init(host, password, timeout, &option));
+    for (int i = 0; i < 50 && !cache->tracking(); ++i) {
+        usleep(20 * 1000);
+    }
+    ASSERT_TRUE(cache->tracking());
+
+    ASSERT_EQ("v1", cache->Get(6, "near_key").toString());
+    ASSERT_EQ("v1", cache->Get(6, "near_key").toString());
+    ASSERT_TRUE(cache->Get(7, "near_key").is_nil());
+    ASSERT_TRUE(cache->Get(7, "near_key").is_nil());
+    NearCacheStats stats = cache->stats();
+    ASSERT_EQ(2u, stats.hits);
+    ASSERT_EQ(2u, stats.misses);
+    ASSERT_EQ(2, stats.entries);
+
+    // a write by another client invalidates the key of every DB
+    ASSERT_TRUE(manager->Do(6, "SET near_key v2").ok());
+    for (int i = 0; i < 50 && cache->stats().entries > 0; ++i) {
+        usleep(20 * 1000);
+    }
+    ASSERT_EQ(0, cache->stats().entries);
+    ASSERT_GT(cache->stats().invalidations, 0u);
+    ASSERT_EQ("v2", cache->Get(6, "near_key").toString());
+
+    // entries are bounded in time even without invalidation
+    usleep(400 * 1000);
+    uint64_t misses = cache->stats().misses;
+    ASSERT_EQ("v2", cache->Get(6, "near_key").toString());
+    ASSERT_EQ(misses + 1, cache->stats().misses);
+    ASSERT_EQ(1u, cache->stats().expirations);
+    delete cache;
+
+    // and in memory
+    option.max_ttl_ms = 0;
+    option.max_bytes = NEAR_CACHE_SHARDS * (NEAR_CACHE_ENTRY_OVERHEAD + 64);
+    cache = new RedisNearCache();
+    ASSERT_TRUE(cache->Init(host, password, timeout, &option));
+    for (int i = 0; i < 50 && !cache->tracking(); ++i) {
+        usleep(20 * 1000);
+    }
+    for (int i = 0; i < 100; ++i) {
+        cache->Get(6, "near_key" + std::to_string(i));
+    }
+    stats = cache->stats();
+    ASSERT_GT(stats.evictions, 0u);
+    ASSERT_LE(stats.bytes, option.max_bytes);
+    delete cache;
+    delete manager;
+}
+
+TEST(cloredis, resp3_reader_test) {
+    const char* input =
+        ",3.25\r\n,-inf\r\n#t\r\n_\r\n(3492890328409238509324850943850943825024385\r\n"
+        "=15\r\ntxt:Some string\r\n!9\r\nERR oops!\r\n"
+        "%2\r\n+a\r\n:1\r\n$1\r\nb\r\n~2\r\n#f\r\n,1e3\r\n"
+        ">2\r\n$10\r\ninvalidate\r\n*1\r\n$3\r\nkey\r\n";
+    redisReader* reader = redisReaderCreate();
+    ASSERT_EQ(REDIS_OK, redisReaderFeed(reader, input, strlen(input)));
+    std::vector<RedisReply> replies;
+    void* aux = NULL;
+    while (redisReaderGetReply(reader, &aux) == REDIS_OK && aux) {
+        replies.emplace_back((redisReply*)aux, true, STATE_OK, "");
+    }
+    ASSERT_EQ(0, reader->err);
+    redisReaderFree(reader);
+    ASSERT_EQ(9u, replies.size());
+
+    ASSERT_TRUE(replies[0].is_double());
+    ASSERT_DOUBLE_EQ(3.25, replies[0].toDouble());
+    ASSERT_EQ("3.25", replies[0].toString());
+    ASSERT_TRUE(std::isinf(replies[1].toDouble()) && replies[1].toDouble() < 0);
+    ASSERT_TRUE(replies[2].is_bool() && replies[2].toBool());
+    ASSERT_TRUE(replies[3].is_nil());
+    ASSERT_TRUE(replies[4].is_bignum());
+    ASSERT_EQ("3492890328409238509324850943850943825024385", replies[4].toString());
+    ASSERT_TRUE(replies[5].is_verbatim());
+    ASSERT_EQ("txt", replies[5].verbatim_format());
+    ASSERT_EQ("Some string", replies[5].toString());
+    ASSERT_TRUE(replies[6].error());
+    ASSERT_STREQ("ERR oops!", replies[6].err_msg());
+    // a map is read as its keys and values in turn
+    ASSERT_TRUE(replies[7].is_map());
+    ASSERT_EQ(4u, replies[7].size());
+    ASSERT_EQ("a", replies[7][0].toString());
+    ASSERT_EQ(1, replies[7][1].toInt32());
+    ASSERT_EQ("b", replies[7][2].toString());
+    ASSERT_TRUE(replies[7][3].is_set());
+    ASSERT_FALSE(replies[7][3][0].toBool());
+    ASSERT_DOUBLE_EQ(1000.0, replies[7][3][1].toDouble());
+    ASSERT_TRUE(replies[8].is_push());
+    ASSERT_EQ("invalidate", replies[8][0].toString());
+    ASSERT_EQ("key", replies[8][1][0].toString());
+
+    // a RESP2 nil stays a nil, a malformed RESP3 value is a protocol error
+    const char* bad_inputs[] = { ",1.5x\r\n", "#x\r\n", "(12a\r\n", "=5\r\ntxt-a\r\n", "%-1\r\n" };
+    for (auto bad : bad_inputs) {
+        reader = redisReaderCreate();
+        redisReaderFeed(reader, bad, strlen(bad));
+        ASSERT_EQ(REDIS_ERR, redisReaderGetReply(reader, &aux)) << bad;
+        redisReaderFree(reader);
+    }
+}
+
+TEST(cloredis, resp3_connection_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    {
+        // RESP2 stays the default
+        RedisConnection conn = manager->Get(6);
+        ASSERT_TRUE(conn);
+        ASSERT_EQ(2, conn->protocol());
+        conn->Do("DEL resp3_hash");
+        ASSERT_TRUE(conn->Do("HSET resp3_hash f1 v1").ok());
+        ASSERT_TRUE(conn->Do("HGETALL resp3_hash").is_array());
+    }
+    delete manager;
+
+    ConnectionPoolOption option;
+    option.protocol = 3;
+    manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout, &option));
+    {
+        RedisConnection conn = manager->Get(6);
+        ASSERT_TRUE(conn);
+        ASSERT_EQ(3, conn->protocol());
+        RedisReply hash = conn->Do("HGETALL resp3_hash");
+        ASSERT_TRUE(hash.is_map());
+        ASSERT_EQ(2u, hash.size());
+        ASSERT_EQ("f1", hash[0].toString());
+        ASSERT_EQ("v1", hash[1].toString());
+
+        // push messages never take the place of a reply: a key read under
+        // CLIENT TRACKING gets its invalidation here once written elsewhere
+        conn->Do("DEL resp3_push");
+        ASSERT_EQ("OK", conn->Do("CLIENT TRACKING on").toString());
+        ASSERT_TRUE(conn->Do("GET resp3_push").is_nil());
+        ASSERT_TRUE(manager->Do(6, "SET resp3_push v1").ok());
+        ASSERT_EQ("v1", conn->Do("GET resp3_push").toString());
+        std::vector<std::string> pushed;
+        conn->set_push_handler([&pushed](RedisReply push) {
+            if (push.is_push() && push.size() == 2 && push[1].size() == 1) {
+                pushed.push_back(push[1][0].toString());
+            }
+        });
+        ASSERT_TRUE(manager->Do(6, "SET resp3_push v2").ok());
+        ASSERT_EQ("v2", conn->Do("GET resp3_push").toString());
+        ASSERT_EQ(1u, pushed.size());
+        ASSERT_EQ("resp3_push", pushed[0]);
+        ASSERT_EQ("OK", conn->Do("CLIENT TRACKING off").toString());
+        // and neither do attributes, which come ahead of the reply
+        ASSERT_EQ("Some real reply following the attribute", conn->Do("DEBUG PROTOCOL attrib").toString());
+        ASSERT_EQ("PONG", conn->Do("PING").toString());
+        conn->set_push_handler(nullptr);
+        conn->Do("DEL resp3_hash resp3_push");
+    }
+
+    // the near cache listener gets invalidations as push messages
+    NearCacheOption cache_option;
+    cache_option.pool.protocol = 3;
+    RedisNearCache* cache = new RedisNearCache();
+    ASSERT_TRUE(cache->Init(host, password, timeout, &cache_option));
+    for (int i = 0; i < 50 && !cache->tracking(); ++i) {
+        usleep(20 * 1000);
+    }
+    ASSERT_TRUE(cache->tracking());
+    ASSERT_TRUE(manager->Do(6, "SET resp3_key v1").ok());
+    ASSERT_EQ("v1", cache->Get(6, "resp3_key").toString());
+    ASSERT_EQ(1, cache->stats().entries);
+    ASSERT_TRUE(manager->Do(6, "SET resp3_key v2").ok());
+    for (int i = 0; i < 50 && cache->stats().entries > 0; ++i) {
+        usleep(20 * 1000);
+    }
+    ASSERT_EQ(0, cache->stats().entries);
+    ASSERT_EQ("v2", cache->Get(6, "resp3_key").toString());
+    delete cache;
+    delete manager;
+}
+
+TEST(cloredis, coalescing_test) {
+    SingleFlight flights;
+    std::atomic<int> calls(0);
+    auto slow_get = [&calls]() {
+        ++calls;
+        usleep(100 * 1000);
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, "slow reply");
+    };
+    std::vector<std::thread> threads;
+    std::atomic<int> replies(0);
+    for (int i = 0; i < 20; ++i) {
+        threads.emplace_back([&]() {
+            RedisReply reply = flights.Do("k1", 0, slow_get);
+            if (std::string("slow reply") == reply.err_msg()) {
+                ++replies;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ASSERT_EQ(20, replies.load());
+    ASSERT_LT(calls.load(), 20);
+    ASSERT_EQ(20u, calls + flights.shared_cnt());
+
+    // a caller whose write was done after the flight started runs on its own
+    calls = 0;
+    std::thread leader([&]() { flights.Do("k2", 0, slow_get); });
+    usleep(20 * 1000);
+    uint64_t write_done_seq = SingleFlight::sequence();
+    flights.Do("k2", write_done_seq, slow_get);
+    leader.join();
+    ASSERT_EQ(2, calls.load());
+    // and joins a flight started after it
+    calls = 0;
+    write_done_seq = SingleFlight::sequence();
+    std::thread later([&]() { flights.Do("k3", write_done_seq, slow_get); });
+    usleep(20 * 1000);
+    flights.Do("k3", write_done_seq, slow_get);
+    later.join();
+    ASSERT_EQ(1, calls.load());
+
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    manager->EnableCoalescing();
+    ASSERT_TRUE(manager->Do(6, "SET coalesce_key %s", "v1").ok());
+    threads.clear();
+    replies = 0;
+    for (int i = 0; i < 16; ++i) {
+        threads.emplace_back([&]() {
+            for (int j = 0; j < 50; ++j) {
+                if (manager->Do(6, "GET coalesce_key").toString() == "v1"
+                        && manager->DoArgv(6, {"GET", "coalesce_key"}).toString() == "v1") {
+                    ++replies;
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ASSERT_EQ(16 * 50, replies.load());
+    // writes are never coalesced
+    ASSERT_EQ(1, manager->Do(6, "DEL coalesce_key").toInt32());
+    ASSERT_EQ(0, manager->Do(6, "DEL coalesce_key").toInt32());
+    manager->DisableCoalescing();
+    ASSERT_EQ(0u, manager->coalesced_cnt());
+    delete manager;
+}
+
+TEST(cloredis, cache_aside_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    manager->Do(6, "DEL ca:k1 ca:k1:lock ca:k2 plain");
+
+    std::atomic<int> loads(0);
+    RedisCacheAside::Loader loader = [&loads](const std::string& key, std::string* value) {
+        ++loads;
+        usleep(50 * 1000);
+        *value = key + "-v" + std::to_string(loads.load());
+        return true;
+    };
+    CacheAsideOption option;
+    option.ttl_ms = 200;
+    option.stale_ms = 2000;
+    option.beta = 0;        // no early refresh, only at expiry
+    RedisCacheAside cache(manager, 6, &option);
+
+    // concurrent misses elect one loader, the others wait for its value
+    std::vector<std::thread> threads;
+    std::atomic<int> ok(0);
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&]() {
+            std::string value;
+            if (cache.Get("ca:k1", loader, &value) && value == "ca:k1-v1") {
+                ++ok;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ASSERT_EQ(8, ok.load());
+    ASSERT_EQ(1, loads.load());
+    std::string value;
+    ASSERT_TRUE(cache.Get("ca:k1", loader, &value));
+    ASSERT_EQ("ca:k1-v1", value);
+
+    // once expired, one caller recomputes and the others are served stale
+    usleep(250 * 1000);
+    threads.clear();
+    std::atomic<int> stale(0);
+    for (int i = 0; i < 8; ++i) {
+        threads.emplace_back([&]() {
+            std::string v;
+            if (cache.Get("ca:k1", loader, &v) && v == "ca:k1-v1") {
+                ++stale;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    ASSERT_EQ(2, loads.load());
+    ASSERT_EQ(7, stale.load());
+    ASSERT_TRUE(cache.Get("ca:k1", loader, &value));
+    ASSERT_EQ("ca:k1-v2", value);
+
+    std::map<std::string, CacheAsideStats> stats = cache.stats();
+    ASSERT_EQ(1u, stats.size());
+    ASSERT_EQ(8u, stats["ca"].misses);
+    ASSERT_EQ(7u, stats["ca"].stale_hits);
+    ASSERT_EQ(1u, stats["ca"].refreshes);
+    ASSERT_EQ(2u, stats["ca"].hits);
+    ASSERT_NEAR(9.0 / 17, stats["ca"].hit_rate(), 1e-9);
+
+    // a large beta refreshes long before expiry
+    option.ttl_ms = 60000;
+    option.beta = 1e9;
+    RedisCacheAside eager(manager, 6, &option);
+    ASSERT_TRUE(eager.Get("plain", loader, &value));
+    ASSERT_TRUE(eager.Get("plain", loader, &value));
+    ASSERT_EQ(4, loads.load());
+    ASSERT_EQ(1u, eager.stats()[""].refreshes);
+
+    // a failed load is an error only if nothing can be served
+    RedisCacheAside::Loader failing = [](const std::string&, std::string*) { return false; };
+    std::string err;
+    ASSERT_FALSE(cache.Get("ca:k2", failing, &value, &err));
+    ASSERT_EQ(ERR_LOAD_FAILED, err);
+    ASSERT_TRUE(eager.Get("plain", failing, &value));
+    ASSERT_EQ("plain-v4", value);
+    ASSERT_TRUE(cache.Invalidate("ca:k1"));
+    manager->Do(6, "DEL plain");
+    delete manager;
+}
+
+TEST(cloredis, aggregator_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+
+    for (int reply_off = 0; reply_off < 2; ++reply_off) {
+        manager->Do(6, "DEL agg:c agg:h");
+        AggregatorOption option;
+        option.flush_interval_ms = 20;
+        option.batch_size = 3;
+        option.reply_off = reply_off;
+        RedisCounterAggregator* aggregator = new RedisCounterAggregator(manager, 6, &option);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 8; ++i) {
+            threads.emplace_back([aggregator, i]() {
+                for (int j = 0; j < 1000; ++j) {
+                    aggregator->IncrBy("agg:c", 1);
+                    aggregator->HIncrBy("agg:h", "f" + std::to_string(i % 4), 2);
+                }
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        // whatever is pending is flushed on shutdown
+        aggregator->Stop();
+        ASSERT_FALSE(aggregator->IncrBy("agg:c", 1));
+        AggregatorStats stats = aggregator->stats();
+        ASSERT_EQ(16000u, stats.merged);
+        ASSERT_EQ(0, stats.pending);
+        ASSERT_EQ(0u, stats.failed);
+        ASSERT_LT(stats.flushed, 16000u);
+        delete aggregator;
+        ASSERT_EQ(8000, manager->Do(6, "GET agg:c").toInt32());
+        for (int i = 0; i < 4; ++i) {
+            ASSERT_EQ(4000, manager->Do(6, "HGET agg:h f%d", i).toInt32());
+        }
+        // connections go back to pool with replies on
+        ASSERT_EQ("PONG", manager->Do(6, "PING").toString());
+    }
+
+    // pending counters are bounded, increments of pending ones still merge
+    AggregatorOption option;
+    option.flush_interval_ms = 60000;
+    option.max_pending = 2;
+    RedisCounterAggregator aggregator(manager, 6, &option);
+    ASSERT_TRUE(aggregator.IncrBy("agg:c", 1));
+    ASSERT_TRUE(aggregator.HIncrBy("agg:h", "f0", 1));
+    ASSERT_FALSE(aggregator.HIncrBy("agg:h", "f1", 1));
+    ASSERT_FALSE(aggregator.IncrBy("agg:d", 1));
+    ASSERT_TRUE(aggregator.IncrBy("agg:c", 1));
+    ASSERT_EQ(2u, aggregator.stats().refused);
+    ASSERT_TRUE(aggregator.Flush());
+    ASSERT_EQ(8002, manager->Do(6, "GET agg:c").toInt32());
+    ASSERT_TRUE(aggregator.IncrBy("agg:d", 1));
+    aggregator.Stop();
+    ASSERT_EQ(1, manager->Do(6, "GET agg:d").toInt32());
+    manager->Do(6, "DEL agg:c agg:d agg:h");
+    delete manager;
+}
+
+TEST(cloredis, no_reply_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    int active = 0;
+    {
+        RedisConnection conn = manager->Get(6);
+        active = manager->ActiveConnectionCount();
+        ASSERT_TRUE(conn->BeginNoReply());
+        ASSERT_TRUE(conn->reply_off());
+        for (int i = 0; i < 100; ++i) {
+            ASSERT_TRUE(conn->Append("SET nr_key%d %d", i, i));
+        }
+        ASSERT_EQ(0, conn->pending_replies());
+        ASSERT_STREQ(ERR_REPLY_OFF, conn->Do("GET nr_key0").err_msg());
+        ASSERT_TRUE(conn->EndNoReply());
+        ASSERT_EQ("99", conn->Do("GET nr_key99").toString());
+
+        // one command skipped among commands with replies
+        ASSERT_TRUE(conn->Append("SET nr_key0 a"));
+        ASSERT_TRUE(conn->AppendSkip({"SET", "nr_key1", "b"}));
+        ASSERT_TRUE(conn->Append("GET nr_key1"));
+        ASSERT_EQ(2, conn->pending_replies());
+        ASSERT_EQ("OK", conn->GetReply().toString());
+        ASSERT_EQ("b", conn->GetReply().toString());
+
+        // replies still pending must be read before turning replies off
+        ASSERT_TRUE(conn->Append("SET nr_key3 d"));
+        ASSERT_FALSE(conn->BeginNoReply());
+        ASSERT_STREQ(ERR_REPLIES_PENDING, conn->err_msg());
+        ASSERT_FALSE(conn->reply_off());
+        ASSERT_TRUE(conn->EndNoReply());
+        ASSERT_EQ(1, conn->pending_replies());
+        ASSERT_EQ("OK", conn->GetReply().toString());
+        ASSERT_EQ("d", conn->Do("GET nr_key3").toString());
+
+        // left with replies off, it gets them on before going back to pool
+        ASSERT_TRUE(conn->BeginNoReply());
+        ASSERT_TRUE(conn->Append("SET nr_key2 c"));
+    }
+    ASSERT_EQ(active, manager->ActiveConnectionCount());
+    ASSERT_EQ(active, manager->ConnectionInPool());
+    ASSERT_EQ("c", manager->Do(6, "GET nr_key2").toString());
+
+    std::vector<std::vector<std::string>> commands;
+    for (int i = 0; i < 1000; ++i) {
+        commands.push_back({"SET", "nr_key" + std::to_string(i), "v" + std::to_string(i)});
+    }
+    ASSERT_TRUE(manager->DoNoReply(6, commands));
+    ASSERT_EQ("v999", manager->Do(6, "GET nr_key999").toString());
+    ASSERT_TRUE(manager->DoNoReply(6, {}));
+    for (auto& command : commands) {
+        command[0] = "DEL";
+        command.pop_back();
+    }
+    ASSERT_TRUE(manager->DoNoReply(6, commands));
+    ASSERT_TRUE(manager->Do(6, "GET nr_key999").is_nil());
+    delete manager;
+}
+
+TEST(cloredis, bulk_load_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    BulkLoadOption option;
+    option.connections = 2;
+    option.pipeline_depth = 100;
+    option.buffer_bytes = 1024;
+    int progress_calls = 0;
+    option.progress = [&progress_calls](const BulkLoadStats&) { ++progress_calls; };
+    RedisBulkLoader loader;
+    ASSERT_TRUE(loader.Init(host, password, timeout, &option));
+
+    // records of two DBs, one of a bad DB and one answered by an error
+    int n = 0;
+    BulkSource source = [&n](BulkRecord* record) {
+        if (n == 3000) {
+            return false;
+        }
+        record->db = (n % 2) ? 7 : 6;
+        record->args = {"SET", "bulk_key" + std::to_string(n), "v" + std::to_string(n)};
+        if (n == 100) {
+            record->db = MAX_DB_NUM;
+        } else if (n == 200) {
+            record->args = {"NOSUCHCOMMAND"};
+        }
+        ++n;
+        return true;
+    };
+    BulkLoadStats stats;
+    ASSERT_TRUE(loader.Load(source, &stats));
+    ASSERT_EQ(3000u, stats.records);
+    ASSERT_EQ(2999u, stats.replies);
+    ASSERT_EQ(2u, stats.errors);
+    ASSERT_GT(stats.bytes, 3000u * 20);
+    ASSERT_GE(progress_calls, 1);
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    ASSERT_EQ("v2998", manager->Do(6, "GET bulk_key2998").toString());
+    ASSERT_EQ("v2999", manager->Do(7, "GET bulk_key2999").toString());
+    ASSERT_TRUE(manager->Do(6, "GET bulk_key2999").is_nil());
+
+    // lines of a file, the DB in the first field
+    FILE* file = tmpfile();
+    fputs("6\tSET\tbulk_file1\ta b\n\n7\tHSET\tbulk_file2\tf\tv\r\nx\tSET\tbulk_file3\tv\n", file);
+    rewind(file);
+    ASSERT_TRUE(loader.Load(bulk_file_source(file, 0, true), &stats));
+    fclose(file);
+    ASSERT_EQ(3u, stats.records);
+    ASSERT_EQ(2u, stats.replies);
+    ASSERT_EQ(1u, stats.errors);
+    ASSERT_EQ("a b", manager->Do(6, "GET bulk_file1").toString());
+    ASSERT_EQ("v", manager->Do(7, "HGET bulk_file2 f").toString());
+
+    for (int i = 0; i < 3000; ++i) {
+        manager->Do((i % 2) ? 7 : 6, "DEL bulk_key%d", i);
+    }
+    manager->Do(6, "DEL bulk_file1");
+    manager->Do(7, "DEL bulk_file2");
+    delete manager;
+}
+
+TEST(cloredis, scan_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    std::set<std::string> expected;
+    for (int i = 0; i < 500; ++i) {
+        expected.insert("scan_key:" + std::to_string(i));
+        manager->Do(5, "SET scan_key:%d v", i);
+    }
+    manager->Do(5, "HSET scan_hash f1 v1 f2 v2");
+    manager->Do(5, "SADD scan_set m1 m2 m3");
+
+    // pages come one by one, the next one requested while the caller reads
+    ScanOption option;
+    option.match = "scan_key:*";
+    option.count = 20;
+    std::set<std::string> got;
+    {
+        RedisScan scan = RedisScan::Keys(manager, 5, &option);
+        for (auto& entry : scan) {
+            got.insert(entry.key);
+        }
+        ASSERT_TRUE(scan.ok());
+        ASSERT_GT(scan.page_cnt(), 1u);
+    }
+    ASSERT_EQ(expected, got);
+    ASSERT_EQ(manager->ActiveConnectionCount(), manager->ConnectionInPool());
+
+    // segments of the cursor space cover the whole keyspace together
+    got.clear();
+    std::mutex mutex;
+    ASSERT_TRUE(ParallelScan(manager, 5, 4, &option, [&](const std::vector<ScanEntry>& page) {
+        std::lock_guard<std::mutex> lk(mutex);
+        for (auto& entry : page) {
+            got.insert(entry.key);
+        }
+    }));
+    ASSERT_EQ(expected, got);
+    ASSERT_EQ(0u, ScanSegment::Split(0, 4).first);
+    ASSERT_EQ(0u, ScanSegment::Split(3, 4).last);
+    ASSERT_EQ(ScanSegment::Split(1, 4).last, ScanSegment::Split(2, 4).first);
+    ASSERT_EQ(1ULL << 63, ScanSegment::Reverse(1));
+
+    option.match = "scan_*";
+    option.type = "hash";
+    std::vector<ScanEntry> page;
+    RedisScan typed = RedisScan::Keys(manager, 5, &option);
+    got.clear();
+    while (typed.NextPage(&page)) {
+        for (auto& entry : page) {
+            got.insert(entry.key);
+        }
+    }
+    ASSERT_EQ(std::set<std::string>{"scan_hash"}, got);
+
+    std::map<std::string, std::string> fields;
+    for (auto& entry : RedisScan::HScan(manager, 5, "scan_hash")) {
+        fields[entry.key] = entry.value;
+    }
+    ASSERT_EQ(2u, fields.size());
+    ASSERT_EQ("v2", fields["f2"]);
+    got.clear();
+    for (auto& entry : RedisScan::SScan(manager, 5, "scan_set")) {
+        got.insert(entry.key);
+    }
+    ASSERT_EQ(3u, got.size());
+
+    RedisScan failed(NULL, "SCAN");
+    ASSERT_TRUE(failed.begin() == failed.end());
+    ASSERT_FALSE(failed.ok());
+
+    for (int i = 0; i < 500; ++i) {
+        manager->Do(5, "DEL scan_key:%d", i);
+    }
+    manager->Do(5, "DEL scan_hash scan_set");
+    delete manager;
+
+    // every shard, each split in two
+    RedisShardedManager sharded;
+    ASSERT_TRUE(sharded.Init(Config::instance()->GetString("redis.shard_host"), password, timeout));
+    expected.clear();
+    for (int i = 0; i < 200; ++i) {
+        std::string key = "scan_shard:" + std::to_string(i);
+        expected.insert(key);
+        sharded.Do(key, "SET %s v", key.c_str());
+    }
+    option = ScanOption();
+    option.match = "scan_shard:*";
+    got.clear();
+    ASSERT_TRUE(ParallelScan(&sharded, 2, &option, [&](const std::vector<ScanEntry>& page) {
+        std::lock_guard<std::mutex> lk(mutex);
+        for (auto& entry : page) {
+            got.insert(entry.key);
+        }
+    }));
+    ASSERT_EQ(expected, got);
+    for (auto& key : expected) {
+        sharded.Do(key, "DEL %s", key.c_str());
+    }
+}
+
+TEST(cloredis, mutator_test) {
+    std::string host     = Config::instance()->GetString("redis.host");
+    int32_t timeout      = Config::instance()->GetInt32("redis.timeout");
+    std::string password = Config::instance()->GetString("redis.password");
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->Init(host, password, timeout));
+    for (int i = 0; i < 300; ++i) {
+        manager->Do(4, "SET mutate_key:%d v", i);
+    }
+    manager->Do(4, "SET mutate_other v");
+
+    MutateOption option;
+    RedisKeyMutator unsafe(manager, 4, &option);
+    std::string err;
+    ASSERT_FALSE(unsafe.Unlink(NULL, &err));
+    ASSERT_EQ(ERR_MUTATE_NO_PATTERN, err);
+
+    option.scan.match = "mutate_key:*";
+    option.scan.count = 50;
+    option.batch_size = 40;
+    option.concurrency = 2;
+    option.progress_interval_ms = 0;
+    int progress_calls = 0;
+    std::mutex mutex;
+    option.progress = [&](const MutateStats&) {
+        std::lock_guard<std::mutex> lk(mutex);
+        ++progress_calls;
+    };
+    RedisKeyMutator mutator(manager, 4, &option);
+    MutateStats stats;
+    // PEXPIRE 0 would delete every key
+    ASSERT_FALSE(mutator.Expire(0, &stats, &err));
+    ASSERT_EQ(ERR_MUTATE_BAD_TTL, err);
+    ASSERT_FALSE(mutator.Expire(-1));
+    ASSERT_EQ("v", manager->Do(4, "GET mutate_key:7").toString());
+    ASSERT_TRUE(mutator.Expire(100000, &stats));
+    // a key given twice by the scan has its TTL set twice
+    ASSERT_GE(stats.scanned, 300u);
+    ASSERT_GE(stats.changed, 300u);
+    ASSERT_EQ(0u, stats.failed);
+    ASSERT_GT(manager->Do(4, "PTTL mutate_key:7").toInt64(), 0);
+    ASSERT_EQ(-1, manager->Do(4, "PTTL mutate_other").toInt64());
+    ASSERT_GE(progress_calls, 1);
+
+    ASSERT_TRUE(mutator.Persist(&stats));
+    ASSERT_EQ(300u, stats.changed);
+    ASSERT_EQ(-1, manager->Do(4, "PTTL mutate_key:7").toInt64());
+
+    // 300 keys at 1000 keys/s take about 300 ms
+    option.max_keys_per_sec = 1000;
+    RedisKeyMutator limited(manager, 4, &option);
+    ASSERT_TRUE(limited.Unlink(&stats));
+    ASSERT_EQ(300u, stats.changed);
+    ASSERT_GE(stats.elapsed_ms, 200);
+    ASSERT_GT(stats.keys_per_sec(), 0.0);
+    ASSERT_TRUE(manager->Do(4, "GET mutate_key:7").is_nil());
+    ASSERT_EQ("v", manager->Do(4, "GET mutate_other").toString());
+
+    manager->Do(4, "DEL mutate_other");
+    delete manager;
+}
+
+TEST(cloredis, script_test) {
+    std::string host        = Config::instance()->GetString("redis.host");
+    std::string slave_hosts = Config::instance()->GetString("redis.slave_host");
+    int32_t timeout         = Config::instance()->GetInt32("redis.timeout");
+    std::string password    = Config::instance()->GetString("redis.password");
+
+    ASSERT_EQ("da39a3ee5e6b4b0d3255bfef95601890afd80709", sha1_hex(""));
+    ASSERT_EQ("a9993e364706816aba3e25717850c26c9cd0d89d", sha1_hex("abc"));
+    ASSERT_EQ("84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+            sha1_hex("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"));
+
+    RedisManager* manager = new RedisManager();
+    ASSERT_TRUE(manager->InitEx(host, slave_hosts, password, timeout));
+    manager->DoRoute(0, ROUTE_MASTER, "SCRIPT FLUSH");
+    for (int i = 0; i < manager->slave_cnt(); ++i) {
+        RedisConnection slave = manager->Get(DEFAULT_DB, NULL, SLAVE, i);
+        slave->Do("SCRIPT FLUSH");
+    }
+    delete manager;
+
+    // registered before init, loaded to master and slaves by InitEx
+    manager = new RedisManager();
+    std::string incr = "return redis.call('INCRBY', KEYS[1], ARGV[1])";
+    std::string sha = manager->RegisterScript(incr);
+    ASSERT_EQ(sha1_hex(incr), sha);
+    ASSERT_TRUE(manager->InitEx(host, slave_hosts, password, timeout));
+    ASSERT_EQ(1, manager->DoRoute(0, ROUTE_MASTER, "SCRIPT EXISTS %s", sha.c_str())[0].toInt32());
+    for (int i = 0; i < manager->slave_cnt(); ++i) {
+        RedisConnection slave = manager->Get(DEFAULT_DB, NULL, SLAVE, i);
+        ASSERT_EQ(1, slave->Do("SCRIPT EXISTS %s", sha.c_str())[0].toInt32());
+    }
+    RedisReply reply = manager->EvalScript(3, sha, {"script_counter"}, {"5"});
+    ASSERT_TRUE(reply.ok());
+
+    // a server that lost its cache gets the script again
+    manager->DoRoute(0, ROUTE_MASTER, "SCRIPT FLUSH");
+    ASSERT_EQ(0, manager->DoRoute(0, ROUTE_MASTER, "SCRIPT EXISTS %s", sha.c_str())[0].toInt32());
+    reply = manager->EvalScript(3, sha, {"script_counter"}, {"5"});
+    ASSERT_TRUE(reply.ok());
+    ASSERT_EQ(1, manager->DoRoute(0, ROUTE_MASTER, "SCRIPT EXISTS %s", sha.c_str())[0].toInt32());
+    reply = manager->EvalScript(3, sha1_hex("unknown"), {"script_counter"});
+    ASSERT_TRUE(reply.error());
+
+    // registered later, loaded at once; loaded to the new servers by Reload
+    std::string get = "return redis.call('GET', KEYS[1])";
+    std::string get_sha = manager->RegisterScript(get);
+    if (manager->slave_cnt() > 0) {
+        RedisConnection slave = manager->Get(DEFAULT_DB, NULL, SLAVE, 0);
+        ASSERT_EQ(1, slave->Do("SCRIPT EXISTS %s", get_sha.c_str())[0].toInt32());
+        slave->Do("SCRIPT FLUSH");
+    }
+    manager->DoRoute(0, ROUTE_MASTER, "SCRIPT FLUSH");
+    ASSERT_TRUE(manager->Reload(host, slave_hosts));
+    ASSERT_EQ(1, manager->DoRoute(0, ROUTE_MASTER, "SCRIPT EXISTS %s", get_sha.c_str())[0].toInt32());
+    ASSERT_EQ(1, manager->DoRoute(0, ROUTE_MASTER, "SCRIPT EXISTS %s", sha.c_str())[0].toInt32());
+    if (manager->slave_cnt() > 0) {
+        RedisConnection slave = manager->Get(DEFAULT_DB, NULL, SLAVE, 0);
+        ASSERT_EQ(1, slave->Do("SCRIPT EXISTS %s", get_sha.c_str())[0].toInt32());
+    }
+
+    manager->Do(3, "DEL script_counter");
+    delete manager;
+}
+
+// exposes how a connection records its hiredis errors
+class HiredisErrorReply : public RedisReply {
+public:
+    using RedisReply::UpdateHiredisError;
+};
+
+TEST(cloredis, sys_errno_test) {
+    // an I/O error keeps static text plus the errno, 'err_str' joins them
+    HiredisErrorReply reply;
+    reply.UpdateHiredisError(REDIS_ERR_IO, ECONNREFUSED);
+    ASSERT_TRUE(reply.error());
+    ASSERT_EQ(STATE_ERROR_HIREDIS, reply.err_state());
+    ASSERT_STREQ("I/O error", reply.err_msg());
+    ASSERT_EQ(std::string("I/O error: ") + strerror(ECONNREFUSED), reply.err_str());
+    // the errno goes along with a share
+    ASSERT_EQ(reply.err_str(), reply.Share().err_str());
+
+    // other hiredis errors have no errno to add
+    reply.UpdateHiredisError(REDIS_ERR_EOF, ECONNREFUSED);
+    ASSERT_EQ("Server closed the connection", reply.err_str());
+}
+
 int main(int argc, char** argv) {
     // use cloriConf to load config
     Config::instance()->Load(g_redis_conf, SRC_DIRECT);
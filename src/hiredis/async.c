@@ -432,7 +432,7 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
         if (reply == NULL) {
             /* When the connection is being disconnected and there are
              * no more replies, this is the cue to really disconnect. */
-            if (c->flags & REDIS_DISCONNECTING && sdslen(c->obuf) == 0
+            if (c->flags & REDIS_DISCONNECTING && !redisHasPendingOutput(c)
                 && ac->replies.head == NULL) {
                 __redisAsyncDisconnect(ac);
                 return;
@@ -35,6 +35,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
@@ -48,6 +49,8 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 static void *createArrayObject(const redisReadTask *task, int elements);
 static void *createIntegerObject(const redisReadTask *task, long long value);
 static void *createNilObject(const redisReadTask *task);
+static void *createDoubleObject(const redisReadTask *task, double value, char *str, size_t len);
+static void *createBoolObject(const redisReadTask *task, int bval);
 
 /* Default set of functions to build the reply. Keep in mind that such a
  * function returning NULL is interpreted as OOM. */
@@ -56,7 +59,9 @@ static redisReplyObjectFunctions defaultFunctions = {
     createArrayObject,
     createIntegerObject,
     createNilObject,
-    freeReplyObject
+    freeReplyObject,
+    createDoubleObject,
+    createBoolObject
 };
 
 /* Create a reply object */
@@ -80,8 +85,14 @@ void freeReplyObject(void *reply) {
 
     switch(r->type) {
     case REDIS_REPLY_INTEGER:
+    case REDIS_REPLY_BOOL:
+    case REDIS_REPLY_NIL:
         break; /* Nothing to free */
     case REDIS_REPLY_ARRAY:
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_ATTR:
+    case REDIS_REPLY_PUSH:
         if (r->element != NULL) {
             for (j = 0; j < r->elements; j++)
                 freeReplyObject(r->element[j]);
@@ -91,6 +102,9 @@ void freeReplyObject(void *reply) {
     case REDIS_REPLY_ERROR:
     case REDIS_REPLY_STATUS:
     case REDIS_REPLY_STRING:
+    case REDIS_REPLY_DOUBLE:
+    case REDIS_REPLY_BIGNUM:
+    case REDIS_REPLY_VERB:
         free(r->str);
         break;
     }
@@ -113,9 +127,17 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 
     assert(task->type == REDIS_REPLY_ERROR  ||
            task->type == REDIS_REPLY_STATUS ||
-           task->type == REDIS_REPLY_STRING);
-
-    /* Copy string value */
+           task->type == REDIS_REPLY_STRING ||
+           task->type == REDIS_REPLY_BIGNUM ||
+           task->type == REDIS_REPLY_VERB);
+
+    /* Copy string value, a verbatim string keeps its format apart */
+    if (task->type == REDIS_REPLY_VERB) {
+        memcpy(r->vtype,str,3);
+        r->vtype[3] = '\0';
+        str += 4;
+        len -= 4;
+    }
     memcpy(buf,str,len);
     buf[len] = '\0';
     r->str = buf;
@@ -123,7 +145,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(redisIsAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -132,7 +154,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 static void *createArrayObject(const redisReadTask *task, int elements) {
     redisReply *r, *parent;
 
-    r = createReplyObject(REDIS_REPLY_ARRAY);
+    r = createReplyObject(task->type);
     if (r == NULL)
         return NULL;
 
@@ -148,7 +170,7 @@ static void *createArrayObject(const redisReadTask *task, int elements) {
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(redisIsAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -165,7 +187,7 @@ static void *createIntegerObject(const redisReadTask *task, long long value) {
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(redisIsAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -180,7 +202,50 @@ static void *createNilObject(const redisReadTask *task) {
 
     if (task->parent) {
         parent = task->parent->obj;
-        assert(parent->type == REDIS_REPLY_ARRAY);
+        assert(redisIsAggregateType(parent->type));
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createDoubleObject(const redisReadTask *task, double value, char *str, size_t len) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_DOUBLE);
+    if (r == NULL)
+        return NULL;
+
+    r->dval = value;
+    /* The text is kept as well, a double may not print back the same */
+    r->str = malloc(len+1);
+    if (r->str == NULL) {
+        freeReplyObject(r);
+        return NULL;
+    }
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(redisIsAggregateType(parent->type));
+        parent->element[task->idx] = r;
+    }
+    return r;
+}
+
+static void *createBoolObject(const redisReadTask *task, int bval) {
+    redisReply *r, *parent;
+
+    r = createReplyObject(REDIS_REPLY_BOOL);
+    if (r == NULL)
+        return NULL;
+
+    r->integer = bval != 0;
+
+    if (task->parent) {
+        parent = task->parent->obj;
+        assert(redisIsAggregateType(parent->type));
         parent->element[task->idx] = r;
     }
     return r;
@@ -591,6 +656,8 @@ static redisContext *redisContextInit(void) {
         return NULL;
 
     c->obuf = sdsempty();
+    c->maxbuf = REDIS_OBUF_MAX_BUF;
+    c->rsize = REDIS_READ_INIT_SIZE;
     c->reader = redisReaderCreate();
 
     if (c->obuf == NULL || c->reader == NULL) {
@@ -607,6 +674,7 @@ void redisFree(redisContext *c) {
     if (c->fd > 0)
         close(c->fd);
     sdsfree(c->obuf);
+    free(c->ochunks);
     redisReaderFree(c->reader);
     free(c->tcp.host);
     free(c->tcp.source_addr);
@@ -634,7 +702,10 @@ int redisReconnect(redisContext *c) {
     redisReaderFree(c->reader);
 
     c->obuf = sdsempty();
+    c->ochunks_len = c->ochunk_idx = c->ochunk_off = 0;
     c->reader = redisReaderCreate();
+    if (c->reader != NULL)
+        c->reader->maxbuf = c->maxbuf;
 
     if (c->connection_type == REDIS_CONN_TCP) {
         return redisContextConnectBindTcp(c, c->tcp.host, c->tcp.port,
@@ -772,20 +843,78 @@ int redisEnableKeepAlive(redisContext *c) {
     return REDIS_OK;
 }
 
+void redisSetMaxBuffer(redisContext *c, size_t maxbuf) {
+    c->maxbuf = maxbuf;
+    c->reader->maxbuf = maxbuf;
+}
+
+void redisTrimBuffers(redisContext *c) {
+    if (c->maxbuf != 0 && !redisHasPendingOutput(c) &&
+        sdsalloc(c->obuf) > c->maxbuf) {
+        sdsfree(c->obuf);
+        c->obuf = sdsempty();
+    }
+    redisReaderTrim(c->reader);
+}
+
+/* Pick the size of the next read. When the reader is in the middle of a bulk
+ * item the remaining length is known exactly, otherwise the size adapts to
+ * what the previous reads returned. Spare room already allocated in the
+ * reader buffer is always offered to the kernel. */
+static size_t __redisReadSize(redisContext *c, int *sized) {
+    redisReader *r = c->reader;
+    size_t size = c->rsize;
+    size_t avail = sdsavail(r->buf);
+
+    *sized = 0;
+    if (r->pending > size) {
+        size = r->pending;
+        *sized = 1;
+    }
+    /* Spare room above maxbuf is left for the reader to release. */
+    if (avail > size && (r->maxbuf == 0 || avail <= r->maxbuf))
+        size = avail;
+    return size;
+}
+
+/* Grow the read size when a read filled the whole request, shrink it when
+ * reads keep returning much less. */
+static void __redisReadAdapt(redisContext *c, size_t want, size_t got) {
+    if (got >= want) {
+        if (c->rsize < REDIS_READ_MAX_SIZE)
+            c->rsize *= 2;
+    } else if (got < c->rsize/4 && c->rsize > REDIS_READ_MIN_SIZE) {
+        c->rsize /= 2;
+    }
+}
+
 /* Use this function to handle a read event on the descriptor. It will try
- * and read some bytes from the socket and feed them to the reply parser.
+ * and read some bytes from the socket straight into the spare room of the
+ * reader buffer, which is sized by __redisReadSize.
  *
  * After this function is called, you may use redisContextReadReply to
  * see if there is a reply available. */
 int redisBufferRead(redisContext *c) {
-    char buf[1024*16];
-    int nread;
+    size_t want;
+    char *buf;
+    int nread, sized;
 
-    /* Return early when the context has seen an error. */
+    /* Return early when the context or its reader has seen an error. */
     if (c->err)
         return REDIS_ERR;
+    if (c->reader->err) {
+        __redisSetError(c,c->reader->err,c->reader->errstr);
+        return REDIS_ERR;
+    }
+
+    want = __redisReadSize(c,&sized);
+    buf = redisReaderPrepareBuffer(c->reader,want);
+    if (buf == NULL) {
+        __redisSetError(c,c->reader->err,c->reader->errstr);
+        return REDIS_ERR;
+    }
 
-    nread = read(c->fd,buf,sizeof(buf));
+    nread = read(c->fd,buf,want);
     if (nread == -1) {
         if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
             /* Try again later */
@@ -797,32 +926,68 @@ int redisBufferRead(redisContext *c) {
         __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
         return REDIS_ERR;
     } else {
-        if (redisReaderFeed(c->reader,buf,nread) != REDIS_OK) {
-            __redisSetError(c,c->reader->err,c->reader->errstr);
-            return REDIS_ERR;
-        }
+        redisReaderCommitBuffer(c->reader,nread);
+        c->rstats.reads++;
+        c->rstats.bytes += nread;
+        c->rstats.last_size = nread;
+        if ((size_t)nread > c->rstats.max_size)
+            c->rstats.max_size = nread;
+        if (sized)
+            c->rstats.sized_reads++;
+        else
+            __redisReadAdapt(c,want,nread);
     }
     return REDIS_OK;
 }
 
-/* Write the output buffer to the socket.
+/* Drop the output queue once everything in it has been written. The obuf
+ * allocation is reused unless it grew beyond the retained maximum. */
+static void __redisOutputReset(redisContext *c) {
+    c->ochunks_len = 0;
+    c->ochunk_idx = 0;
+    c->ochunk_off = 0;
+    if (c->maxbuf != 0 && sdsalloc(c->obuf) > c->maxbuf) {
+        sdsfree(c->obuf);
+        c->obuf = sdsempty();
+    } else {
+        sdsclear(c->obuf);
+    }
+}
+
+/* Write the output queue to the socket.
  *
- * Returns REDIS_OK when the buffer is empty, or (a part of) the buffer was
- * successfully written to the socket. When the buffer is empty after the
- * write operation, "done" is set to 1 (if given).
+ * Returns REDIS_OK when the queue is empty, or (a part of) the queue was
+ * successfully written to the socket. When the queue is empty after the
+ * write operation, "done" is set to 1 (if given). Chunks that are only
+ * partially written are tracked with a cursor, so nothing is moved.
  *
  * Returns REDIS_ERR if an error occurred trying to write and sets
  * c->errstr to hold the appropriate error string.
  */
 int redisBufferWrite(redisContext *c, int *done) {
-    int nwritten;
+    struct iovec iov[REDIS_OBUF_IOV_MAX];
+    redisOutputChunk *chunk;
+    size_t j, n, left;
+    ssize_t nwritten;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
 
-    if (sdslen(c->obuf) > 0) {
-        nwritten = write(c->fd,c->obuf,sdslen(c->obuf));
+    if (c->ochunk_idx < c->ochunks_len) {
+        for (j = c->ochunk_idx, n = 0;
+             j < c->ochunks_len && n < REDIS_OBUF_IOV_MAX; j++, n++) {
+            chunk = &c->ochunks[j];
+            iov[n].iov_base = (char*)(chunk->ref ? chunk->ref : c->obuf+chunk->off);
+            iov[n].iov_len = chunk->len;
+        }
+        iov[0].iov_base = (char*)iov[0].iov_base+c->ochunk_off;
+        iov[0].iov_len -= c->ochunk_off;
+
+        if (n == 1)
+            nwritten = write(c->fd,iov[0].iov_base,iov[0].iov_len);
+        else
+            nwritten = writev(c->fd,iov,n);
         if (nwritten == -1) {
             if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
                 /* Try again later */
@@ -831,26 +996,51 @@ int redisBufferWrite(redisContext *c, int *done) {
                 return REDIS_ERR;
             }
         } else if (nwritten > 0) {
-            if (nwritten == (signed)sdslen(c->obuf)) {
-                sdsfree(c->obuf);
-                c->obuf = sdsempty();
-            } else {
-                sdsrange(c->obuf,nwritten,-1);
+            /* Advance the cursor over the chunks that were written. */
+            left = nwritten;
+            while (left > 0) {
+                chunk = &c->ochunks[c->ochunk_idx];
+                n = chunk->len-c->ochunk_off;
+                if (left < n) {
+                    c->ochunk_off += left;
+                    break;
+                }
+                left -= n;
+                c->ochunk_idx++;
+                c->ochunk_off = 0;
             }
+            if (c->ochunk_idx == c->ochunks_len)
+                __redisOutputReset(c);
         }
     }
-    if (done != NULL) *done = (sdslen(c->obuf) == 0);
+    if (done != NULL) *done = (c->ochunk_idx == c->ochunks_len);
     return REDIS_OK;
 }
 
+int redisHasPendingOutput(redisContext *c) {
+    return c->ochunk_idx < c->ochunks_len;
+}
+
 /* Internal helper function to try and get a reply from the reader,
  * or set an error in the context otherwise. */
 int redisGetReplyFromReader(redisContext *c, void **reply) {
-    if (redisReaderGetReply(c->reader,reply) == REDIS_ERR) {
-        __redisSetError(c,c->reader->err,c->reader->errstr);
-        return REDIS_ERR;
+    for (;;) {
+        if (redisReaderGetReply(c->reader,reply) == REDIS_ERR) {
+            __redisSetError(c,c->reader->err,c->reader->errstr);
+            return REDIS_ERR;
+        }
+        /* Push messages come between replies, hand them over and go on.
+         * Attributes come ahead of the reply they annotate, and are dropped */
+        if (*reply == NULL || c->reader->fn != &defaultFunctions ||
+            (((redisReply*)*reply)->type != REDIS_REPLY_PUSH &&
+             ((redisReply*)*reply)->type != REDIS_REPLY_ATTR))
+            return REDIS_OK;
+        if (((redisReply*)*reply)->type == REDIS_REPLY_PUSH && c->push_cb)
+            c->push_cb(c->push_privdata,*reply);
+        else
+            freeReplyObject(*reply);
+        *reply = NULL;
     }
-    return REDIS_OK;
 }
 
 int redisGetReply(redisContext *c, void **reply) {
@@ -884,6 +1074,69 @@ int redisGetReply(redisContext *c, void **reply) {
 }
 
 
+/* Make room for one more chunk in the output queue. */
+static int __redisOutputReserve(redisContext *c) {
+    redisOutputChunk *chunks;
+    size_t cap;
+
+    if (c->ochunks_len < c->ochunks_cap)
+        return REDIS_OK;
+
+    cap = c->ochunks_cap ? c->ochunks_cap*2 : 16;
+    chunks = realloc(c->ochunks,cap*sizeof(*chunks));
+    if (chunks == NULL)
+        return REDIS_ERR;
+    c->ochunks = chunks;
+    c->ochunks_cap = cap;
+    return REDIS_OK;
+}
+
+/* Copy bytes to the tail of obuf. Consecutive copies share one chunk. */
+static int __redisOutputCopy(redisContext *c, const char *buf, size_t len) {
+    redisOutputChunk *chunk;
+    size_t off = sdslen(c->obuf);
+    sds newbuf;
+
+    if (len == 0)
+        return REDIS_OK;
+    if (__redisOutputReserve(c) != REDIS_OK)
+        return REDIS_ERR;
+
+    newbuf = sdscatlen(c->obuf,buf,len);
+    if (newbuf == NULL)
+        return REDIS_ERR;
+    c->obuf = newbuf;
+
+    if (c->ochunks_len > 0) {
+        chunk = &c->ochunks[c->ochunks_len-1];
+        if (chunk->ref == NULL && chunk->off+chunk->len == off) {
+            chunk->len += len;
+            return REDIS_OK;
+        }
+    }
+    chunk = &c->ochunks[c->ochunks_len++];
+    chunk->ref = NULL;
+    chunk->off = off;
+    chunk->len = len;
+    return REDIS_OK;
+}
+
+/* Queue caller-owned bytes without copying them. */
+static int __redisOutputRef(redisContext *c, const char *buf, size_t len) {
+    redisOutputChunk *chunk;
+
+    if (len == 0)
+        return REDIS_OK;
+    if (__redisOutputReserve(c) != REDIS_OK)
+        return REDIS_ERR;
+
+    chunk = &c->ochunks[c->ochunks_len++];
+    chunk->ref = buf;
+    chunk->off = 0;
+    chunk->len = len;
+    return REDIS_OK;
+}
+
 /* Helper function for the redisAppendCommand* family of functions.
  *
  * Write a formatted command to the output buffer. When this family
@@ -891,15 +1144,10 @@ int redisGetReply(redisContext *c, void **reply) {
  * the reply (or replies in pub/sub).
  */
 int __redisAppendCommand(redisContext *c, const char *cmd, size_t len) {
-    sds newbuf;
-
-    newbuf = sdscatlen(c->obuf,cmd,len);
-    if (newbuf == NULL) {
+    if (__redisOutputCopy(c,cmd,len) != REDIS_OK) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
         return REDIS_ERR;
     }
-
-    c->obuf = newbuf;
     return REDIS_OK;
 }
 
@@ -963,6 +1211,46 @@ int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const s
     return REDIS_OK;
 }
 
+/* Write the protocol headers to obuf and queue every argument of at least
+ * REDIS_OBUF_REF_THRESHOLD bytes by reference, so large values go to the
+ * socket straight from the caller's memory through writev(2). On failure
+ * the output queue is restored to its previous state. */
+int redisAppendCommandArgvRef(redisContext *c, int argc, const char **argv, const size_t *argvlen) {
+    size_t saved_len = c->ochunks_len;
+    size_t saved_obuf = sdslen(c->obuf);
+    size_t saved_last = saved_len ? c->ochunks[saved_len-1].len : 0;
+    char hdr[32];
+    size_t len;
+    int hlen, j;
+
+    hlen = snprintf(hdr,sizeof(hdr),"*%d\r\n",argc);
+    if (__redisOutputCopy(c,hdr,hlen) != REDIS_OK)
+        goto oom;
+    for (j = 0; j < argc; j++) {
+        len = argvlen ? argvlen[j] : strlen(argv[j]);
+        hlen = snprintf(hdr,sizeof(hdr),"$%zu\r\n",len);
+        if (__redisOutputCopy(c,hdr,hlen) != REDIS_OK)
+            goto oom;
+        if (len >= REDIS_OBUF_REF_THRESHOLD) {
+            if (__redisOutputRef(c,argv[j],len) != REDIS_OK)
+                goto oom;
+        } else if (__redisOutputCopy(c,argv[j],len) != REDIS_OK) {
+            goto oom;
+        }
+        if (__redisOutputCopy(c,"\r\n",2) != REDIS_OK)
+            goto oom;
+    }
+    return REDIS_OK;
+
+oom:
+    c->ochunks_len = saved_len;
+    if (saved_len > 0)
+        c->ochunks[saved_len-1].len = saved_last;
+    sdssetlen(c->obuf,saved_obuf);
+    __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+    return REDIS_ERR;
+}
+
 /* Helper function for the redisCommand* family of functions.
  *
  * Write a formatted command to the output buffer. If the given context is
@@ -1004,3 +1292,9 @@ void *redisCommandArgv(redisContext *c, int argc, const char **argv, const size_
         return NULL;
     return __redisBlockForReply(c);
 }
+
+void *redisCommandArgvRef(redisContext *c, int argc, const char **argv, const size_t *argvlen) {
+    if (redisAppendCommandArgvRef(c,argc,argv,argvlen) != REDIS_OK)
+        return NULL;
+    return __redisBlockForReply(c);
+}
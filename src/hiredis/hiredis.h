@@ -76,6 +76,22 @@
 
 #define REDIS_KEEPALIVE_INTERVAL 15 /* seconds */
 
+/* Arguments at least this long are queued by reference instead of being
+ * copied into the output buffer by the redisAppendCommandArgvRef family. */
+#define REDIS_OBUF_REF_THRESHOLD 1024
+
+/* Maximum number of chunks handed to a single writev(2) call. */
+#define REDIS_OBUF_IOV_MAX 64
+
+/* Default capacity obuf may keep once it has been flushed. */
+#define REDIS_OBUF_MAX_BUF (1024*16)
+
+/* Bounds of the adaptive read size used when the reader does not know how
+ * many bytes the reply still needs. */
+#define REDIS_READ_MIN_SIZE (1024*4)
+#define REDIS_READ_INIT_SIZE (1024*16)
+#define REDIS_READ_MAX_SIZE (1024*1024)
+
 /* number of times we retry to connect in the case of EADDRNOTAVAIL and
  * SO_REUSEADDR is being used. */
 #define REDIS_CONNECT_RETRIES  10
@@ -92,6 +108,8 @@ typedef struct redisReply {
     char *str; /* Used for both REDIS_REPLY_ERROR and REDIS_REPLY_STRING */
     size_t elements; /* number of elements, for REDIS_REPLY_ARRAY */
     struct redisReply **element; /* elements vector for REDIS_REPLY_ARRAY */
+    double dval; /* The double when type is REDIS_REPLY_DOUBLE, 'str' has its text */
+    char vtype[4]; /* Format of a REDIS_REPLY_VERB, like "txt", 'str' has the text only */
 } redisReply;
 
 redisReader *redisReaderCreate(void);
@@ -112,13 +130,43 @@ enum redisConnectionType {
     REDIS_CONN_UNIX
 };
 
+/* A chunk of pending output. When "ref" is NULL the bytes live in the
+ * context's obuf at offset "off", otherwise they belong to the caller. */
+typedef struct redisOutputChunk {
+    const char *ref;
+    size_t off;
+    size_t len;
+} redisOutputChunk;
+
+/* Read statistics of a context, see redisBufferRead. */
+typedef struct redisReadStats {
+    unsigned long long reads; /* read(2) calls that returned data */
+    unsigned long long bytes; /* Total bytes read */
+    unsigned long long sized_reads; /* Reads sized by a pending bulk length */
+    size_t last_size; /* Bytes returned by the last read */
+    size_t max_size; /* Largest number of bytes returned by one read */
+} redisReadStats;
+
 /* Context for a connection to Redis */
+/* Called with every RESP3 push message a blocking context reads; the callback
+ * owns 'reply'. Without a callback push messages are freed, either way they
+ * never take the place of the reply to a command. */
+typedef void (redisPushFn)(void *privdata, void *reply);
+
 typedef struct redisContext {
     int err; /* Error flags, 0 when there is no error */
     char errstr[128]; /* String representation of error when applicable */
     int fd;
     int flags;
-    char *obuf; /* Write buffer */
+    char *obuf; /* Write buffer, holds copied and formatted bytes */
+    redisOutputChunk *ochunks; /* Output queue, written in order */
+    size_t ochunks_len; /* Number of queued chunks */
+    size_t ochunks_cap; /* Allocated chunk slots */
+    size_t ochunk_idx; /* First chunk not completely written */
+    size_t ochunk_off; /* Bytes of ochunks[ochunk_idx] already written */
+    size_t maxbuf; /* Max capacity obuf retains once flushed, 0 for no limit */
+    size_t rsize; /* Size of the next read when nothing is pending */
+    redisReadStats rstats;
     redisReader *reader; /* Protocol reader */
 
     enum redisConnectionType connection_type;
@@ -134,6 +182,8 @@ typedef struct redisContext {
         char *path;
     } unix_sock;
 
+    redisPushFn *push_cb;
+    void *push_privdata;
 } redisContext;
 
 redisContext *redisConnect(const char *ip, int port);
@@ -161,6 +211,12 @@ int redisReconnect(redisContext *c);
 
 int redisSetTimeout(redisContext *c, const struct timeval tv);
 int redisEnableKeepAlive(redisContext *c);
+
+/* Set the capacity that obuf and the reader buffer may retain once drained,
+ * 0 means no limit. redisTrimBuffers releases drained buffers above it,
+ * which is useful before parking an idle connection. */
+void redisSetMaxBuffer(redisContext *c, size_t maxbuf);
+void redisTrimBuffers(redisContext *c);
 void redisFree(redisContext *c);
 int redisFreeKeepFd(redisContext *c);
 int redisBufferRead(redisContext *c);
@@ -183,6 +239,15 @@ int redisvAppendCommand(redisContext *c, const char *format, va_list ap);
 int redisAppendCommand(redisContext *c, const char *format, ...);
 int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const size_t *argvlen);
 
+/* Like redisAppendCommandArgv, but arguments of REDIS_OBUF_REF_THRESHOLD bytes
+ * or more are referenced instead of copied. They must stay valid until the
+ * output buffer has been flushed, i.e. until redisGetReply returns in a
+ * blocking context. */
+int redisAppendCommandArgvRef(redisContext *c, int argc, const char **argv, const size_t *argvlen);
+
+/* Returns 1 when there is output that has not been written to the socket. */
+int redisHasPendingOutput(redisContext *c);
+
 /* Issue a command to Redis. In a blocking context, it is identical to calling
  * redisAppendCommand, followed by redisGetReply. The function will return
  * NULL if there was an error in performing the request, otherwise it will
@@ -191,6 +256,7 @@ int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const s
 void *redisvCommand(redisContext *c, const char *format, va_list ap);
 void *redisCommand(redisContext *c, const char *format, ...);
 void *redisCommandArgv(redisContext *c, int argc, const char **argv, const size_t *argvlen);
+void *redisCommandArgvRef(redisContext *c, int argc, const char **argv, const size_t *argvlen);
 
 #ifdef __cplusplus
 }
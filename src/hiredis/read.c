@@ -32,6 +32,7 @@
 
 #include "fmacros.h"
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #ifndef _MSC_VER
 #include <unistd.h>
@@ -40,6 +41,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <limits.h>
+#include <math.h>
 
 #include "read.h"
 #include "sds.h"
@@ -56,6 +58,7 @@ static void __redisReaderSetError(redisReader *r, int type, const char *str) {
     sdsfree(r->buf);
     r->buf = NULL;
     r->pos = r->len = 0;
+    r->pending = 0;
 
     /* Reset task stack. */
     r->ridx = -1;
@@ -232,6 +235,9 @@ static char *readLine(redisReader *r, int *_len) {
     return NULL;
 }
 
+/* '!' blob errors are read like bulk strings and then typed as errors. */
+#define REDIS_READ_BLOB_ERROR 100
+
 static void moveToNextTask(redisReader *r) {
     redisReadTask *cur, *prv;
     while (r->ridx >= 0) {
@@ -243,7 +249,7 @@ static void moveToNextTask(redisReader *r) {
 
         cur = &(r->rstack[r->ridx]);
         prv = &(r->rstack[r->ridx-1]);
-        assert(prv->type == REDIS_REPLY_ARRAY);
+        assert(redisIsAggregateType(prv->type));
         if (cur->idx == prv->elements-1) {
             r->ridx--;
         } else {
@@ -276,6 +282,73 @@ static int processLineItem(redisReader *r) {
             } else {
                 obj = (void*)REDIS_REPLY_INTEGER;
             }
+        } else if (cur->type == REDIS_REPLY_DOUBLE) {
+            if (r->fn && r->fn->createDouble) {
+                char buf[326], *eptr;
+                double d;
+
+                if ((size_t)len >= sizeof(buf)) {
+                    __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                            "Double value is too large");
+                    return REDIS_ERR;
+                }
+                memcpy(buf,p,len);
+                buf[len] = '\0';
+                if (strcasecmp(buf,"inf") == 0) {
+                    d = INFINITY;
+                } else if (strcasecmp(buf,"-inf") == 0) {
+                    d = -INFINITY;
+                } else if (strcasecmp(buf,"nan") == 0) {
+                    d = NAN;
+                } else {
+                    d = strtod(buf,&eptr);
+                    if (len == 0 || eptr[0] != '\0') {
+                        __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                                "Bad double value");
+                        return REDIS_ERR;
+                    }
+                }
+                obj = r->fn->createDouble(cur,d,buf,len);
+            } else {
+                obj = (void*)REDIS_REPLY_DOUBLE;
+            }
+        } else if (cur->type == REDIS_REPLY_NIL) {
+            if (len != 0) {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Bad nil value");
+                return REDIS_ERR;
+            }
+            if (r->fn && r->fn->createNil)
+                obj = r->fn->createNil(cur);
+            else
+                obj = (void*)REDIS_REPLY_NIL;
+        } else if (cur->type == REDIS_REPLY_BOOL) {
+            int bval = (len == 1) ? p[0] : 0;
+
+            if (bval != 't' && bval != 'f') {
+                __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                        "Bad bool value");
+                return REDIS_ERR;
+            }
+            if (r->fn && r->fn->createBool)
+                obj = r->fn->createBool(cur,bval == 't');
+            else
+                obj = (void*)REDIS_REPLY_BOOL;
+        } else if (cur->type == REDIS_REPLY_BIGNUM) {
+            int i;
+
+            /* An optional sign, then digits only. */
+            for (i = (len > 0 && p[0] == '-') ? 1 : 0; i < len; i++) {
+                if (p[i] < '0' || p[i] > '9') {
+                    __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                            "Bad bignum value");
+                    return REDIS_ERR;
+                }
+            }
+            if (r->fn && r->fn->createString)
+                obj = r->fn->createString(cur,p,len);
+            else
+                obj = (void*)REDIS_REPLY_BIGNUM;
         } else {
             /* Type will be error or status. */
             if (r->fn && r->fn->createString)
@@ -318,13 +391,14 @@ static int processBulkItem(redisReader *r) {
             return REDIS_ERR;
         }
 
-        if (len < -1 || (LLONG_MAX > SIZE_MAX && len > (long long)SIZE_MAX)) {
+        if (len < (cur->type == REDIS_REPLY_STRING ? -1 : 0) ||
+            (LLONG_MAX > SIZE_MAX && len > (long long)SIZE_MAX)) {
             __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
                     "Bulk string length out of range");
             return REDIS_ERR;
         }
 
-        if (len == -1) {
+        if (len == -1 && cur->type == REDIS_REPLY_STRING) {
             /* The nil object can always be created. */
             if (r->fn && r->fn->createNil)
                 obj = r->fn->createNil(cur);
@@ -335,11 +409,23 @@ static int processBulkItem(redisReader *r) {
             /* Only continue when the buffer contains the entire bulk item. */
             bytelen += len+2; /* include \r\n */
             if (r->pos+bytelen <= r->len) {
+                /* Verbatim strings start with their 3 bytes format and ':'. */
+                if (cur->type == REDIS_REPLY_VERB && (len < 4 || s[2+3] != ':')) {
+                    __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
+                            "Verbatim string 4 bytes of content type are "
+                            "missing or incorrectly encoded.");
+                    return REDIS_ERR;
+                }
+                if (cur->type == REDIS_READ_BLOB_ERROR)
+                    cur->type = REDIS_REPLY_ERROR;
                 if (r->fn && r->fn->createString)
                     obj = r->fn->createString(cur,s+2,len);
                 else
-                    obj = (void*)REDIS_REPLY_STRING;
+                    obj = (void*)(size_t)(cur->type);
                 success = 1;
+            } else {
+                /* Let the caller size its next read to the rest of the item. */
+                r->pending = r->pos+bytelen-r->len;
             }
         }
 
@@ -351,6 +437,7 @@ static int processBulkItem(redisReader *r) {
             }
 
             r->pos += bytelen;
+            r->pending = 0;
 
             /* Set reply if this is the root object. */
             if (r->ridx == 0) r->reply = obj;
@@ -385,12 +472,17 @@ static int processMultiBulkItem(redisReader *r) {
 
         root = (r->ridx == 0);
 
-        if (elements < -1 || elements > INT_MAX) {
+        if (elements < (cur->type == REDIS_REPLY_ARRAY ? -1 : 0) || elements > INT_MAX ||
+            ((cur->type == REDIS_REPLY_MAP || cur->type == REDIS_REPLY_ATTR) && elements > INT_MAX/2)) {
             __redisReaderSetError(r,REDIS_ERR_PROTOCOL,
                     "Multi-bulk length out of range");
             return REDIS_ERR;
         }
 
+        /* Maps and attributes have a key and a value per entry. */
+        if (cur->type == REDIS_REPLY_MAP || cur->type == REDIS_REPLY_ATTR)
+            elements *= 2;
+
         if (elements == -1) {
             if (r->fn && r->fn->createNil)
                 obj = r->fn->createNil(cur);
@@ -407,7 +499,7 @@ static int processMultiBulkItem(redisReader *r) {
             if (r->fn && r->fn->createArray)
                 obj = r->fn->createArray(cur,elements);
             else
-                obj = (void*)REDIS_REPLY_ARRAY;
+                obj = (void*)(size_t)(cur->type);
 
             if (obj == NULL) {
                 __redisReaderSetErrorOOM(r);
@@ -461,6 +553,36 @@ static int processItem(redisReader *r) {
             case '*':
                 cur->type = REDIS_REPLY_ARRAY;
                 break;
+            case ',':
+                cur->type = REDIS_REPLY_DOUBLE;
+                break;
+            case '_':
+                cur->type = REDIS_REPLY_NIL;
+                break;
+            case '#':
+                cur->type = REDIS_REPLY_BOOL;
+                break;
+            case '(':
+                cur->type = REDIS_REPLY_BIGNUM;
+                break;
+            case '=':
+                cur->type = REDIS_REPLY_VERB;
+                break;
+            case '!':
+                cur->type = REDIS_READ_BLOB_ERROR;
+                break;
+            case '%':
+                cur->type = REDIS_REPLY_MAP;
+                break;
+            case '~':
+                cur->type = REDIS_REPLY_SET;
+                break;
+            case '|':
+                cur->type = REDIS_REPLY_ATTR;
+                break;
+            case '>':
+                cur->type = REDIS_REPLY_PUSH;
+                break;
             default:
                 __redisReaderSetErrorProtocolByte(r,*p);
                 return REDIS_ERR;
@@ -476,10 +598,20 @@ static int processItem(redisReader *r) {
     case REDIS_REPLY_ERROR:
     case REDIS_REPLY_STATUS:
     case REDIS_REPLY_INTEGER:
+    case REDIS_REPLY_DOUBLE:
+    case REDIS_REPLY_NIL:
+    case REDIS_REPLY_BOOL:
+    case REDIS_REPLY_BIGNUM:
         return processLineItem(r);
     case REDIS_REPLY_STRING:
+    case REDIS_REPLY_VERB:
+    case REDIS_READ_BLOB_ERROR:
         return processBulkItem(r);
     case REDIS_REPLY_ARRAY:
+    case REDIS_REPLY_MAP:
+    case REDIS_REPLY_SET:
+    case REDIS_REPLY_ATTR:
+    case REDIS_REPLY_PUSH:
         return processMultiBulkItem(r);
     default:
         assert(NULL);
@@ -515,38 +647,91 @@ void redisReaderFree(redisReader *r) {
     free(r);
 }
 
-int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
+/* Move the unparsed tail of the buffer to its start. This is only done when
+ * the parsed prefix is at least as large as the tail, so every byte is moved
+ * at most once on average no matter how deep the pipeline is. */
+static void compactBuffer(redisReader *r) {
+    size_t unread = r->len-r->pos;
+
+    if (r->pos == 0 || r->pos < unread)
+        return;
+    if (unread > 0)
+        memmove(r->buf,r->buf+r->pos,unread);
+    sdssetlen(r->buf,unread);
+    r->buf[unread] = '\0';
+    r->pos = 0;
+    r->len = unread;
+}
+
+char *redisReaderPrepareBuffer(redisReader *r, size_t len) {
     sds newbuf;
 
+    /* Return early when this reader is in an erroneous state. */
+    if (r->err)
+        return NULL;
+
+    /* Destroy internal buffer when it is empty and is quite large. */
+    if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf &&
+        len <= r->maxbuf) {
+        sdsfree(r->buf);
+        r->buf = sdsempty();
+        r->pos = 0;
+
+        /* r->buf should not be NULL since we just free'd a larger one. */
+        assert(r->buf != NULL);
+    }
+
+    /* Reclaim the parsed prefix only when growing would be needed. */
+    if (sdsavail(r->buf) < len)
+        compactBuffer(r);
+
+    newbuf = sdsMakeRoomFor(r->buf,len);
+    if (newbuf == NULL) {
+        __redisReaderSetErrorOOM(r);
+        return NULL;
+    }
+    r->buf = newbuf;
+    return r->buf+r->len;
+}
+
+void redisReaderCommitBuffer(redisReader *r, size_t len) {
+    sdsIncrLen(r->buf,len);
+    r->len = sdslen(r->buf);
+}
+
+int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
+    char *p;
+
     /* Return early when this reader is in an erroneous state. */
     if (r->err)
         return REDIS_ERR;
 
     /* Copy the provided buffer. */
     if (buf != NULL && len >= 1) {
-        /* Destroy internal buffer when it is empty and is quite large. */
-        if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf) {
-            sdsfree(r->buf);
-            r->buf = sdsempty();
-            r->pos = 0;
-
-            /* r->buf should not be NULL since we just free'd a larger one. */
-            assert(r->buf != NULL);
-        }
-
-        newbuf = sdscatlen(r->buf,buf,len);
-        if (newbuf == NULL) {
-            __redisReaderSetErrorOOM(r);
+        p = redisReaderPrepareBuffer(r,len);
+        if (p == NULL)
             return REDIS_ERR;
-        }
-
-        r->buf = newbuf;
-        r->len = sdslen(r->buf);
+        memcpy(p,buf,len);
+        redisReaderCommitBuffer(r,len);
     }
 
     return REDIS_OK;
 }
 
+/* Release the buffer when everything in it has been parsed and its capacity
+ * is above maxbuf, so idle readers do not hold on to large allocations. */
+void redisReaderTrim(redisReader *r) {
+    if (r->err || r->pos != r->len || r->maxbuf == 0)
+        return;
+    if (sdsalloc(r->buf) <= r->maxbuf)
+        return;
+
+    sdsfree(r->buf);
+    r->buf = sdsempty();
+    r->pos = r->len = 0;
+    assert(r->buf != NULL);
+}
+
 int redisReaderGetReply(redisReader *r, void **reply) {
     /* Default target pointer to NULL. */
     if (reply != NULL)
@@ -580,12 +765,12 @@ int redisReaderGetReply(redisReader *r, void **reply) {
     if (r->err)
         return REDIS_ERR;
 
-    /* Discard part of the buffer when we've consumed at least 1k, to avoid
-     * doing unnecessary calls to memmove() in sds.c. */
-    if (r->pos >= 1024) {
-        sdsrange(r->buf,r->pos,-1);
-        r->pos = 0;
-        r->len = sdslen(r->buf);
+    /* Rewind the cursor once the buffer has been fully consumed. Partially
+     * consumed buffers are left alone: compactBuffer() reclaims the parsed
+     * prefix lazily on the next feed, instead of a memmove per reply. */
+    if (r->pos == r->len) {
+        sdsclear(r->buf);
+        r->pos = r->len = 0;
     }
 
     /* Emit a reply when there is one. */
@@ -53,6 +53,19 @@
 #define REDIS_REPLY_NIL 4
 #define REDIS_REPLY_STATUS 5
 #define REDIS_REPLY_ERROR 6
+/* RESP3 types, only sent by servers that were asked for protocol 3 by HELLO */
+#define REDIS_REPLY_DOUBLE 7
+#define REDIS_REPLY_BOOL 8
+#define REDIS_REPLY_MAP 9
+#define REDIS_REPLY_SET 10
+#define REDIS_REPLY_ATTR 11
+#define REDIS_REPLY_PUSH 12
+#define REDIS_REPLY_BIGNUM 13
+#define REDIS_REPLY_VERB 14
+
+/* Whether replies of the type have elements. */
+#define redisIsAggregateType(_t) ((_t) == REDIS_REPLY_ARRAY || (_t) == REDIS_REPLY_MAP || \
+    (_t) == REDIS_REPLY_SET || (_t) == REDIS_REPLY_ATTR || (_t) == REDIS_REPLY_PUSH)
 
 #define REDIS_READER_MAX_BUF (1024*16)  /* Default max unused reader buffer. */
 
@@ -75,6 +88,9 @@ typedef struct redisReplyObjectFunctions {
     void *(*createInteger)(const redisReadTask*, long long);
     void *(*createNil)(const redisReadTask*);
     void (*freeObject)(void*);
+    /* RESP3 only, a reader without them returns the type as object */
+    void *(*createDouble)(const redisReadTask*, double, char*, size_t);
+    void *(*createBool)(const redisReadTask*, int);
 } redisReplyObjectFunctions;
 
 typedef struct redisReader {
@@ -85,6 +101,7 @@ typedef struct redisReader {
     size_t pos; /* Buffer cursor */
     size_t len; /* Buffer length */
     size_t maxbuf; /* Max length of unused buffer */
+    size_t pending; /* Bytes still missing for the bulk item being parsed, 0 if unknown */
 
     redisReadTask rstack[9];
     int ridx; /* Index of current read task */
@@ -99,6 +116,13 @@ redisReader *redisReaderCreateWithFunctions(redisReplyObjectFunctions *fn);
 void redisReaderFree(redisReader *r);
 int redisReaderFeed(redisReader *r, const char *buf, size_t len);
 int redisReaderGetReply(redisReader *r, void **reply);
+void redisReaderTrim(redisReader *r);
+
+/* Zero-copy feeding: redisReaderPrepareBuffer returns a pointer to at least
+ * "len" bytes of spare room at the tail of the buffer (NULL on OOM), and
+ * redisReaderCommitBuffer makes "len" bytes written there visible. */
+char *redisReaderPrepareBuffer(redisReader *r, size_t len);
+void redisReaderCommitBuffer(redisReader *r, size_t len);
 
 #define redisReaderSetPrivdata(_r, _p) (int)(((redisReader*)(_r))->privdata = (_p))
 #define redisReaderGetObject(_r) (((redisReader*)(_r))->reply)
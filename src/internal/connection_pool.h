@@ -60,6 +60,7 @@ struct IdleList {
     void PushFront(ListItem<T> *item);
     void PopFront();
     void PopBack();
+    void Remove(ListItem<T> *item);
 
     int count;
     ListItem<T> *front;
@@ -118,12 +119,33 @@ void IdleList<T>::PopBack() {
     return;
 }
 
+template <typename T>
+void IdleList<T>::Remove(ListItem<T> *item) {
+    if (item == this->front) {
+        PopFront();
+        return;
+    }
+    if (item == this->back) {
+        PopBack();
+        return;
+    }
+    --this->count;
+    item->prev->next = item->next;
+    item->next->prev = item->prev;
+    item->next = NULL;
+    item->prev = NULL;
+    return;
+}
+
 struct ConnectionPoolOption {
     ConnectionPoolOption() 
         : max_idle(NUMBER_UNLIMITED),
           max_active(NUMBER_UNLIMITED),
           idle_timeout_ms(NUMBER_UNLIMITED),
-          max_conn_life_time(NUMBER_UNLIMITED) {
+          max_conn_life_time(NUMBER_UNLIMITED),
+          max_retained_buffer(16 * 1024),
+          share_db_pool(false),
+          protocol(2) {
       }
 
     int max_idle;
@@ -131,6 +153,14 @@ struct ConnectionPoolOption {
     int max_active;
     int64_t idle_timeout_ms;
     int64_t max_conn_life_time;
+    // Maximum bytes of read/write buffer a connection keeps while idle in the pool, 0 means no limit
+    int64_t max_retained_buffer;
+    // RedisManager only: one pool per server serves every DB, a connection 
+    // sends SELECT only when it is borrowed for another DB than its current one
+    bool share_db_pool;
+    // RESP version asked by 'HELLO' on connect, 2 or 3. A server without HELLO
+    // leaves the connection on RESP2, see 'RedisConnectionImpl::protocol'
+    int protocol;
 };
 
 struct ConnectionPoolStats {
@@ -157,10 +187,13 @@ public:
     }
     ~ConnectionPool(); 
     Type* Get(std::string* err_msg = NULL);
+    // like 'Get', but an idle object for which 'prefer' returns true is taken first
+    Type* GetPreferred(const std::function<bool(const Type*)>& prefer, std::string* err_msg = NULL);
     void Put(Type* type, bool is_ok = true);
 
     int conn_in_pool() const { return idle_.count; }
     int active_cnt() const {  return active_cnt_; }
+    const ConnectionPoolOption& option() const { return option_; }
 
 private:
     Type* GetNewInstance();
@@ -189,12 +222,13 @@ ConnectionPool<Type>::~ConnectionPool() {
 
 template<typename Type>
 Type* ConnectionPool<Type>::Get(std::string* err_msg) {
+    return GetPreferred(NULL, err_msg);
+}
+
+template<typename Type>
+Type* ConnectionPool<Type>::GetPreferred(const std::function<bool(const Type*)>& prefer, std::string* err_msg) {
     //TODO 
     (void)err_msg;
-    if (option_.max_active > 0 && active_cnt_ >= option_.max_active) {
-        ++stats_.overload_error;
-        return NULL;
-    }
     std::unique_lock<std::mutex> lck(mutex_, std::defer_lock);
     if (option_.idle_timeout_ms > 0) {
         lck.lock();
@@ -209,9 +243,19 @@ Type* ConnectionPool<Type>::Get(std::string* err_msg) {
         lck.unlock();
     }
     lck.lock();
+    if (prefer) {
+        for (ListItem<Type> *item = idle_.front; item != NULL; item = item->next) {
+            if (prefer(item->GetObject()) && ((option_.max_conn_life_time <= 0) 
+                    || (__get_current_time_ms() - item->create_time < (uint64_t)option_.max_conn_life_time))) {
+                idle_.Remove(item);
+                lck.unlock();
+                return item->GetObject();
+            }
+        }
+    }
     for (ListItem<Type> *item = idle_.front; item != NULL; item = idle_.front) {
         idle_.PopFront();
-        if ((option_.max_conn_life_time <= 0) || (__get_current_time_ms() - item->create_time < option_.max_conn_life_time)) {
+        if ((option_.max_conn_life_time <= 0) || (__get_current_time_ms() - item->create_time < (uint64_t)option_.max_conn_life_time)) {
             lck.unlock();
             return item->GetObject(); 
         }
@@ -220,6 +264,11 @@ Type* ConnectionPool<Type>::Get(std::string* err_msg) {
         lck.lock();
     }
     lck.unlock();
+    // idle connections count in 'active_cnt_' too, only a new one can overload
+    if (option_.max_active > 0 && active_cnt_ >= option_.max_active) {
+        ++stats_.overload_error;
+        return NULL;
+    }
     return GetNewInstance();
 }
 
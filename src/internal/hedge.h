@@ -0,0 +1,85 @@
+//
+// Hedged read policy
+// Latencies of recent reads give the delay after which a read is sent again
+// to another replica. Every read earns 'budget' of a hedge and a hedge costs
+// one, so hedges stay within 'budget' of the reads whatever the replicas do.
+// Copyright (c) 2018 James Wei (weijianlhp@163.com). All rights reserved.
+//
+
+#ifndef CLORIS_HEDGE_H_
+#define CLORIS_HEDGE_H_
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define HEDGE_SAMPLES 1024
+#define HEDGE_RECOMPUTE_EVERY 64    // samples between two percentile updates
+#define HEDGE_MAX_TOKENS 10         // hedges that can be saved up for a burst
+
+namespace cloris {
+
+class HedgePolicy {
+public:
+    HedgePolicy(double percentile, double budget)
+        : percentile_(std::min(std::max(percentile, 0.0), 1.0)),
+          budget_(std::max(budget, 0.0)),
+          tokens_(0),
+          next_(0),
+          added_(0),
+          delay_us_(-1),
+          hedge_cnt_(0),
+          win_cnt_(0) {
+        samples_.reserve(HEDGE_SAMPLES);
+    }
+    // record the latency of a read, it also earns the budget of the read
+    void AddLatency(int64_t us) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        tokens_ = std::min(tokens_ + budget_, (double)HEDGE_MAX_TOKENS);
+        if (samples_.size() < HEDGE_SAMPLES) {
+            samples_.push_back(us);
+        } else {
+            samples_[next_] = us;
+            next_ = (next_ + 1) % HEDGE_SAMPLES;
+        }
+        if (++added_ % HEDGE_RECOMPUTE_EVERY == 0) {
+            std::vector<int64_t> sorted(samples_);
+            size_t n = std::min((size_t)(percentile_ * sorted.size()), sorted.size() - 1);
+            std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+            delay_us_ = sorted[n];
+        }
+    }
+    // delay before hedging in us, -1 until enough reads are seen
+    int64_t DelayUs() const { return delay_us_; }
+    // whether the budget allows one more hedge, which is then paid
+    bool TakeHedge() {
+        std::lock_guard<std::mutex> lk(mutex_);
+        if (tokens_ < 1.0) {
+            return false;
+        }
+        tokens_ -= 1.0;
+        ++hedge_cnt_;
+        return true;
+    }
+    void AddWin() { ++win_cnt_; }
+    // hedges sent, and how many of them answered first
+    uint64_t hedge_cnt() const { return hedge_cnt_; }
+    uint64_t win_cnt() const { return win_cnt_; }
+private:
+    const double percentile_;
+    const double budget_;
+    double tokens_;
+    std::vector<int64_t> samples_;  // ring of the last HEDGE_SAMPLES latencies
+    size_t next_;
+    uint64_t added_;
+    std::atomic<int64_t> delay_us_;
+    std::atomic<uint64_t> hedge_cnt_;
+    std::atomic<uint64_t> win_cnt_;
+    std::mutex mutex_;              // protects the samples and the tokens
+};
+
+} // namespace cloris
+
+#endif // CLORIS_HEDGE_H_
@@ -0,0 +1,68 @@
+//
+// Replica lag estimation from replication offsets
+// The master offset is sampled over time; a replica at offset 's' is as far
+// behind as the time passed since the master went beyond 's'.
+// Copyright (c) 2018 James Wei (weijianlhp@163.com). All rights reserved.
+//
+
+#ifndef CLORIS_REPLICA_LAG_H_
+#define CLORIS_REPLICA_LAG_H_
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <utility>
+
+#define REPLICA_LAG_SAMPLES 600
+
+namespace cloris {
+
+class ReplicaLagTracker {
+public:
+    // record the master offset seen at 'now_ms', offsets never go backwards
+    void AddMasterOffset(uint64_t now_ms, int64_t offset) {
+        if (!samples_.empty() && offset < samples_.back().second) {
+            // the master was replaced or restarted, old samples mean nothing
+            samples_.clear();
+        }
+        samples_.push_back(std::make_pair(now_ms, offset));
+        if (samples_.size() > REPLICA_LAG_SAMPLES) {
+            samples_.pop_front();
+        }
+    }
+    // lag of a replica at 'offset' in ms, -1 if no master offset is known yet
+    int64_t LagMs(uint64_t now_ms, int64_t offset) const {
+        if (samples_.empty()) {
+            return -1;
+        }
+        // the first sample beyond the replica is when it started to miss data
+        for (auto& sample : samples_) {
+            if (sample.second > offset) {
+                return (now_ms > sample.first) ? now_ms - sample.first : 0;
+            }
+        }
+        return 0;
+    }
+    void Reset() { samples_.clear(); }
+private:
+    std::deque<std::pair<uint64_t, int64_t> > samples_;
+};
+
+// value of 'name' in the text of 'INFO', false if it is not there
+inline bool info_field(const std::string& info, const std::string& name, std::string* value) {
+    size_t pos = 0;
+    while ((pos = info.find(name, pos)) != std::string::npos) {
+        size_t end = pos + name.size();
+        if ((pos == 0 || info[pos - 1] == '\n') && end < info.size() && info[end] == ':') {
+            size_t eol = info.find_first_of("\r\n", end + 1);
+            value->assign(info, end + 1, (eol == std::string::npos) ? std::string::npos : eol - end - 1);
+            return true;
+        }
+        pos = end;
+    }
+    return false;
+}
+
+} // namespace cloris
+
+#endif // CLORIS_REPLICA_LAG_H_
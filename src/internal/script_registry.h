@@ -0,0 +1,52 @@
+//
+// Lua script registry
+// Scripts are kept under their SHA1, computed locally, which is the name
+// EVALSHA runs them by once a server got them by 'SCRIPT LOAD'.
+// Copyright (c) 2018 James Wei (weijianlhp@163.com). All rights reserved.
+//
+
+#ifndef CLORIS_SCRIPT_REGISTRY_H_
+#define CLORIS_SCRIPT_REGISTRY_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "internal/sha1.h"
+
+namespace cloris {
+
+class ScriptRegistry {
+public:
+    // keep 'body', registering it again is harmless
+    std::string Add(const std::string& body) {
+        std::string sha = sha1_hex(body);
+        std::lock_guard<std::mutex> lk(mutex_);
+        scripts_.emplace(sha, body);
+        return sha;
+    }
+    bool Find(const std::string& sha, std::string* body) const {
+        std::lock_guard<std::mutex> lk(mutex_);
+        auto iter = scripts_.find(sha);
+        if (iter == scripts_.end()) {
+            return false;
+        }
+        *body = iter->second;
+        return true;
+    }
+    std::vector<std::string> bodies() const {
+        std::lock_guard<std::mutex> lk(mutex_);
+        std::vector<std::string> bodies;
+        for (auto& item : scripts_) {
+            bodies.push_back(item.second);
+        }
+        return bodies;
+    }
+private:
+    mutable std::mutex mutex_;
+    std::map<std::string, std::string> scripts_;
+};
+
+} // namespace cloris
+
+#endif // CLORIS_SCRIPT_REGISTRY_H_
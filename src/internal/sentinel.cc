@@ -0,0 +1,202 @@
+//
+// Redis Sentinel client implementation
+// Copyright (c) 2018 James Wei (weijianlhp@163.com). All rights reserved.
+//
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <boost/algorithm/string.hpp>
+#include "hiredis/hiredis.h"
+#include "internal/log.h"
+#include "internal/sentinel.h"
+
+namespace cloris {
+
+// field 'name' of a reply made of name/value pairs, like the ones of 'SENTINEL replicas'
+static std::string reply_field(redisReply* reply, const char* name) {
+    for (size_t i = 0; i + 1 < reply->elements; i += 2) {
+        redisReply* key = reply->element[i];
+        redisReply* value = reply->element[i + 1];
+        if (key->type == REDIS_REPLY_STRING && value->type == REDIS_REPLY_STRING && strcmp(key->str, name) == 0) {
+            return std::string(value->str, value->len);
+        }
+    }
+    return "";
+}
+
+Sentinel::Sentinel(const std::vector<ServiceAddress>& hosts, const std::string& master_name, int timeout_ms)
+    : hosts_(hosts),
+      master_name_(master_name),
+      timeout_ms_(timeout_ms),
+      current_(0),
+      sub_context_(NULL) {
+}
+
+Sentinel::~Sentinel() {
+    if (sub_context_) {
+        redisFree(sub_context_);
+        sub_context_ = NULL;
+    }
+}
+
+redisContext* Sentinel::Connect(const ServiceAddress& addr) {
+    struct timeval timeout = { timeout_ms_ / 1000, (timeout_ms_ % 1000) * 1000 };
+    redisContext* context = (addr.port == 0) ? redisConnectUnixWithTimeout(addr.host.c_str(), timeout)
+        : redisConnectWithTimeout(addr.host.c_str(), addr.port, timeout);
+    if (!context || context->err) {
+        cLog(ERROR, "connect to sentinel %s failed", addr.full_host.c_str());
+        if (context) {
+            redisFree(context);
+        }
+        return NULL;
+    }
+    redisSetTimeout(context, timeout);
+    return context;
+}
+
+bool Sentinel::Resolve(ServiceAddress* master, std::vector<ServiceAddress>* slaves, std::string* err_msg) {
+    for (size_t i = 0; i < hosts_.size(); ++i) {
+        redisContext* context = Connect(hosts_[(current_ + i) % hosts_.size()]);
+        if (!context) {
+            continue;
+        }
+        redisReply* reply = (redisReply*)redisCommand(context, "SENTINEL get-master-addr-by-name %s", master_name_.c_str());
+        if (!reply || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2) {
+            if (reply) {
+                freeReplyObject(reply);
+            }
+            redisFree(context);
+            continue;
+        }
+        master->host.assign(reply->element[0]->str, reply->element[0]->len);
+        master->port = atoi(reply->element[1]->str);
+        master->full_host = master->host + ":" + std::to_string(master->port);
+        freeReplyObject(reply);
+
+        slaves->clear();
+        reply = (redisReply*)redisCommand(context, "SENTINEL replicas %s", master_name_.c_str());
+        if (reply && reply->type == REDIS_REPLY_ERROR) {
+            // sentinel before 5.0 only knows the old name
+            freeReplyObject(reply);
+            reply = (redisReply*)redisCommand(context, "SENTINEL slaves %s", master_name_.c_str());
+        }
+        if (reply && reply->type == REDIS_REPLY_ARRAY) {
+            for (size_t j = 0; j < reply->elements && slaves->size() < MAX_SLAVE_CNT - 1; ++j) {
+                redisReply* item = reply->element[j];
+                if (item->type != REDIS_REPLY_ARRAY) {
+                    continue;
+                }
+                std::string flags = reply_field(item, "flags");
+                if (flags.find("s_down") != std::string::npos
+                        || flags.find("o_down") != std::string::npos
+                        || flags.find("disconnected") != std::string::npos) {
+                    continue;
+                }
+                ServiceAddress addr;
+                addr.host = reply_field(item, "ip");
+                addr.port = atoi(reply_field(item, "port").c_str());
+                addr.full_host = addr.host + ":" + std::to_string(addr.port);
+                if (!addr.host.empty() && addr.port > 0) {
+                    slaves->push_back(addr);
+                }
+            }
+        }
+        if (reply) {
+            freeReplyObject(reply);
+        }
+        redisFree(context);
+        return true;
+    }
+    if (err_msg) {
+        *err_msg = ERR_SENTINEL_NO_MASTER;
+    }
+    return false;
+}
+
+bool Sentinel::Subscribe() {
+    for (size_t i = 0; i < hosts_.size(); ++i) {
+        const ServiceAddress& addr = hosts_[current_];
+        current_ = (current_ + 1) % hosts_.size();
+        redisContext* context = Connect(addr);
+        if (!context) {
+            continue;
+        }
+        int done = 0;
+        redisAppendCommand(context, "SUBSCRIBE +switch-master +sdown");
+        while (!done && redisBufferWrite(context, &done) == REDIS_OK) {
+        }
+        if (!done) {
+            redisFree(context);
+            continue;
+        }
+        cLog(INFO, "subscribed to sentinel %s", addr.full_host.c_str());
+        sub_context_ = context;
+        return true;
+    }
+    return false;
+}
+
+bool Sentinel::IsAboutMaster(const std::string& event) const {
+    // '+switch-master': <name> <old-ip> <old-port> <new-ip> <new-port>
+    // '+sdown': <type> <name> <ip> <port> [@ <master-name> <master-ip> <master-port>]
+    std::vector<std::string> fields;
+    boost::split(fields, event, boost::is_any_of(" "));
+    for (auto& field : fields) {
+        if (field == master_name_) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Sentinel::WaitEvent(int wait_ms) {
+    if (!sub_context_) {
+        if (!Subscribe()) {
+            usleep(wait_ms * 1000);
+            return false;
+        }
+        return true;
+    }
+    for (;;) {
+        void* aux = NULL;
+        if (redisReaderGetReply(sub_context_->reader, &aux) != REDIS_OK) {
+            break;
+        }
+        if (!aux) {
+            struct pollfd pfd;
+            pfd.fd = sub_context_->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            int ret = poll(&pfd, 1, wait_ms);
+            if (ret == 0 || (ret < 0 && errno == EINTR)) {
+                return false;
+            }
+            if (ret < 0 || redisBufferRead(sub_context_) != REDIS_OK) {
+                break;
+            }
+            continue;
+        }
+        // ["message", <channel>, <event>], the replies to SUBSCRIBE are skipped
+        redisReply* reply = (redisReply*)aux;
+        bool about_master = reply->type == REDIS_REPLY_ARRAY
+                && reply->elements == 3
+                && reply->element[0]->type == REDIS_REPLY_STRING
+                && strcmp(reply->element[0]->str, "message") == 0
+                && reply->element[2]->type == REDIS_REPLY_STRING
+                && IsAboutMaster(std::string(reply->element[2]->str, reply->element[2]->len));
+        cLogIf(about_master, INFO, "sentinel event %s: %s", reply->element[1]->str, reply->element[2]->str);
+        freeReplyObject(reply);
+        if (about_master) {
+            return true;
+        }
+    }
+    // the sentinel is gone, subscribe to the next one
+    cLog(ERROR, "sentinel subscription broken");
+    redisFree(sub_context_);
+    sub_context_ = NULL;
+    return false;
+}
+
+} // namespace cloris
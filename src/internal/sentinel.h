@@ -0,0 +1,49 @@
+//
+// Redis Sentinel client used by RedisManager: resolves the addresses of a
+// monitored master and its replicas, and watches failover events
+// Copyright (c) 2018 James Wei (weijianlhp@163.com). All rights reserved.
+//
+
+#ifndef CLORIS_SENTINEL_H_
+#define CLORIS_SENTINEL_H_
+
+#include <string>
+#include <vector>
+#include "cloredis.h"
+
+#define SENTINEL_POLL_MS 200
+#define SENTINEL_RESOLVE_INTERVAL_MS 10000
+
+#define ERR_SENTINEL_NO_MASTER "no sentinel knows the master"
+
+struct redisContext;
+
+namespace cloris {
+
+class Sentinel {
+public:
+    Sentinel(const std::vector<ServiceAddress>& hosts, const std::string& master_name, int timeout_ms);
+    ~Sentinel();
+    // ask the sentinels in turn until one of them knows the master, replicas
+    // that are down or disconnected are left out
+    bool Resolve(ServiceAddress* master, std::vector<ServiceAddress>* slaves, std::string* err_msg = NULL);
+    // wait up to 'wait_ms' for a '+switch-master' or '+sdown' event about our master.
+    // Returns true on such an event, and also after (re)subscribing since events
+    // may have been missed meanwhile, so the caller should resolve again.
+    bool WaitEvent(int wait_ms);
+    const std::string& master_name() const { return master_name_; }
+private:
+    redisContext* Connect(const ServiceAddress& addr);
+    bool Subscribe();
+    bool IsAboutMaster(const std::string& event) const;
+
+    std::vector<ServiceAddress> hosts_;
+    std::string master_name_;
+    int timeout_ms_;
+    size_t current_;            // sentinel to subscribe to next
+    redisContext* sub_context_;
+};
+
+} // namespace cloris
+
+#endif // CLORIS_SENTINEL_H_
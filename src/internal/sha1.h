@@ -0,0 +1,22 @@
+//
+// SHA1 digest, for naming Lua scripts the way 'SCRIPT LOAD' does
+// Copyright (c) 2018 James Wei (weijianlhp@163.com). All rights reserved.
+//
+
+#ifndef CLORIS_SHA1_H_
+#define CLORIS_SHA1_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+namespace cloris {
+
+// 20 bytes digest of 'data'
+void sha1(const void* data, size_t len, uint8_t digest[20]);
+// digest in 40 lowercase hex digits, as redis prints it
+std::string sha1_hex(const std::string& data);
+
+} // namespace cloris
+
+#endif // CLORIS_SHA1_H_
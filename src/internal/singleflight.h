@@ -0,0 +1,110 @@
+//
+// Request coalescing
+// Concurrent calls with the same key share one in-flight call: the first one
+// runs it, the others wait on the flight of that key and get a share of its
+// reply. Keys are spread over shards so that flights of different keys never
+// wait on one lock.
+// Copyright (c) 2018 James Wei (weijianlhp@163.com). All rights reserved.
+//
+
+#ifndef CLORIS_SINGLEFLIGHT_H_
+#define CLORIS_SINGLEFLIGHT_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "reply.h"
+
+#define SINGLE_FLIGHT_SHARDS 64
+
+namespace cloris {
+
+class SingleFlight {
+public:
+    typedef std::function<RedisReply()> Call;
+
+    SingleFlight() : shared_cnt_(0) { }
+    // Flights are numbered in the order they start, by one counter for the
+    // whole process. A caller that took 'sequence()' once the reply of its last
+    // write came back never joins a flight started before that write was done
+    static uint64_t sequence() { return flight_seq().load(); }
+
+    // run 'call' for 'key', or wait for the flight of 'key' already running if
+    // it started after sequence 'not_before_seq', so a caller never gets a
+    // reply read before its own last write
+    RedisReply Do(const std::string& key, uint64_t not_before_seq, const Call& call) {
+        Shard& shard = shards_[std::hash<std::string>()(key) % SINGLE_FLIGHT_SHARDS];
+        std::shared_ptr<Flight> flight;
+        bool leader = false;
+        {
+            std::lock_guard<std::mutex> lk(shard.mutex);
+            auto iter = shard.flights.find(key);
+            if (iter == shard.flights.end()) {
+                flight = std::make_shared<Flight>(++flight_seq());
+                shard.flights[key] = flight;
+                leader = true;
+            } else if (iter->second->start_seq > not_before_seq) {
+                flight = iter->second;
+            }
+        }
+        if (leader) {
+            return Run(shard, key, flight, call);
+        } else if (!flight) {
+            // a flight too old for this caller, which runs on its own
+            return call();
+        }
+        ++shared_cnt_;
+        std::unique_lock<std::mutex> lk(flight->mutex);
+        flight->cond.wait(lk, [&flight]() { return flight->done; });
+        return flight->reply.Share();
+    }
+    // calls served by the flight of another caller
+    uint64_t shared_cnt() const { return shared_cnt_; }
+private:
+    struct Flight {
+        explicit Flight(uint64_t seq) : start_seq(seq), done(false) { }
+
+        const uint64_t start_seq;
+        std::mutex mutex;
+        std::condition_variable cond;   // waiters of the key
+        bool done;
+        RedisReply reply;
+    };
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+    };
+
+    static std::atomic<uint64_t>& flight_seq() {
+        static std::atomic<uint64_t> seq(0);
+        return seq;
+    }
+
+    RedisReply Run(Shard& shard, const std::string& key, const std::shared_ptr<Flight>& flight, const Call& call) {
+        RedisReply reply = call();
+        {
+            // callers coming from now on start a new flight
+            std::lock_guard<std::mutex> lk(shard.mutex);
+            shard.flights.erase(key);
+        }
+        {
+            std::lock_guard<std::mutex> lk(flight->mutex);
+            flight->reply = reply.Share();
+            flight->done = true;
+        }
+        flight->cond.notify_all();
+        return reply;
+    }
+
+    Shard shards_[SINGLE_FLIGHT_SHARDS];
+    std::atomic<uint64_t> shared_cnt_;
+};
+
+} // namespace cloris
+
+#endif // CLORIS_SINGLEFLIGHT_H_
@@ -0,0 +1,193 @@
+//
+// cloRedis key mutator class implementation
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "internal/log.h"
+#include "mutator.h"
+
+namespace cloris {
+
+RedisKeyMutator::RedisKeyMutator(RedisManager* manager, int db, const MutateOption* option)
+    : manager_(manager),
+      db_(db),
+      start_ms_(0),
+      next_ms_(0),
+      last_progress_ms_(0),
+      scanned_(0),
+      changed_(0),
+      unchanged_(0),
+      failed_(0) {
+    if (option) {
+        option_ = *option;
+    }
+    option_.batch_size = std::max(option_.batch_size, 1);
+    cLog(TRACE, "RedisKeyMutator constructor ");
+}
+
+RedisKeyMutator::~RedisKeyMutator() {
+    cLog(TRACE, "RedisKeyMutator ~ destructor");
+}
+
+bool RedisKeyMutator::Unlink(MutateStats* stats, std::string* err_msg) {
+    return this->Run(ACTION_UNLINK, 0, stats, err_msg);
+}
+
+bool RedisKeyMutator::Expire(int64_t ttl_ms, MutateStats* stats, std::string* err_msg) {
+    if (ttl_ms <= 0) {
+        if (err_msg) {
+            *err_msg = ERR_MUTATE_BAD_TTL;
+        }
+        return false;
+    }
+    return this->Run(ACTION_EXPIRE, ttl_ms, stats, err_msg);
+}
+
+bool RedisKeyMutator::Persist(MutateStats* stats, std::string* err_msg) {
+    return this->Run(ACTION_PERSIST, 0, stats, err_msg);
+}
+
+bool RedisKeyMutator::Run(Action action, int64_t ttl_ms, MutateStats* stats, std::string* err_msg) {
+    // an empty pattern would touch the whole DB
+    if (option_.scan.match.empty()) {
+        if (err_msg) {
+            *err_msg = ERR_MUTATE_NO_PATTERN;
+        }
+        return false;
+    }
+    start_ms_ = __get_current_time_ms();
+    last_progress_ms_ = start_ms_;
+    next_ms_ = start_ms_;
+    scanned_ = 0;
+    changed_ = 0;
+    unchanged_ = 0;
+    failed_ = 0;
+    std::string ttl = std::to_string(ttl_ms);
+    bool ok = ParallelScan(manager_, db_, option_.concurrency, &option_.scan,
+            [this, action, &ttl](const std::vector<ScanEntry>& page) {
+        scanned_ += page.size();
+        for (size_t i = 0; i < page.size(); i += option_.batch_size) {
+            size_t end = std::min(page.size(), i + option_.batch_size);
+            this->Throttle(end - i);
+            this->Mutate(action, ttl, page, i, end);
+        }
+        this->Progress();
+    }, err_msg);
+    if (stats) {
+        *stats = this->Snapshot();
+    }
+    cLog(INFO, "%s of '%s' done, %llu keys scanned, %llu changed, %llu failed",
+            action == ACTION_UNLINK ? "UNLINK" : (action == ACTION_EXPIRE ? "PEXPIRE" : "PERSIST"),
+            option_.scan.match.c_str(),
+            (unsigned long long)scanned_, (unsigned long long)changed_, (unsigned long long)failed_);
+    return ok && failed_ == 0;
+}
+
+void RedisKeyMutator::Mutate(Action action, const std::string& ttl,
+        const std::vector<ScanEntry>& page, size_t begin, size_t end) {
+    uint64_t count = end - begin;
+    RedisConnection conn = manager_->Get(db_);
+    if (!conn) {
+        failed_ += count;
+        return;
+    }
+    if (action == ACTION_UNLINK) {
+        std::vector<const char*> argv(1, "UNLINK");
+        std::vector<size_t> argvlen(1, strlen("UNLINK"));
+        for (size_t i = begin; i < end; ++i) {
+            argv.push_back(page[i].key.data());
+            argvlen.push_back(page[i].key.size());
+        }
+        RedisReply reply = conn->DoArgv(argv.size(), argv.data(), argvlen.data());
+        if (!reply.is_int()) {
+            failed_ += count;
+            cLog(ERROR, "UNLINK of %llu keys failed: %s", (unsigned long long)count, reply.err_str().c_str());
+            return;
+        }
+        uint64_t unlinked = std::min((uint64_t)reply.toInt64(), count);
+        changed_ += unlinked;
+        unchanged_ += count - unlinked;
+        return;
+    }
+    const char* argv[3];
+    size_t argvlen[3];
+    int argc = action == ACTION_EXPIRE ? 3 : 2;
+    argv[0] = action == ACTION_EXPIRE ? "PEXPIRE" : "PERSIST";
+    argvlen[0] = strlen(argv[0]);
+    argv[2] = ttl.data();
+    argvlen[2] = ttl.size();
+    for (size_t i = begin; i < end; ++i) {
+        argv[1] = page[i].key.data();
+        argvlen[1] = page[i].key.size();
+        if (!conn->AppendArgv(argc, argv, argvlen)) {
+            failed_ += count;
+            return;
+        }
+    }
+    // a broken connection gives up the replies left, their keys count as failed
+    uint64_t answered = 0;
+    while (conn->pending_replies() > 0) {
+        RedisReply reply = conn->GetReply();
+        if (!reply.is_int()) {
+            cLog(ERROR, "%s failed: %s", argv[0], reply.err_str().c_str());
+            continue;
+        }
+        ++answered;
+        if (reply.toInt64() == 1) {
+            ++changed_;
+        } else {
+            ++unchanged_;
+        }
+    }
+    failed_ += count - answered;
+}
+
+void RedisKeyMutator::Throttle(size_t keys) {
+    if (option_.max_keys_per_sec <= 0) {
+        return;
+    }
+    double wait_ms = 0;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        double now_ms = __get_current_time_ms();
+        // no credit for the time nothing was sent
+        next_ms_ = std::max(next_ms_, now_ms);
+        wait_ms = next_ms_ - now_ms;
+        next_ms_ += keys * 1000.0 / option_.max_keys_per_sec;
+    }
+    if (wait_ms > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(wait_ms * 1000)));
+    }
+}
+
+void RedisKeyMutator::Progress() {
+    if (!option_.progress) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        uint64_t now_ms = __get_current_time_ms();
+        if (now_ms - last_progress_ms_ < (uint64_t)option_.progress_interval_ms) {
+            return;
+        }
+        last_progress_ms_ = now_ms;
+    }
+    option_.progress(this->Snapshot());
+}
+
+MutateStats RedisKeyMutator::Snapshot() const {
+    MutateStats stats;
+    stats.scanned = scanned_;
+    stats.changed = changed_;
+    stats.unchanged = unchanged_;
+    stats.failed = failed_;
+    stats.elapsed_ms = __get_current_time_ms() - start_ms_;
+    return stats;
+}
+
+} // namespace cloris
@@ -0,0 +1,105 @@
+//
+// cloRedis key mutator class definition
+// RedisKeyMutator unlinks, expires or persists every key matching a pattern.
+// Keys come from ParallelScan over 'concurrency' connections, and each
+// scanning thread sends them to master in pipelined batches of 'batch_size',
+// all threads together at most 'max_keys_per_sec' keys a second
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#ifndef CLORIS_CLOREDIS_MUTATOR_H_
+#define CLORIS_CLOREDIS_MUTATOR_H_
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "cloredis.h"
+#include "scan.h"
+
+#define DEFAULT_MUTATE_BATCH_SIZE 500
+#define DEFAULT_MUTATE_CONCURRENCY 4
+#define DEFAULT_MUTATE_PROGRESS_INTERVAL_MS 1000
+
+#define ERR_MUTATE_NO_PATTERN "a MATCH pattern is required"
+#define ERR_MUTATE_BAD_TTL    "TTL must be positive"
+
+namespace cloris {
+
+struct MutateStats {
+    MutateStats() : scanned(0), changed(0), unchanged(0), failed(0), elapsed_ms(0) { }
+    // keys sent to redis per second
+    double keys_per_sec() const { return elapsed_ms ? (changed + unchanged + failed) * 1000.0 / elapsed_ms : 0.0; }
+
+    uint64_t scanned;       // keys given by SCAN, a key may come more than once
+    uint64_t changed;       // unlinked, or had their TTL set or removed
+    uint64_t unchanged;     // gone already, or without TTL to remove
+    uint64_t failed;        // in batches answered by an error or lost with their connection
+    int64_t elapsed_ms;
+};
+
+struct MutateOption {
+    MutateOption()
+        : batch_size(DEFAULT_MUTATE_BATCH_SIZE),
+          concurrency(DEFAULT_MUTATE_CONCURRENCY),
+          max_keys_per_sec(0),
+          progress_interval_ms(DEFAULT_MUTATE_PROGRESS_INTERVAL_MS) {
+    }
+
+    // MATCH pattern, which can't be empty, COUNT and TYPE of the scan
+    ScanOption scan;
+    // keys per pipelined batch
+    int batch_size;
+    // scan segments, each one with a connection to scan and one to mutate
+    int concurrency;
+    // keys mutated per second by all threads together, 0 for no limit
+    int64_t max_keys_per_sec;
+    // 'progress' is called from a scanning thread at this interval
+    int progress_interval_ms;
+    std::function<void(const MutateStats&)> progress;
+};
+
+class RedisKeyMutator {
+public:
+    RedisKeyMutator(RedisManager* manager, int db, const MutateOption* option = NULL);
+    ~RedisKeyMutator();
+
+    // one UNLINK per batch
+    bool Unlink(MutateStats* stats = NULL, std::string* err_msg = NULL);
+    // one PEXPIRE per key, pipelined by batch. 'ttl_ms' must be positive, as
+    // PEXPIRE deletes the key at once otherwise
+    bool Expire(int64_t ttl_ms, MutateStats* stats = NULL, std::string* err_msg = NULL);
+    // one PERSIST per key, pipelined by batch
+    bool Persist(MutateStats* stats = NULL, std::string* err_msg = NULL);
+private:
+    enum Action {
+        ACTION_UNLINK,
+        ACTION_EXPIRE,
+        ACTION_PERSIST,
+    };
+
+    bool Run(Action action, int64_t ttl_ms, MutateStats* stats, std::string* err_msg);
+    void Mutate(Action action, const std::string& ttl, const std::vector<ScanEntry>& page, size_t begin, size_t end);
+    // blocks until 'keys' more keys fit in the rate limit
+    void Throttle(size_t keys);
+    void Progress();
+    MutateStats Snapshot() const;
+
+    RedisManager* manager_;
+    int db_;
+    MutateOption option_;
+    uint64_t start_ms_;
+    std::mutex mutex_;              // protects 'next_ms_' and 'last_progress_ms_'
+    double next_ms_;                // when the rate limit lets the next key go
+    uint64_t last_progress_ms_;
+    std::atomic<uint64_t> scanned_;
+    std::atomic<uint64_t> changed_;
+    std::atomic<uint64_t> unchanged_;
+    std::atomic<uint64_t> failed_;
+};
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_MUTATOR_H_
@@ -0,0 +1,439 @@
+//
+// cloRedis near cache class implementation
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <functional>
+#include "hiredis/hiredis.h"
+#include "internal/log.h"
+#include "nearcache.h"
+
+#define NEAR_CACHE_CHANNEL "__redis__:invalidate"
+// how often the listener looks at 'stopping_' while no invalidation comes
+#define NEAR_CACHE_POLL_MS 100
+
+namespace cloris {
+
+struct RedisNearCache::Entry {
+    std::string key;        // see 'cache_key'
+    RedisReply value;
+    int64_t bytes;
+    uint64_t expire_ms;     // 0 if it never expires
+};
+
+struct RedisNearCache::Shard {
+    Shard() : bytes(0), epoch(0) { }
+
+    std::mutex mutex;
+    std::list<Entry> lru;   // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    int64_t bytes;
+    // bumped by every invalidation, a read started before is not cached
+    uint64_t epoch;
+};
+
+// connections whose invalidations go to one subscriber, replaced as a whole
+// when the subscriber reconnects since its client id changes
+struct RedisNearCache::Tracking {
+    RedisConnectionPool* pool;
+
+    ~Tracking() { delete pool; }
+};
+
+// entries of a key in all DBs share a shard, the DB is the first byte
+static std::string cache_key(int db, const std::string& key) {
+    std::string ckey(1, (char)db);
+    ckey.append(key);
+    return ckey;
+}
+
+RedisNearCache::RedisNearCache()
+    : timeout_ms_(DEFAULT_TIMEOUT_MS),
+      inited_(false),
+      pool_(NULL),
+      stopping_(false),
+      hits_(0),
+      misses_(0),
+      invalidations_(0),
+      evictions_(0),
+      expirations_(0) {
+    for (int i = 0; i < NEAR_CACHE_SHARDS; ++i) {
+        shards_.push_back(new Shard);
+    }
+    cLog(TRACE, "RedisNearCache constructor ");
+}
+
+RedisNearCache::~RedisNearCache() {
+    this->Flush();
+    for (auto shard : shards_) {
+        delete shard;
+    }
+    cLog(TRACE, "RedisNearCache ~ destructor");
+}
+
+void RedisNearCache::Flush() {
+    stopping_ = true;
+    if (listen_thread_.joinable()) {
+        listen_thread_.join();
+    }
+    stopping_ = false;
+    std::atomic_store(&tracking_, TrackingPtr());
+    retired_.clear();
+    Clear();
+    delete pool_;
+    pool_ = NULL;
+    inited_ = false;
+}
+
+bool RedisNearCache::Init(const std::string& host,
+             const std::string& password,
+             int timeout_ms,
+             NearCacheOption* option,
+             std::string* err_msg) {
+    if (inited_) {
+        cLog(ERROR, ERR_REENTERING);
+        if (err_msg) {
+            *err_msg = ERR_REENTERING;
+        }
+        return false;
+    }
+    std::vector<ServiceAddress> address_vec = parse_address_vector(host);
+    if (address_vec.size() != 1) {
+        cLog(ERROR, ERR_BAD_HOST);
+        if (err_msg) {
+            *err_msg = ERR_BAD_HOST;
+        }
+        return false;
+    }
+    inited_ = true;
+    if (option) {
+        option_ = *option;
+    }
+    addr_ = address_vec[0];
+    password_ = password;
+    timeout_ms_ = timeout_ms;
+
+    RedisConnectionPool::InitHandler handler = std::bind(&RedisConnectionImpl::Init, std::placeholders::_1,
+            addr_.host,
+            addr_.port,
+            password_,
+            timeout_ms_,
+            DEFAULT_DB);
+    pool_ = new RedisConnectionPool(&option_.pool, handler);
+    RedisConnection conn = pool_->Get(err_msg);
+    if (!conn) {
+        return false;
+    }
+    listen_thread_ = std::thread(&RedisNearCache::Listen, this);
+    return true;
+}
+
+RedisNearCache::Shard* RedisNearCache::ShardOf(const std::string& key) const {
+    return shards_[std::hash<std::string>()(key) % NEAR_CACHE_SHARDS];
+}
+
+RedisConnectionImpl* RedisNearCache::Borrow(RedisConnectionPool* pool, int db) {
+    // one pool serves every DB, an idle connection already on 'db' saves a SELECT
+    RedisConnection conn = pool->GetPreferred([db](const RedisConnectionImpl* c) { return c->db() == db; });
+    if (!conn || !conn->Select(db)) {
+        return NULL;
+    }
+    RedisConnectionImpl* impl = conn.mutable_impl();
+    conn.set_impl(NULL);
+    return impl;
+}
+
+RedisReply RedisNearCache::Get(int db, const std::string& key) {
+    if (db < 0 || db >= MAX_DB_NUM) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    TrackingPtr tracking = std::atomic_load(&tracking_);
+    if (!tracking) {
+        if (!pool_) {
+            return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_NOT_INITED);
+        }
+        ++misses_;
+        RedisConnection conn = Borrow(pool_, db);
+        if (!conn) {
+            return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+        }
+        return conn->Do("GET %b", key.data(), key.size());
+    }
+
+    Shard* shard = ShardOf(key);
+    std::string ckey = cache_key(db, key);
+    uint64_t epoch = 0;
+    {
+        std::lock_guard<std::mutex> lk(shard->mutex);
+        auto iter = shard->index.find(ckey);
+        if (iter != shard->index.end()) {
+            Entry& entry = *iter->second;
+            if (entry.expire_ms == 0 || entry.expire_ms > __get_current_time_ms()) {
+                shard->lru.splice(shard->lru.begin(), shard->lru, iter->second);
+                ++hits_;
+                return entry.value.Share();
+            }
+            shard->bytes -= entry.bytes;
+            shard->lru.erase(iter->second);
+            shard->index.erase(iter);
+            ++expirations_;
+        }
+        epoch = shard->epoch;
+    }
+    ++misses_;
+    RedisConnection conn = Borrow(tracking->pool, db);
+    if (!conn) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    RedisReply reply = conn->Do("GET %b", key.data(), key.size());
+    if (reply.is_nil() || reply.is_string()) {
+        Insert(shard, epoch, ckey, reply);
+    }
+    return reply;
+}
+
+void RedisNearCache::Insert(Shard* shard, uint64_t epoch, const std::string& cache_key, const RedisReply& value) {
+    int64_t bytes = value.is_string() ? value.toString().size() : 0;
+    if (bytes > option_.max_value_bytes) {
+        return;
+    }
+    bytes += cache_key.size() + NEAR_CACHE_ENTRY_OVERHEAD;
+    int64_t max_bytes = option_.max_bytes / NEAR_CACHE_SHARDS;
+    std::lock_guard<std::mutex> lk(shard->mutex);
+    if (shard->epoch != epoch) {
+        // invalidated while it was read, the value may be stale already
+        return;
+    }
+    auto iter = shard->index.find(cache_key);
+    if (iter != shard->index.end()) {
+        shard->bytes -= iter->second->bytes;
+        shard->lru.erase(iter->second);
+        shard->index.erase(iter);
+    }
+    Entry entry;
+    entry.key = cache_key;
+    entry.value = value.Share();
+    entry.bytes = bytes;
+    entry.expire_ms = (option_.max_ttl_ms > 0) ? __get_current_time_ms() + option_.max_ttl_ms : 0;
+    shard->lru.push_front(std::move(entry));
+    shard->index[cache_key] = shard->lru.begin();
+    shard->bytes += bytes;
+    while (shard->bytes > max_bytes && !shard->lru.empty()) {
+        Entry& last = shard->lru.back();
+        shard->bytes -= last.bytes;
+        shard->index.erase(last.key);
+        shard->lru.pop_back();
+        ++evictions_;
+    }
+}
+
+void RedisNearCache::Invalidate(const std::string& key) {
+    Shard* shard = ShardOf(key);
+    std::lock_guard<std::mutex> lk(shard->mutex);
+    ++shard->epoch;
+    for (int db = 0; db < MAX_DB_NUM; ++db) {
+        auto iter = shard->index.find(cache_key(db, key));
+        if (iter != shard->index.end()) {
+            shard->bytes -= iter->second->bytes;
+            shard->lru.erase(iter->second);
+            shard->index.erase(iter);
+        }
+    }
+}
+
+void RedisNearCache::Clear() {
+    for (auto shard : shards_) {
+        std::lock_guard<std::mutex> lk(shard->mutex);
+        ++shard->epoch;
+        shard->index.clear();
+        shard->lru.clear();
+        shard->bytes = 0;
+    }
+}
+
+bool RedisNearCache::tracking() const {
+    return std::atomic_load(&tracking_) ? true : false;
+}
+
+NearCacheStats RedisNearCache::stats() const {
+    NearCacheStats stats;
+    stats.hits = hits_;
+    stats.misses = misses_;
+    stats.invalidations = invalidations_;
+    stats.evictions = evictions_;
+    stats.expirations = expirations_;
+    stats.entries = 0;
+    stats.bytes = 0;
+    for (auto shard : shards_) {
+        std::lock_guard<std::mutex> lk(shard->mutex);
+        stats.entries += shard->index.size();
+        stats.bytes += shard->bytes;
+    }
+    return stats;
+}
+
+redisContext* RedisNearCache::Subscribe(int64_t* client_id) {
+    struct timeval timeout = { timeout_ms_ / 1000, (timeout_ms_ % 1000) * 1000 };
+    redisContext* context = (addr_.port == 0) ? redisConnectUnixWithTimeout(addr_.host.c_str(), timeout)
+        : redisConnectWithTimeout(addr_.host.c_str(), addr_.port, timeout);
+    if (!context || context->err) {
+        cLog(ERROR, "connect to %s for invalidations failed", addr_.full_host.c_str());
+        if (context) {
+            redisFree(context);
+        }
+        return NULL;
+    }
+    redisSetTimeout(context, timeout);
+    redisReply* reply = NULL;
+    if (!password_.empty()) {
+        reply = (redisReply*)redisCommand(context, "AUTH %s", password_.c_str());
+        bool ok = reply && reply->type != REDIS_REPLY_ERROR;
+        if (reply) {
+            freeReplyObject(reply);
+        }
+        if (!ok) {
+            redisFree(context);
+            return NULL;
+        }
+    }
+    reply = (redisReply*)redisCommand(context, "CLIENT ID");
+    bool ok = reply && reply->type == REDIS_REPLY_INTEGER;
+    *client_id = ok ? reply->integer : -1;
+    if (reply) {
+        freeReplyObject(reply);
+    }
+    // a RESP3 client gets invalidations as push messages without subscribing
+    bool resp3 = false;
+    if (ok && option_.pool.protocol == 3) {
+        reply = (redisReply*)redisCommand(context, "HELLO 3");
+        ok = reply != NULL;
+        resp3 = ok && reply->type != REDIS_REPLY_ERROR;
+        if (reply) {
+            freeReplyObject(reply);
+        }
+    }
+    // the subscription is confirmed before any connection redirects to it
+    if (ok && !resp3) {
+        reply = (redisReply*)redisCommand(context, "SUBSCRIBE " NEAR_CACHE_CHANNEL);
+        ok = reply && (reply->type == REDIS_REPLY_ARRAY || reply->type == REDIS_REPLY_PUSH);
+        if (reply) {
+            freeReplyObject(reply);
+        }
+    }
+    if (!ok) {
+        cLog(ERROR, "subscribe to invalidations of %s failed", addr_.full_host.c_str());
+        redisFree(context);
+        return NULL;
+    }
+    return context;
+}
+
+void RedisNearCache::OnInvalidate(void* aux) {
+    // ["message", "__redis__:invalidate", [key ...]] on RESP2, a push of
+    // ["invalidate", [key ...]] on RESP3; nil keys when the server flushed
+    redisReply* reply = (redisReply*)aux;
+    if ((reply->type != REDIS_REPLY_ARRAY && reply->type != REDIS_REPLY_PUSH)
+            || reply->elements < 2 || reply->element[0]->type != REDIS_REPLY_STRING) {
+        return;
+    }
+    redisReply* keys = NULL;
+    if (reply->elements == 3 && strcmp(reply->element[0]->str, "message") == 0) {
+        keys = reply->element[2];
+    } else if (reply->elements == 2 && strcmp(reply->element[0]->str, "invalidate") == 0) {
+        keys = reply->element[1];
+    } else {
+        return;
+    }
+    if (keys->type == REDIS_REPLY_ARRAY) {
+        for (size_t i = 0; i < keys->elements; ++i) {
+            if (keys->element[i]->type == REDIS_REPLY_STRING) {
+                Invalidate(std::string(keys->element[i]->str, keys->element[i]->len));
+                ++invalidations_;
+            }
+        }
+    } else if (keys->type == REDIS_REPLY_STRING) {
+        Invalidate(std::string(keys->str, keys->len));
+        ++invalidations_;
+    } else {
+        Clear();
+    }
+}
+
+// called by the listener thread only, like everything touching 'retired_'
+void RedisNearCache::FreeDrainedTracking() {
+    for (auto iter = retired_.begin(); iter != retired_.end(); ) {
+        RedisConnectionPool* pool = (*iter)->pool;
+        if (iter->use_count() == 1 && pool->active_cnt() == pool->conn_in_pool()) {
+            iter = retired_.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+void RedisNearCache::Listen() {
+    while (!stopping_) {
+        int64_t client_id = -1;
+        redisContext* context = Subscribe(&client_id);
+        if (!context) {
+            for (int waited = 0; waited < NEAR_CACHE_RETRY_MS && !stopping_; waited += NEAR_CACHE_POLL_MS) {
+                usleep(NEAR_CACHE_POLL_MS * 1000);
+            }
+            continue;
+        }
+        // connections of this pool send their invalidations to 'client_id'
+        ServiceAddress addr = addr_;
+        std::string password = password_;
+        int timeout_ms = timeout_ms_;
+        TrackingPtr tracking = std::make_shared<Tracking>();
+        tracking->pool = new RedisConnectionPool(&option_.pool, [addr, password, timeout_ms, client_id](void* p) {
+            if (!RedisConnectionImpl::Init(p, addr.host, addr.port, password, timeout_ms, DEFAULT_DB)) {
+                return false;
+            }
+            RedisConnectionImpl* conn = static_cast<RedisConnectionImpl*>(p);
+            return conn->Do("CLIENT TRACKING on REDIRECT %lld", (long long)client_id).ok();
+        });
+        // whatever was cached before may have missed invalidations
+        Clear();
+        std::atomic_store(&tracking_, tracking);
+        cLog(INFO, "near cache of %s tracking by client %lld", addr_.full_host.c_str(), (long long)client_id);
+
+        while (!stopping_) {
+            void* aux = NULL;
+            if (redisReaderGetReply(context->reader, &aux) != REDIS_OK) {
+                break;
+            }
+            if (aux) {
+                OnInvalidate(aux);
+                freeReplyObject(aux);
+                continue;
+            }
+            FreeDrainedTracking();
+            struct pollfd pfd;
+            pfd.fd = context->fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            int ret = poll(&pfd, 1, NEAR_CACHE_POLL_MS);
+            if (ret == 0 || (ret < 0 && errno == EINTR)) {
+                continue;
+            }
+            if (ret < 0 || redisBufferRead(context) != REDIS_OK) {
+                break;
+            }
+        }
+        // stop caching before the entries are dropped, no invalidation comes any more
+        std::atomic_store(&tracking_, TrackingPtr());
+        retired_.push_back(tracking);
+        tracking.reset();
+        Clear();
+        redisFree(context);
+        cLogIf(!stopping_, ERROR, "invalidations of %s broken", addr_.full_host.c_str());
+    }
+}
+
+} // namespace cloris
@@ -0,0 +1,118 @@
+//
+// cloRedis near cache class definition
+// RedisNearCache keeps GET replies in process, spread over NEAR_CACHE_SHARDS
+// LRU lists keyed by (db, key). The server tells which keys to drop by
+// 'CLIENT TRACKING': every connection of the cache redirects its invalidations
+// to one subscriber connection listening on '__redis__:invalidate', or getting
+// them as RESP3 push messages when 'pool.protocol' is 3. While that subscriber
+// is down nothing is cached, and entries cached before are dropped.
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#ifndef CLORIS_CLOREDIS_NEARCACHE_H_
+#define CLORIS_CLOREDIS_NEARCACHE_H_
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "cloredis.h"
+
+#define NEAR_CACHE_SHARDS 16
+#define NEAR_CACHE_ENTRY_OVERHEAD 96            // bytes of bookkeeping counted per entry
+#define NEAR_CACHE_RETRY_MS 1000                // between two subscription attempts
+#define DEFAULT_NEAR_CACHE_MAX_BYTES (64 << 20)
+#define DEFAULT_NEAR_CACHE_MAX_TTL_MS 60000
+#define DEFAULT_NEAR_CACHE_MAX_VALUE_BYTES (64 << 10)
+
+struct redisContext;
+
+namespace cloris {
+
+struct NearCacheOption {
+    NearCacheOption()
+        : max_bytes(DEFAULT_NEAR_CACHE_MAX_BYTES),
+          max_ttl_ms(DEFAULT_NEAR_CACHE_MAX_TTL_MS),
+          max_value_bytes(DEFAULT_NEAR_CACHE_MAX_VALUE_BYTES) {
+    }
+
+    // memory for keys and values of all entries, least recently used ones go first
+    int64_t max_bytes;
+    // an entry is dropped after it even if no invalidation came, 0 means no limit
+    int64_t max_ttl_ms;
+    // larger values are read but not cached
+    int64_t max_value_bytes;
+    // connections of the cache, with 'protocol' 3 invalidations come as push messages
+    ConnectionPoolOption pool;
+};
+
+struct NearCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t invalidations;     // keys invalidated by the server
+    uint64_t evictions;         // entries dropped for 'max_bytes'
+    uint64_t expirations;       // entries dropped for 'max_ttl_ms'
+    int64_t entries;
+    int64_t bytes;
+};
+
+class RedisNearCache {
+public:
+    RedisNearCache();
+    ~RedisNearCache();
+    bool Init(const std::string& host,
+              const std::string& password = "",
+              int timeout_ms = DEFAULT_TIMEOUT_MS,
+              NearCacheOption* option = NULL,
+              std::string* err_msg = NULL);
+    void Flush();
+
+    // GET 'key' of 'db', from the cache when it's there; nil replies are cached too
+    RedisReply Get(int db, const std::string& key);
+    // drop 'key' of every DB, writes through other clients are invalidated by the server
+    void Invalidate(const std::string& key);
+    void Clear();
+
+    // whether invalidations are being received, reads bypass the cache while not
+    bool tracking() const;
+    NearCacheStats stats() const;
+private:
+    struct Entry;
+    struct Shard;
+    struct Tracking;
+    typedef std::shared_ptr<Tracking> TrackingPtr;
+
+    Shard* ShardOf(const std::string& key) const;
+    // store 'value' unless 'shard' was invalidated since 'epoch'
+    void Insert(Shard* shard, uint64_t epoch, const std::string& cache_key, const RedisReply& value);
+    RedisConnectionImpl* Borrow(RedisConnectionPool* pool, int db);
+    redisContext* Subscribe(int64_t* client_id);
+    void Listen();
+    void OnInvalidate(void* reply);
+    void FreeDrainedTracking();
+
+    ServiceAddress addr_;
+    std::string password_;
+    int timeout_ms_;
+    bool inited_;
+    NearCacheOption option_;
+    std::vector<Shard*> shards_;
+    RedisConnectionPool* pool_;             // untracked, serves reads while tracking is down
+    TrackingPtr tracking_;                  // accessed by std::atomic_load/atomic_store
+    std::vector<TrackingPtr> retired_;      // kept until their connections are returned
+    std::thread listen_thread_;
+    std::atomic<bool> stopping_;
+    std::atomic<uint64_t> hits_;
+    std::atomic<uint64_t> misses_;
+    std::atomic<uint64_t> invalidations_;
+    std::atomic<uint64_t> evictions_;
+    std::atomic<uint64_t> expirations_;
+};
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_NEARCACHE_H_
@@ -12,60 +12,110 @@
 
 namespace cloris {
 
-RedisReply::RedisReply() {
+static inline const char* strerror_r_result(int ret, const char* buf) {
+    return (ret == 0) ? buf : "unknown error";
+}
+
+static inline const char* strerror_r_result(const char* ret, const char*) {
+    return ret;
+}
+
+static RedisReply::ReplyPtr make_reply_ptr(redisReply* rep, bool reclaim) {
+    if (!rep) {
+        return RedisReply::ReplyPtr();
+    } else if (reclaim) {
+        return RedisReply::ReplyPtr(rep, freeReplyObject);
+    } else {
+        // aliasing an empty owner gives a non-owning pointer
+        return RedisReply::ReplyPtr(RedisReply::ReplyPtr(), rep);
+    }
+}
+
+RedisReply::RedisReply() 
+    : err_state_(STATE_ERROR_INVOKE),
+      sys_errno_(0),
+      err_msg_("") {
     cLog(TRACE, "RedisReply constructor..."); 
-    Init(NULL, true, STATE_ERROR_INVOKE, NULL);
 }
 
-RedisReply::RedisReply(RedisReply&& reply) {
+RedisReply::RedisReply(RedisReply&& reply) 
+    : reply_(std::move(reply.reply_)),
+      err_state_(reply.err_state_),
+      sys_errno_(reply.sys_errno_),
+      err_msg_(reply.err_msg_) {
     cLog(TRACE, "RedisReply move constructor..."); 
-    Init(reply.mutable_reply(), reply.reclaim(), reply.err_state(), reply.err_msg());
 }
 
 RedisReply& RedisReply::operator=(RedisReply&& reply) {
     cLog(TRACE, "RedisReply move assignment..."); 
-    RemoveOldState();
-    Init(reply.mutable_reply(), reply.reclaim(), reply.err_state(), reply.err_msg());
+    if (this != &reply) {
+        reply_ = std::move(reply.reply_);
+        err_state_ = reply.err_state_;
+        sys_errno_ = reply.sys_errno_;
+        err_msg_ = reply.err_msg_;
+    }
     return *this;
 }
 
-RedisReply::RedisReply(redisReply* reply, bool reclaim, ERR_STATE state, const char* err_msg) {
+RedisReply::RedisReply(redisReply* reply, bool reclaim, ERR_STATE state, const char* err_msg) 
+    : reply_(make_reply_ptr(reply, reclaim)),
+      err_state_(state),
+      sys_errno_(0),
+      err_msg_(err_msg ? err_msg : "") {
     cLog(TRACE, "RedisReply constructor..."); 
-    Init(reply, reclaim, state, err_msg);
 }
 
-RedisReply::~RedisReply() {
-    cLog(TRACE, "RedisReply destructor..."); 
-    RemoveOldState();
+RedisReply::RedisReply(const ReplyPtr& rep, ERR_STATE state, const char* err_msg, int sys_errno) 
+    : reply_(rep),
+      err_state_(state),
+      sys_errno_(sys_errno),
+      err_msg_(err_msg) {
 }
 
-void RedisReply::RemoveOldState() {
-    if (reply_ && reclaim_) {
-        freeReplyObject(reply_);
-        reply_ = NULL;
-    }
+RedisReply::~RedisReply() {
+    cLog(TRACE, "RedisReply destructor..."); 
 }
 
-void RedisReply::UpdateErrMsg(const char* err_msg) {
-    if (!err_msg) {
-        return;
-    }
-    size_t len = strlen(err_msg);
-    len = (len < sizeof(err_msg_)) ? len : (sizeof(err_msg_) - 1);
-    memcpy(err_msg_, err_msg, len);
-    err_msg_[len + 1] = '\0';
+void RedisReply::Update(redisReply* rep, bool reclaim, ERR_STATE state, const char* err_msg) {
+    reply_ = make_reply_ptr(rep, reclaim);
+    err_state_ = state;
+    sys_errno_ = 0;
+    err_msg_ = err_msg ? err_msg : "";
 }
 
-void RedisReply::Init(redisReply* rep, bool reclaim, ERR_STATE state, const char* err_msg) {
+void RedisReply::Update(const ReplyPtr& rep, ERR_STATE state, const char* err_msg) {
     reply_ = rep;
-    reclaim_ = reclaim;
     err_state_ = state;
-    UpdateErrMsg(err_msg);
+    sys_errno_ = 0;
+    err_msg_ = err_msg ? err_msg : "";
 }
 
-void RedisReply::Update(redisReply* rep, bool reclaim, ERR_STATE state, const char* err_msg) {
-    RemoveOldState();
-    Init(rep, reclaim, state, err_msg);
+void RedisReply::UpdateHiredisError(int err, int sys_errno) {
+    const char* msg = "hiredis error";
+    switch (err) {
+        case REDIS_ERR_IO:
+            msg = "I/O error";
+            break;
+        case REDIS_ERR_EOF:
+            msg = "Server closed the connection";
+            break;
+        case REDIS_ERR_PROTOCOL:
+            msg = "Protocol error";
+            break;
+        case REDIS_ERR_OOM:
+            msg = "Out of memory";
+            break;
+        default:
+            ;
+    }
+    reply_.reset();
+    err_state_ = STATE_ERROR_HIREDIS;
+    sys_errno_ = (err == REDIS_ERR_IO) ? sys_errno : 0;
+    err_msg_ = msg;
+}
+
+RedisReply RedisReply::Share() const {
+    return RedisReply(reply_, err_state_, err_msg_, sys_errno_);
 }
 
 std::string RedisReply::toString() const {
@@ -75,6 +125,9 @@ std::string RedisReply::toString() const {
             case REDIS_REPLY_STRING:
             case REDIS_REPLY_STATUS:
             case REDIS_REPLY_ERROR:
+            case REDIS_REPLY_DOUBLE:
+            case REDIS_REPLY_BIGNUM:
+            case REDIS_REPLY_VERB:
                 value.assign(reply_->str, reply_->len);
                 break;
             default:
@@ -87,7 +140,7 @@ std::string RedisReply::toString() const {
 int32_t RedisReply::toInt32() const {
     int32_t value(0);
     if (reply_) {
-        if (reply_->type == REDIS_REPLY_INTEGER) {
+        if (reply_->type == REDIS_REPLY_INTEGER || reply_->type == REDIS_REPLY_BOOL) {
             value = reply_->integer;
         } else if (reply_->type == REDIS_REPLY_STRING) {
             value = atoi(reply_->str);
@@ -99,7 +152,7 @@ int32_t RedisReply::toInt32() const {
 int64_t RedisReply::toInt64() const {
     int64_t value(-1);
     if (reply_) {
-        if (reply_->type == REDIS_REPLY_INTEGER) {
+        if (reply_->type == REDIS_REPLY_INTEGER || reply_->type == REDIS_REPLY_BOOL) {
             value = reply_->integer;
         } else if (reply_->type == REDIS_REPLY_STRING) {
             value = atol(reply_->str);
@@ -108,6 +161,30 @@ int64_t RedisReply::toInt64() const {
     return value;
 }
 
+double RedisReply::toDouble() const {
+    double value(0);
+    if (reply_) {
+        if (reply_->type == REDIS_REPLY_DOUBLE) {
+            value = reply_->dval;
+        } else if (reply_->type == REDIS_REPLY_INTEGER) {
+            value = reply_->integer;
+        } else if (reply_->type == REDIS_REPLY_STRING) {
+            // RESP2 sends scores and INCRBYFLOAT results as strings
+            value = strtod(reply_->str, NULL);
+        }
+    }
+    return value;
+}
+
+bool RedisReply::toBool() const {
+    if (reply_) {
+        if (reply_->type == REDIS_REPLY_BOOL || reply_->type == REDIS_REPLY_INTEGER) {
+            return reply_->integer != 0;
+        }
+    }
+    return false;
+}
+
 bool RedisReply::error() const {  
     return (!reply_ || (reply_->type == REDIS_REPLY_ERROR));
 }
@@ -116,14 +193,20 @@ bool RedisReply::ok() const {
     return (reply_ && (reply_->type != REDIS_REPLY_ERROR)); 
 }
 
-std::string RedisReply::err_str() const {
-    std::string value("");
+const char* RedisReply::err_msg() const {
     if (reply_) {
-        if (reply_->type == REDIS_REPLY_ERROR) {
-            value = reply_->str;
-        }
-    } else {
-        value = this->err_msg_;
+        return (reply_->type == REDIS_REPLY_ERROR) ? reply_->str : "";
+    } 
+    return err_msg_;
+}
+
+std::string RedisReply::err_str() const {
+    std::string value(this->err_msg());
+    if (!reply_ && sys_errno_) {
+        char buf[128];
+        // XSI-compliant strerror_r under _POSIX_C_SOURCE, GNU one otherwise
+        value += ": ";
+        value += strerror_r_result(strerror_r(sys_errno_, buf, sizeof(buf)), buf);
     }
     return value;
 }
@@ -152,25 +235,57 @@ bool RedisReply::is_array() const {
     return (reply_ && (reply_->type == REDIS_REPLY_ARRAY));
 }
 
+bool RedisReply::is_double() const {
+    return (reply_ && (reply_->type == REDIS_REPLY_DOUBLE));
+}
+
+bool RedisReply::is_bool() const {
+    return (reply_ && (reply_->type == REDIS_REPLY_BOOL));
+}
+
+bool RedisReply::is_bignum() const {
+    return (reply_ && (reply_->type == REDIS_REPLY_BIGNUM));
+}
+
+bool RedisReply::is_verbatim() const {
+    return (reply_ && (reply_->type == REDIS_REPLY_VERB));
+}
+
+bool RedisReply::is_map() const {
+    return (reply_ && (reply_->type == REDIS_REPLY_MAP));
+}
+
+bool RedisReply::is_set() const {
+    return (reply_ && (reply_->type == REDIS_REPLY_SET));
+}
+
+bool RedisReply::is_push() const {
+    return (reply_ && (reply_->type == REDIS_REPLY_PUSH));
+}
+
+std::string RedisReply::verbatim_format() const {
+    return is_verbatim() ? std::string(reply_->vtype) : std::string("");
+}
+
 size_t RedisReply::size() const {
-    if (reply_ && (reply_->type == REDIS_REPLY_ARRAY)) {
+    if (reply_ && redisIsAggregateType(reply_->type)) {
         return reply_->elements;
     } else {
         return 0;
     }
 }
 
-RedisReply RedisReply::get(size_t index) {
+RedisReply RedisReply::get(size_t index) const {
     return (*this)[index];
 }
 
-RedisReply RedisReply::operator[](size_t index) {
-    RedisReply reply;
-    if (!reply_ || (reply_->type != REDIS_REPLY_ARRAY) || (index >= reply_->elements)) {
-        cLog(ERROR, "reply type is not array");
+RedisReply RedisReply::operator[](size_t index) const {
+    if (!reply_ || !redisIsAggregateType(reply_->type) || (index >= reply_->elements)) {
+        cLog(ERROR, "reply type is not aggregate");
         return RedisReply();
     } else {
-        return RedisReply(reply_->element[index], false, STATE_OK, "");
+        // the element shares ownership of the root reply
+        return RedisReply(ReplyPtr(reply_, reply_->element[index]), STATE_OK, "", 0);
     }
 }
 
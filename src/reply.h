@@ -8,8 +8,9 @@
 #ifndef CLORIS_REDIS_REPLY_H_
 #define CLORIS_REDIS_REPLY_H_
 
-#define REDIS_ERRSTR_LEN 256
-
+#include <stdlib.h>
+#include <string>
+#include <memory>
 #include "hiredis/hiredis.h"
 
 namespace cloris {
@@ -22,8 +23,24 @@ enum ERR_STATE {
     STATE_ERROR_INVOKE = 4,
 };
 
+// A RedisReply owns (a share of) the redisReply tree it was created from, so it 
+// stays valid after the connection that produced it has run other commands or 
+// has been put back to the pool. Elements got by 'get' or 'operator[]' keep the 
+// whole tree alive as well. RedisReply is movable but not copyable, use 'Share' 
+// to get another handle to the same reply.
+//
+// Errors are kept as an ERR_STATE plus a pointer to static text (and the errno 
+// of an I/O error), nothing is copied; 'err_str' builds the full message lazily.
+// The 'err_msg' passed to constructor and 'Update' must therefore be static.
+//
+// On a connection speaking RESP3 replies may also be doubles, booleans, big
+// numbers, verbatim strings, maps, sets and push messages. A map is read as its
+// keys and values one after the other, so 'size' and 'operator[]' work alike on
+// all the aggregate types.
 class RedisReply {
 public:
+    typedef std::shared_ptr<redisReply> ReplyPtr;
+
     RedisReply();
     RedisReply(redisReply* reply, bool reclaim, ERR_STATE state, const char* err_msg);
     virtual ~RedisReply();
@@ -33,39 +50,52 @@ public:
     std::string toString() const;
     int32_t toInt32() const;
     int64_t toInt64() const;
+    double toDouble() const;
+    bool toBool() const;
     int type() const;
     bool is_nil() const;
     bool is_string() const;
     bool is_int() const;
     bool is_array() const;
+    bool is_double() const;
+    bool is_bool() const;
+    bool is_bignum() const;
+    bool is_verbatim() const;
+    bool is_map() const;
+    bool is_set() const;
+    bool is_push() const;
+    // format of a verbatim string, like "txt" or "mkd"
+    std::string verbatim_format() const;
+    // elements of any aggregate type, twice the pairs for a map
     size_t size() const;
 
-    RedisReply get(size_t index);
-    RedisReply operator[](size_t index);
-
+    RedisReply get(size_t index) const;
+    RedisReply operator[](size_t index) const;
+    RedisReply Share() const;
 
     RedisReply(RedisReply&&); 
     RedisReply& operator=(RedisReply&&);
 
     std::string err_str() const;
-    const char* err_msg() const { return err_msg_; }
-    redisReply* mutable_reply() { return reply_; }
+    const char* err_msg() const;
+    redisReply* mutable_reply() { return reply_.get(); }
     ERR_STATE err_state() const { return err_state_; }
-    bool reclaim() const { return reclaim_; }
+    bool reclaim() const { return reply_.use_count() > 0; }
 
 protected:
     void Update(redisReply* rep, bool reclaim, ERR_STATE state, const char* err_msg); 
-    redisReply* reply_;
+    void Update(const ReplyPtr& rep, ERR_STATE state, const char* err_msg); 
+    // record an error of hiredis context, 'err' is one of REDIS_ERR_*
+    void UpdateHiredisError(int err, int sys_errno); 
+    ReplyPtr reply_;
     ERR_STATE err_state_;
 private:
     RedisReply(const RedisReply&) = delete; 
     RedisReply& operator=(const RedisReply&) = delete;
-    void UpdateErrMsg(const char* err_msg); 
-    void Init(redisReply* rep, bool reclaim, ERR_STATE state, const char* err_msg); 
-    void RemoveOldState();
+    RedisReply(const ReplyPtr& rep, ERR_STATE state, const char* err_msg, int sys_errno);
 
-    char err_msg_[REDIS_ERRSTR_LEN]; //
-    bool reclaim_;
+    int sys_errno_;       // errno of an I/O error, 0 otherwise
+    const char* err_msg_; // static text, never NULL
 };
 
 } // namespace cloris
@@ -0,0 +1,268 @@
+//
+// cloRedis scan class implementation
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#include <stdlib.h>
+#include <strings.h>
+#include <algorithm>
+#include <mutex>
+#include <thread>
+#include "internal/log.h"
+#include "cluster.h"
+#include "shard.h"
+#include "scan.h"
+
+namespace cloris {
+
+uint64_t ScanSegment::Reverse(uint64_t v) {
+    v = ((v >> 1) & 0x5555555555555555ULL) | ((v & 0x5555555555555555ULL) << 1);
+    v = ((v >> 2) & 0x3333333333333333ULL) | ((v & 0x3333333333333333ULL) << 2);
+    v = ((v >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((v & 0x0F0F0F0F0F0F0F0FULL) << 4);
+    v = ((v >> 8) & 0x00FF00FF00FF00FFULL) | ((v & 0x00FF00FF00FF00FFULL) << 8);
+    v = ((v >> 16) & 0x0000FFFF0000FFFFULL) | ((v & 0x0000FFFF0000FFFFULL) << 16);
+    return (v >> 32) | (v << 32);
+}
+
+ScanSegment ScanSegment::Split(int index, int total) {
+    uint64_t step = ~0ULL / std::max(total, 1);
+    return ScanSegment(step * index, index + 1 >= total ? 0 : step * (index + 1));
+}
+
+RedisScan::RedisScan(RedisConnectionImpl* conn,
+        const std::string& command,
+        const std::string& key,
+        const ScanOption* option,
+        const ScanSegment& segment)
+    : conn_(conn),
+      pairs_(!strcasecmp(command.c_str(), "HSCAN") || !strcasecmp(command.c_str(), "ZSCAN")),
+      last_(segment.last),
+      requested_(false),
+      started_(false),
+      index_(0),
+      page_cnt_(0) {
+    ScanOption default_option;
+    if (!option) {
+        option = &default_option;
+    }
+    args_.push_back(command);
+    if (strcasecmp(command.c_str(), "SCAN")) {
+        args_.push_back(key);
+    }
+    cursor_pos_ = args_.size();
+    args_.push_back("0");
+    if (!option->match.empty()) {
+        args_.push_back("MATCH");
+        args_.push_back(option->match);
+    }
+    args_.push_back("COUNT");
+    args_.push_back(std::to_string(std::max(option->count, 1)));
+    if (!option->type.empty() && cursor_pos_ == 1) {
+        args_.push_back("TYPE");
+        args_.push_back(option->type);
+    }
+    if (!conn_) {
+        Fail(ERR_BAD_CONNECTION);
+        return;
+    }
+    // the first page is on its way before the caller asks for it
+    this->Request(ScanSegment::Reverse(segment.first));
+    cLog(TRACE, "RedisScan constructor ");
+}
+
+RedisScan::RedisScan(RedisScan&& other)
+    : conn_(other.conn_),
+      args_(std::move(other.args_)),
+      cursor_pos_(other.cursor_pos_),
+      pairs_(other.pairs_),
+      last_(other.last_),
+      requested_(other.requested_),
+      started_(other.started_),
+      page_(std::move(other.page_)),
+      index_(other.index_),
+      page_cnt_(other.page_cnt_),
+      err_(std::move(other.err_)) {
+    other.conn_ = NULL;
+    other.requested_ = false;
+}
+
+RedisScan::~RedisScan() {
+    // a page still on its way is read out when the connection goes back to pool
+    RedisConnection conn(conn_);
+}
+
+RedisScan RedisScan::Keys(RedisManager* manager, int db, const ScanOption* option, RedisRole role) {
+    return RedisScan(manager->Get(db, NULL, role), "SCAN", "", option);
+}
+
+RedisScan RedisScan::HScan(RedisManager* manager, int db, const std::string& key, const ScanOption* option) {
+    return RedisScan(manager->Get(db), "HSCAN", key, option);
+}
+
+RedisScan RedisScan::SScan(RedisManager* manager, int db, const std::string& key, const ScanOption* option) {
+    return RedisScan(manager->Get(db), "SSCAN", key, option);
+}
+
+RedisScan RedisScan::ZScan(RedisManager* manager, int db, const std::string& key, const ScanOption* option) {
+    return RedisScan(manager->Get(db), "ZSCAN", key, option);
+}
+
+void RedisScan::Fail(const std::string& err) {
+    err_ = err;
+    requested_ = false;
+    page_.clear();
+    index_ = 0;
+    cLog(ERROR, "scan failed: %s", err.c_str());
+}
+
+bool RedisScan::Request(uint64_t cursor) {
+    args_[cursor_pos_] = std::to_string(cursor);
+    if (!conn_->AppendArgv(args_) || !conn_->Flush()) {
+        Fail(conn_->err_str());
+        return false;
+    }
+    requested_ = true;
+    return true;
+}
+
+// read the page on its way and ask for the next one at once
+bool RedisScan::Fetch() {
+    page_.clear();
+    index_ = 0;
+    if (!requested_) {
+        return false;
+    }
+    requested_ = false;
+    RedisReply reply = conn_->GetReply();
+    if (!reply.ok()) {
+        Fail(reply.err_str());
+        return false;
+    }
+    if (!reply.is_array() || reply.size() != 2 || !reply[1].is_array()) {
+        Fail(ERR_SCAN_REPLY);
+        return false;
+    }
+    uint64_t cursor = strtoull(reply[0].toString().c_str(), NULL, 10);
+    if (cursor != 0 && (last_ == 0 || ScanSegment::Reverse(cursor) < last_)) {
+        this->Request(cursor);
+    }
+    RedisReply items = reply[1];
+    size_t step = pairs_ ? 2 : 1;
+    page_.resize(items.size() / step);
+    for (size_t i = 0; i < page_.size(); ++i) {
+        page_[i].key = items[i * step].toString();
+        if (pairs_) {
+            page_[i].value = items[i * step + 1].toString();
+        }
+    }
+    ++page_cnt_;
+    return true;
+}
+
+RedisScan::iterator RedisScan::begin() {
+    if (!started_) {
+        started_ = true;
+        // pages may be empty under MATCH or TYPE
+        while (page_.empty() && this->Fetch()) { }
+    }
+    return iterator(this);
+}
+
+RedisScan::iterator& RedisScan::iterator::operator++() {
+    if (++scan_->index_ >= scan_->page_.size()) {
+        while (scan_->Fetch() && scan_->page_.empty()) { }
+    }
+    return *this;
+}
+
+bool RedisScan::NextPage(std::vector<ScanEntry>* page) {
+    started_ = true;
+    // the rest of a page partly consumed by an iterator comes first
+    if (index_ < page_.size()) {
+        page->assign(page_.begin() + index_, page_.end());
+        page_.clear();
+        index_ = 0;
+        return true;
+    }
+    while (this->Fetch()) {
+        if (!page_.empty()) {
+            page->swap(page_);
+            page_.clear();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ParallelScan(const std::vector<ScanSource>& sources,
+        int parallelism,
+        const ScanOption* option,
+        const ScanPageHandler& handler,
+        std::string* err_msg) {
+    parallelism = std::min(std::max(parallelism, 1), MAX_SCAN_PARALLELISM);
+    std::mutex mutex;
+    std::string first_err;
+    std::vector<std::thread> threads;
+    for (auto& source : sources) {
+        for (int i = 0; i < parallelism; ++i) {
+            threads.push_back(std::thread([&, i]() {
+                std::string err;
+                RedisScan scan(source(&err), "SCAN", "", option, ScanSegment::Split(i, parallelism));
+                std::vector<ScanEntry> page;
+                while (scan.NextPage(&page)) {
+                    handler(page);
+                }
+                if (!scan.ok()) {
+                    std::lock_guard<std::mutex> lk(mutex);
+                    if (first_err.empty()) {
+                        first_err = err.empty() ? scan.err_str() : err;
+                    }
+                }
+            }));
+        }
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    if (!first_err.empty() && err_msg) {
+        *err_msg = first_err;
+    }
+    return first_err.empty();
+}
+
+bool ParallelScan(RedisManager* manager, int db, int parallelism,
+        const ScanOption* option, const ScanPageHandler& handler,
+        std::string* err_msg, RedisRole role) {
+    std::vector<ScanSource> sources;
+    sources.push_back([manager, db, role](std::string* err) {
+        return manager->Get(db, err, role);
+    });
+    return ParallelScan(sources, parallelism, option, handler, err_msg);
+}
+
+bool ParallelScan(RedisShardedManager* manager, int parallelism,
+        const ScanOption* option, const ScanPageHandler& handler,
+        std::string* err_msg) {
+    std::vector<ScanSource> sources;
+    for (auto& host : manager->shard_hosts()) {
+        sources.push_back([manager, host](std::string* err) {
+            return manager->GetShard(host, err);
+        });
+    }
+    return ParallelScan(sources, parallelism, option, handler, err_msg);
+}
+
+bool ParallelScan(RedisClusterManager* manager,
+        const ScanOption* option, const ScanPageHandler& handler,
+        std::string* err_msg) {
+    std::vector<ScanSource> sources;
+    for (int slot : manager->MasterSlots()) {
+        sources.push_back([manager, slot](std::string* err) {
+            return manager->GetBySlot(slot, err);
+        });
+    }
+    return ParallelScan(sources, 1, option, handler, err_msg);
+}
+
+} // namespace cloris
@@ -0,0 +1,151 @@
+//
+// cloRedis scan class definition
+// RedisScan walks SCAN/HSCAN/SSCAN/ZSCAN as a range of entries, 'for (auto& e : scan)'.
+// The next page is requested as soon as a page arrives, so redis works on it
+// while the caller consumes the current one. ParallelScan splits a keyspace
+// scan over several connections, and over the shards or cluster masters
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#ifndef CLORIS_CLOREDIS_SCAN_H_
+#define CLORIS_CLOREDIS_SCAN_H_
+
+#include <stdint.h>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "cloredis.h"
+
+#define DEFAULT_SCAN_COUNT 1000
+#define MAX_SCAN_PARALLELISM 256
+
+#define ERR_SCAN_REPLY "bad SCAN reply"
+
+namespace cloris {
+
+class RedisShardedManager;
+class RedisClusterManager;
+
+struct ScanOption {
+    ScanOption() : count(DEFAULT_SCAN_COUNT) { }
+
+    std::string match;      // MATCH pattern, empty for all
+    int count;              // COUNT, the work redis does per page
+    std::string type;       // TYPE filter, SCAN only
+};
+
+// a key, a set member, or a hash field/sorted set member with its value/score
+struct ScanEntry {
+    std::string key;
+    std::string value;      // HSCAN and ZSCAN only
+};
+
+// Part of the cursor space of a SCAN. Redis walks its table in the order of
+// the bit-reversed cursor, so a scan started at cursor 'Reverse(first)' and
+// stopped at 'Reverse(last)' gets every key of the buckets in between. 'last'
+// 0 means up to the end
+struct ScanSegment {
+    ScanSegment() : first(0), last(0) { }
+    ScanSegment(uint64_t f, uint64_t l) : first(f), last(l) { }
+
+    // segment 'index' of 'total' equal ones
+    static ScanSegment Split(int index, int total);
+    static uint64_t Reverse(uint64_t v);
+
+    uint64_t first;
+    uint64_t last;
+};
+
+class RedisScan {
+public:
+    // single pass, the entry given stays valid until the iterator moves
+    class iterator : public std::iterator<std::input_iterator_tag, ScanEntry> {
+    public:
+        iterator() : scan_(NULL) { }
+        explicit iterator(RedisScan* scan) : scan_(scan) { }
+        const ScanEntry& operator*() const { return scan_->page_[scan_->index_]; }
+        const ScanEntry* operator->() const { return &scan_->page_[scan_->index_]; }
+        iterator& operator++();
+        bool operator==(const iterator& other) const { return done() == other.done(); }
+        bool operator!=(const iterator& other) const { return done() != other.done(); }
+    private:
+        bool done() const { return !scan_ || scan_->index_ >= scan_->page_.size(); }
+        RedisScan* scan_;
+    };
+
+    // 'command' is SCAN, or HSCAN/SSCAN/ZSCAN of 'key'. The scan takes 'conn'
+    // and gives it back to pool when destructed; a NULL 'conn' is a failed scan
+    RedisScan(RedisConnectionImpl* conn,
+              const std::string& command,
+              const std::string& key = "",
+              const ScanOption* option = NULL,
+              const ScanSegment& segment = ScanSegment());
+    ~RedisScan();
+    RedisScan(RedisScan&& other);
+
+    static RedisScan Keys(RedisManager* manager, int db, const ScanOption* option = NULL, RedisRole role = MASTER);
+    static RedisScan HScan(RedisManager* manager, int db, const std::string& key, const ScanOption* option = NULL);
+    static RedisScan SScan(RedisManager* manager, int db, const std::string& key, const ScanOption* option = NULL);
+    static RedisScan ZScan(RedisManager* manager, int db, const std::string& key, const ScanOption* option = NULL);
+
+    iterator begin();
+    iterator end() { return iterator(); }
+    // the whole next page, false at the end or on error
+    bool NextPage(std::vector<ScanEntry>* page);
+
+    // false if the scan stopped on an error, check it after the loop
+    bool ok() const { return err_.empty(); }
+    const std::string& err_str() const { return err_; }
+    uint64_t page_cnt() const { return page_cnt_; }
+private:
+    bool Request(uint64_t cursor);
+    bool Fetch();
+    void Fail(const std::string& err);
+
+    RedisConnectionImpl* conn_;
+    std::vector<std::string> args_;     // the command with the cursor at 'cursor_pos_'
+    size_t cursor_pos_;
+    bool pairs_;
+    uint64_t last_;
+    bool requested_;                    // a page is on its way
+    bool started_;
+    std::vector<ScanEntry> page_;
+    size_t index_;
+    uint64_t page_cnt_;
+    std::string err_;
+
+    RedisScan(const RedisScan&) = delete;
+    RedisScan& operator=(const RedisScan&) = delete;
+    RedisScan& operator=(RedisScan&&) = delete;
+};
+
+// gives a connection to scan, NULL with 'err_msg' if none
+typedef std::function<RedisConnectionImpl*(std::string* err_msg)> ScanSource;
+// called for every page, from the scanning threads at the same time
+typedef std::function<void(const std::vector<ScanEntry>& page)> ScanPageHandler;
+
+// Keyspace scan of every source, each one split in 'parallelism' segments scanned
+// by their own connection and thread. As with SCAN, a key may be given more than
+// once. False if any segment failed, the others are scanned to the end
+bool ParallelScan(const std::vector<ScanSource>& sources,
+                  int parallelism,
+                  const ScanOption* option,
+                  const ScanPageHandler& handler,
+                  std::string* err_msg = NULL);
+bool ParallelScan(RedisManager* manager, int db, int parallelism,
+                  const ScanOption* option, const ScanPageHandler& handler,
+                  std::string* err_msg = NULL, RedisRole role = MASTER);
+bool ParallelScan(RedisShardedManager* manager, int parallelism,
+                  const ScanOption* option, const ScanPageHandler& handler,
+                  std::string* err_msg = NULL);
+// one connection per master: cursors of a cluster node carry the slot in
+// their low bits, so they can't be split
+bool ParallelScan(RedisClusterManager* manager,
+                  const ScanOption* option, const ScanPageHandler& handler,
+                  std::string* err_msg = NULL);
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_SCAN_H_
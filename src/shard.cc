@@ -0,0 +1,381 @@
+//
+// cloRedis sharded manager class implementation
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#include <algorithm>
+#include "internal/log.h"
+#include "shard.h"
+
+namespace cloris {
+
+struct RedisShardedManager::Shard {
+    ServiceAddress addr;
+    int weight;
+    RedisConnectionPool* pool;
+
+    ~Shard() { delete pool; }
+};
+
+struct RedisShardedManager::Ring {
+    std::vector<std::pair<uint32_t, Shard*> > points;  // sorted by hash
+    std::vector<ShardPtr> shards;                       // keeps the shards alive
+};
+
+// FNV-1a folded by the murmur3 finalizer, good enough spread for ring points
+static uint32_t ring_hash(const char* data, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        h ^= (uint8_t)data[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return (uint32_t)(h >> 32);
+}
+
+RedisShardedManager::RedisShardedManager()
+    : timeout_ms_(DEFAULT_TIMEOUT_MS),
+      inited_(false),
+      hash_tag_(false) {
+    cLog(TRACE, "RedisShardedManager constructor ");
+}
+
+RedisShardedManager::~RedisShardedManager() {
+    std::atomic_store(&ring_, RingPtr());
+    shards_.clear();
+    retired_.clear();
+    cLog(TRACE, "RedisShardedManager ~ destructor");
+}
+
+bool RedisShardedManager::Init(const std::string& hosts,
+             const std::string& password,
+             int timeout_ms,
+             ConnectionPoolOption* option,
+             std::string* err_msg) {
+    if (inited_) {
+        cLog(ERROR, ERR_REENTERING);
+        if (err_msg) {
+            *err_msg = ERR_REENTERING;
+        }
+        return false;
+    }
+    std::vector<ServiceAddress> address_vec = parse_address_vector(hosts);
+    if (address_vec.empty()) {
+        cLog(ERROR, ERR_BAD_HOST);
+        if (err_msg) {
+            *err_msg = ERR_BAD_HOST;
+        }
+        return false;
+    }
+    inited_ = true;
+    if (option) {
+        option_ = *option;
+    }
+    password_ = password;
+    timeout_ms_ = timeout_ms;
+
+    for (auto& addr : address_vec) {
+        if (!AddShard(addr.full_host, 1, err_msg)) {
+            return false;
+        }
+    }
+    std::lock_guard<std::mutex> lk(mutex_);
+    for (auto& item : shards_) {
+        RedisConnection conn = item.second->pool->Get(err_msg);
+        if (!conn) {
+            cLog(ERROR, "connect to shard %s failed", item.first.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RedisShardedManager::AddShard(const std::string& host, int weight, std::string* err_msg) {
+    std::vector<ServiceAddress> address_vec = parse_address_vector(host);
+    if (address_vec.size() != 1) {
+        if (err_msg) {
+            *err_msg = ERR_BAD_HOST;
+        }
+        return false;
+    }
+    if (weight < 1 || weight > SHARD_MAX_WEIGHT) {
+        if (err_msg) {
+            *err_msg = ERR_SHARD_WEIGHT;
+        }
+        return false;
+    }
+    std::lock_guard<std::mutex> lk(mutex_);
+    const ServiceAddress& addr = address_vec[0];
+    if (shards_.find(addr.full_host) != shards_.end()) {
+        if (err_msg) {
+            *err_msg = ERR_SHARD_EXISTS;
+        }
+        return false;
+    }
+    ShardPtr shard = std::make_shared<Shard>();
+    shard->addr = addr;
+    shard->weight = weight;
+    RedisConnectionPool::InitHandler handler = std::bind(&RedisConnectionImpl::Init, std::placeholders::_1,
+            addr.host,
+            addr.port,
+            password_,
+            timeout_ms_,
+            DEFAULT_DB);
+    shard->pool = new RedisConnectionPool(&option_, handler);
+    shards_[addr.full_host] = shard;
+    Rebuild();
+    FreeDrainedShard();
+    cLog(INFO, "shard %s added with weight %d", addr.full_host.c_str(), weight);
+    return true;
+}
+
+bool RedisShardedManager::RemoveShard(const std::string& host, std::string* err_msg) {
+    std::vector<ServiceAddress> address_vec = parse_address_vector(host);
+    if (address_vec.size() != 1) {
+        if (err_msg) {
+            *err_msg = ERR_BAD_HOST;
+        }
+        return false;
+    }
+    std::lock_guard<std::mutex> lk(mutex_);
+    auto iter = shards_.find(address_vec[0].full_host);
+    if (iter == shards_.end()) {
+        if (err_msg) {
+            *err_msg = ERR_SHARD_UNKNOWN;
+        }
+        return false;
+    }
+    retired_.push_back(iter->second);
+    shards_.erase(iter);
+    Rebuild();
+    FreeDrainedShard();
+    cLog(INFO, "shard %s removed", address_vec[0].full_host.c_str());
+    return true;
+}
+
+// called with 'mutex_' held
+void RedisShardedManager::Rebuild() {
+    std::shared_ptr<Ring> ring = std::make_shared<Ring>();
+    for (auto& item : shards_) {
+        Shard* shard = item.second.get();
+        ring->shards.push_back(item.second);
+        int points = SHARD_VNODES * shard->weight;
+        for (int i = 0; i < points; ++i) {
+            std::string point = shard->addr.full_host + "-" + std::to_string(i);
+            ring->points.push_back(std::make_pair(ring_hash(point.data(), point.size()), shard));
+        }
+    }
+    std::sort(ring->points.begin(), ring->points.end());
+    std::atomic_store(&ring_, RingPtr(ring));
+}
+
+// called with 'mutex_' held
+void RedisShardedManager::FreeDrainedShard() {
+    for (auto iter = retired_.begin(); iter != retired_.end(); ) {
+        // no ring refers to it any more, so no connection can be borrowed from it
+        RedisConnectionPool* pool = (*iter)->pool;
+        if (iter->use_count() == 1 && pool->active_cnt() == pool->conn_in_pool()) {
+            iter = retired_.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+uint32_t RedisShardedManager::KeyHash(const std::string& key) const {
+    const char* data = key.data();
+    size_t len = key.size();
+    if (hash_tag_) {
+        key_hash_tag(&data, &len);
+    }
+    return ring_hash(data, len);
+}
+
+RedisShardedManager::Shard* RedisShardedManager::Locate(const Ring* ring, const std::string& key) const {
+    if (!ring || ring->points.empty()) {
+        return NULL;
+    }
+    std::pair<uint32_t, Shard*> point(KeyHash(key), NULL);
+    auto iter = std::lower_bound(ring->points.begin(), ring->points.end(), point);
+    return (iter == ring->points.end()) ? ring->points.front().second : iter->second;
+}
+
+RedisConnectionImpl* RedisShardedManager::Get(const std::string& key, std::string* err_msg) {
+    RingPtr ring = std::atomic_load(&ring_);
+    Shard* shard = Locate(ring.get(), key);
+    if (!shard) {
+        if (err_msg) {
+            *err_msg = ERR_SHARD_NONE;
+        }
+        return NULL;
+    }
+    return shard->pool->Get(err_msg);
+}
+
+ServiceAddress RedisShardedManager::ShardOf(const std::string& key) {
+    RingPtr ring = std::atomic_load(&ring_);
+    Shard* shard = Locate(ring.get(), key);
+    return shard ? shard->addr : ServiceAddress();
+}
+
+std::vector<std::string> RedisShardedManager::shard_hosts() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    std::vector<std::string> hosts;
+    for (auto& item : shards_) {
+        hosts.push_back(item.first);
+    }
+    return hosts;
+}
+
+RedisConnectionImpl* RedisShardedManager::GetShard(const std::string& host, std::string* err_msg) {
+    ShardPtr shard;
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        auto iter = shards_.find(host);
+        if (iter != shards_.end()) {
+            shard = iter->second;
+        }
+    }
+    if (!shard) {
+        if (err_msg) {
+            *err_msg = ERR_SHARD_UNKNOWN;
+        }
+        return NULL;
+    }
+    return shard->pool->Get(err_msg);
+}
+
+RedisReply RedisShardedManager::Do(const std::string& key, const char* format, ...) {
+    RedisConnection conn = Get(key);
+    if (!conn) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    va_list ap;
+    va_start(ap, format);
+    RedisReply reply = conn->DoV(format, ap);
+    va_end(ap);
+    return reply;
+}
+
+RedisReply RedisShardedManager::DoArgv(const std::vector<std::string>& args, size_t key_index) {
+    RedisConnection conn = Get((key_index < args.size()) ? args[key_index] : "");
+    if (!conn) {
+        return RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION);
+    }
+    return conn->DoArgv(args);
+}
+
+std::vector<RedisReply> RedisShardedManager::RunByShard(const std::string& command,
+        const std::vector<std::string>& keys,
+        const std::vector<std::string>* values,
+        std::vector<std::vector<size_t> >* positions) {
+    RingPtr ring = std::atomic_load(&ring_);
+    std::map<Shard*, size_t> shard_index;
+    std::vector<Shard*> shards;
+    std::vector<std::vector<std::string> > commands;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        Shard* shard = Locate(ring.get(), keys[i]);
+        auto iter = shard_index.find(shard);
+        if (iter == shard_index.end()) {
+            iter = shard_index.insert(std::make_pair(shard, shards.size())).first;
+            shards.push_back(shard);
+            commands.push_back(std::vector<std::string>(1, command));
+            positions->emplace_back();
+        }
+        commands[iter->second].push_back(keys[i]);
+        if (values) {
+            commands[iter->second].push_back((*values)[i]);
+        }
+        (*positions)[iter->second].push_back(i);
+    }
+
+    std::vector<RedisConnection> conns;
+    std::vector<bool> sent(shards.size(), false);
+    conns.reserve(shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        conns.emplace_back(shards[i] ? shards[i]->pool->Get() : NULL);
+        if (conns[i]) {
+            sent[i] = conns[i]->AppendArgv(commands[i]) && conns[i]->Flush();
+        }
+    }
+    std::vector<RedisReply> replies;
+    replies.reserve(shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        if (!shards[i]) {
+            replies.push_back(RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_SHARD_NONE));
+        } else if (!conns[i]) {
+            replies.push_back(RedisReply(NULL, true, STATE_ERROR_INVOKE, ERR_BAD_CONNECTION));
+        } else if (!sent[i]) {
+            // the command never got out, the shard gets the error of the connection
+            replies.push_back(conns[i]->Share());
+        } else {
+            replies.push_back(conns[i]->GetReply());
+        }
+    }
+    return replies;
+}
+
+std::vector<RedisReply> RedisShardedManager::MGet(const std::vector<std::string>& keys) {
+    std::vector<std::vector<size_t> > positions;
+    std::vector<RedisReply> shard_replies = RunByShard("MGET", keys, NULL, &positions);
+    std::vector<RedisReply> replies(keys.size());
+    for (size_t i = 0; i < shard_replies.size(); ++i) {
+        const RedisReply& reply = shard_replies[i];
+        bool ok = reply.is_array() && reply.size() == positions[i].size();
+        for (size_t j = 0; j < positions[i].size(); ++j) {
+            // elements share the MGET reply, an error is shared by all its keys
+            replies[positions[i][j]] = ok ? reply.get(j) : reply.Share();
+        }
+    }
+    return replies;
+}
+
+bool RedisShardedManager::MSet(const std::vector<std::string>& keys, const std::vector<std::string>& values, std::string* err_msg) {
+    if (keys.size() != values.size()) {
+        if (err_msg) {
+            *err_msg = ERR_BATCH_SIZE;
+        }
+        return false;
+    }
+    std::vector<std::vector<size_t> > positions;
+    std::vector<RedisReply> replies = RunByShard("MSET", keys, &values, &positions);
+    for (auto& reply : replies) {
+        if (reply.error()) {
+            if (err_msg) {
+                *err_msg = reply.err_str();
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+int RedisShardedManager::shard_cnt() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    return shards_.size();
+}
+
+int RedisShardedManager::ActiveConnectionCount() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    int count = 0;
+    for (auto& item : shards_) {
+        count += item.second->pool->active_cnt();
+    }
+    return count;
+}
+
+int RedisShardedManager::ConnectionInPool() {
+    std::lock_guard<std::mutex> lk(mutex_);
+    int count = 0;
+    for (auto& item : shards_) {
+        count += item.second->pool->conn_in_pool();
+    }
+    return count;
+}
+
+} // namespace cloris
@@ -0,0 +1,95 @@
+//
+// cloRedis sharded manager class definition
+// RedisShardedManager spreads keys over independent masters by consistent
+// hashing: every shard owns 'SHARD_VNODES * weight' points on a hash ring and
+// a key goes to the first point following its hash, so adding or removing a
+// shard only moves the keys of that shard
+// version: 1.0
+// Copyright (C) 2018 James Wei (weijianlhp@163.com). All rights reserved
+//
+
+#ifndef CLORIS_CLOREDIS_SHARD_H_
+#define CLORIS_CLOREDIS_SHARD_H_
+
+#include <stdarg.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "cloredis.h"
+
+#define SHARD_VNODES 160
+#define SHARD_MAX_WEIGHT 100
+
+#define ERR_SHARD_NONE      "no shard available"
+#define ERR_SHARD_EXISTS    "shard already exists"
+#define ERR_SHARD_UNKNOWN   "no such shard"
+#define ERR_SHARD_WEIGHT    "shard weight out of range"
+
+namespace cloris {
+
+class RedisShardedManager {
+public:
+    RedisShardedManager();
+    ~RedisShardedManager();
+    // 'hosts' is a comma separated list of masters, all with weight 1
+    bool Init(const std::string& hosts,
+              const std::string& password = "",
+              int timeout_ms = DEFAULT_TIMEOUT_MS,
+              ConnectionPoolOption* option = NULL,
+              std::string* err_msg = NULL);
+    // keys with the same '{tag}' go to the same shard, off by default
+    void EnableHashTag(bool enable) { hash_tag_ = enable; }
+    // shards can be added or removed at any time, pools of the other shards are
+    // kept, and connections borrowed from a removed shard stay usable
+    bool AddShard(const std::string& host, int weight = 1, std::string* err_msg = NULL);
+    bool RemoveShard(const std::string& host, std::string* err_msg = NULL);
+
+    RedisConnectionImpl* Get(const std::string& key, std::string* err_msg = NULL);
+    ServiceAddress ShardOf(const std::string& key);
+    // every shard by its host, to walk all of them like a keyspace scan does
+    std::vector<std::string> shard_hosts();
+    RedisConnectionImpl* GetShard(const std::string& host, std::string* err_msg = NULL);
+
+    RedisReply Do(const std::string& key, const char* format, ...);
+    RedisReply DoArgv(const std::vector<std::string>& args, size_t key_index = 1);
+    // one MGET/MSET per shard, all sent before any reply is read
+    std::vector<RedisReply> MGet(const std::vector<std::string>& keys);
+    bool MSet(const std::vector<std::string>& keys, const std::vector<std::string>& values, std::string* err_msg = NULL);
+
+    int shard_cnt();
+    int ActiveConnectionCount();
+    int ConnectionInPool();
+    int ConnectionInUse() { return ActiveConnectionCount() - ConnectionInPool(); }
+private:
+    struct Shard;
+    struct Ring;
+    typedef std::shared_ptr<Shard> ShardPtr;
+    typedef std::shared_ptr<const Ring> RingPtr;
+
+    uint32_t KeyHash(const std::string& key) const;
+    Shard* Locate(const Ring* ring, const std::string& key) const;
+    void Rebuild();
+    void FreeDrainedShard();
+    // run one command per shard made of 'command' and the keys (and values) the
+    // shard owns, every pipeline is sent before any reply is read; 'positions'
+    // gets the indexes of the keys each command covers
+    std::vector<RedisReply> RunByShard(const std::string& command,
+            const std::vector<std::string>& keys,
+            const std::vector<std::string>* values,
+            std::vector<std::vector<size_t> >* positions);
+
+    ConnectionPoolOption option_;
+    std::string password_;
+    int timeout_ms_;
+    bool inited_;
+    bool hash_tag_;
+    std::map<std::string, ShardPtr> shards_;
+    std::vector<ShardPtr> retired_;     // removed, kept until their connections are returned
+    std::mutex mutex_;                  // protects 'shards_' and 'retired_'
+    RingPtr ring_;                      // accessed by std::atomic_load/atomic_store
+};
+
+} // namespace cloris
+
+#endif // CLORIS_CLOREDIS_SHARD_H_
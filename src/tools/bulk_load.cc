@@ -0,0 +1,78 @@
+//
+// Mass insertion into redis from a file, like 'redis-cli --pipe' but from
+// tab separated commands, one per line
+//
+// usage: bulk_load [-h host] [-a password] [-n db] [-D] [-c connections]
+//                  [-p pipeline_depth] [-b buffer_bytes] [file]
+//   -D    the first field of each line is the DB of the line
+//   reads stdin without 'file', e.g.
+//   printf 'SET\tkey1\tvalue1\nHSET\th1\tf1\tv1\n' | bulk_load -h 127.0.0.1:6379
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include "bulkloader.h"
+
+using namespace cloris;
+
+static void Usage(const char* name) {
+    std::cerr << "usage: " << name << " [-h host] [-a password] [-n db] [-D] [-c connections]"
+              << " [-p pipeline_depth] [-b buffer_bytes] [file]" << std::endl;
+}
+
+static void Report(const BulkLoadStats& stats) {
+    std::cerr << "records " << stats.records
+              << "  replies " << stats.replies
+              << "  errors " << stats.errors
+              << "  " << stats.bytes / (1 << 20) << " MB"
+              << "  " << (int64_t)stats.records_per_sec() << " records/s"
+              << "  " << stats.elapsed_ms / 1000.0 << " s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string host = "127.0.0.1:6379";
+    std::string password;
+    int db = DEFAULT_DB;
+    bool db_column = false;
+    BulkLoadOption option;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:a:n:Dc:p:b:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'a': password = optarg; break;
+            case 'n': db = atoi(optarg); break;
+            case 'D': db_column = true; break;
+            case 'c': option.connections = atoi(optarg); break;
+            case 'p': option.pipeline_depth = atoi(optarg); break;
+            case 'b': option.buffer_bytes = atoll(optarg); break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    FILE* file = stdin;
+    if (optind < argc && !(file = fopen(argv[optind], "r"))) {
+        perror(argv[optind]);
+        return 1;
+    }
+    option.progress = Report;
+
+    RedisBulkLoader loader;
+    std::string err;
+    if (!loader.Init(host, password, 5000, &option, &err)) {
+        std::cerr << "init " << host << " failed: " << err << std::endl;
+        return 1;
+    }
+    BulkLoadStats stats;
+    bool ok = loader.Load(bulk_file_source(file, db, db_column), &stats, &err);
+    if (file != stdin) {
+        fclose(file);
+    }
+    if (!ok) {
+        std::cerr << "load failed: " << err << std::endl;
+    }
+    return (ok && stats.errors == 0) ? 0 : 2;
+}
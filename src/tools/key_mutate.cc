@@ -0,0 +1,103 @@
+//
+// Unlink, expire or persist every key matching a pattern, batch by batch and
+// within a rate limit, so that a key family can go without a blocking KEYS
+//
+// usage: key_mutate [-h host] [-a password] [-n db] [-b batch_size] [-c concurrency]
+//                   [-r max_keys_per_sec] [-t type] unlink|expire <ttl_ms>|persist pattern
+//   e.g. key_mutate -h 127.0.0.1:6379 -r 20000 unlink 'session:*'
+//
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <iostream>
+#include <string>
+#include "mutator.h"
+
+using namespace cloris;
+
+static void Usage(const char* name) {
+    std::cerr << "usage: " << name << " [-h host] [-a password] [-n db] [-b batch_size] [-c concurrency]"
+              << " [-r max_keys_per_sec] [-t type] unlink|expire <ttl_ms>|persist pattern" << std::endl;
+}
+
+static void Report(const MutateStats& stats) {
+    std::cerr << "scanned " << stats.scanned
+              << "  changed " << stats.changed
+              << "  unchanged " << stats.unchanged
+              << "  failed " << stats.failed
+              << "  " << (int64_t)stats.keys_per_sec() << " keys/s"
+              << "  " << stats.elapsed_ms / 1000.0 << " s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string host = "127.0.0.1:6379";
+    std::string password;
+    int db = DEFAULT_DB;
+    MutateOption option;
+    int opt;
+    while ((opt = getopt(argc, argv, "h:a:n:b:c:r:t:")) != -1) {
+        switch (opt) {
+            case 'h': host = optarg; break;
+            case 'a': password = optarg; break;
+            case 'n': db = atoi(optarg); break;
+            case 'b': option.batch_size = atoi(optarg); break;
+            case 'c': option.concurrency = atoi(optarg); break;
+            case 'r': option.max_keys_per_sec = atoll(optarg); break;
+            case 't': option.scan.type = optarg; break;
+            default:
+                Usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        Usage(argv[0]);
+        return 1;
+    }
+    std::string action = argv[optind++];
+    int64_t ttl_ms = 0;
+    if (action == "expire") {
+        if (optind >= argc) {
+            Usage(argv[0]);
+            return 1;
+        }
+        // a typo like '10s' must not become TTL 0, which deletes the keys
+        char* end = NULL;
+        ttl_ms = strtoll(argv[optind], &end, 10);
+        if (end == argv[optind] || *end != '\0' || ttl_ms <= 0) {
+            std::cerr << "bad ttl_ms '" << argv[optind] << "', a positive number of milliseconds" << std::endl;
+            return 1;
+        }
+        ++optind;
+    } else if (action != "unlink" && action != "persist") {
+        Usage(argv[0]);
+        return 1;
+    }
+    if (optind >= argc) {
+        Usage(argv[0]);
+        return 1;
+    }
+    option.scan.match = argv[optind];
+    option.progress = Report;
+
+    RedisManager manager;
+    std::string err;
+    if (!manager.Init(host, password, 5000, NULL, &err)) {
+        std::cerr << "init " << host << " failed: " << err << std::endl;
+        return 1;
+    }
+    RedisKeyMutator mutator(&manager, db, &option);
+    MutateStats stats;
+    bool ok = false;
+    if (action == "unlink") {
+        ok = mutator.Unlink(&stats, &err);
+    } else if (action == "expire") {
+        ok = mutator.Expire(ttl_ms, &stats, &err);
+    } else {
+        ok = mutator.Persist(&stats, &err);
+    }
+    Report(stats);
+    if (!ok) {
+        std::cerr << action << " failed" << (err.empty() ? "" : ": " + err) << std::endl;
+    }
+    return ok ? 0 : 2;
+}